@@ -1,5 +1,44 @@
 #!/bin/bash
 
-g++ -o test1 test1.cc cputrace.cc
-g++ test2.cc cputrace.cc -o test2 -lpthread
-g++ test3.cc cputrace.cc -o test3 -lpthread
+# libcputrace: the profiling core, built once and linked by every test
+g++ -O2 -g -fPIC -c cputrace.cc -o cputrace.o
+g++ -O2 -g -fPIC -c cputrace_symbols.cc -o cputrace_symbols.o
+g++ -O2 -g -fPIC -c cputrace_auto.cc -o cputrace_auto.o
+g++ -O2 -g -fPIC -c cputrace_control.cc -o cputrace_control.o
+ar rcs libcputrace.a cputrace.o cputrace_symbols.o cputrace_auto.o cputrace_control.o
+g++ -shared -o libcputrace.so cputrace.o cputrace_symbols.o cputrace_auto.o cputrace_control.o -lpthread
+# Allocation interposer, kept out of the library: linking it is the opt-in
+g++ -O2 -g -fPIC -c cputrace_alloc.cc -o cputrace_alloc.o
+# Lock wait interposer, likewise linked only by programs that want it
+g++ -O2 -g -fPIC -c cputrace_lock.cc -o cputrace_lock.o
+
+g++ -o test1 test1.cc libcputrace.a
+g++ test2.cc libcputrace.a -o test2 -lpthread
+g++ test3.cc libcputrace.a -o test3 -lpthread
+g++ test4.cc libcputrace.a -o test4 -lpthread
+g++ test5.cc libcputrace.a -o test5 -lpthread
+g++ test6.cc libcputrace.a -o test6 -lpthread
+g++ test7.cc libcputrace.a -o test7 -lpthread
+g++ test8.cc libcputrace.a -o test8 -lpthread
+# Ceph adapter, built against the stub Formatter
+g++ -std=c++17 -Istub test9.cc cputrace_ceph.cc libcputrace.a -o test9 -lpthread
+# Auto-instrumentation: the hooks come from libcputrace
+g++ -finstrument-functions test10.cc libcputrace.a -o test10 -lpthread
+g++ test11.cc libcputrace.a -o test11 -lpthread
+g++ test12.cc libcputrace.a -o test12 -lpthread
+g++ test13.cc libcputrace.a -o test13 -lpthread
+g++ test14.cc libcputrace.a -o test14 -lpthread
+g++ test15.cc libcputrace.a -o test15 -lpthread
+g++ test16.cc cputrace_alloc.o libcputrace.a -o test16 -lpthread
+g++ test17.cc cputrace_lock.o libcputrace.a -o test17 -lpthread
+g++ test18.cc libcputrace.a -o test18 -lpthread
+g++ test19.cc libcputrace.a -o test19 -lpthread
+g++ test20.cc libcputrace.a -o test20 -lpthread
+g++ test21.cc libcputrace.a -o test21 -lpthread
+g++ test22.cc libcputrace.a -o test22 -lpthread
+g++ test23.cc libcputrace.a -o test23 -lpthread
+g++ test24.cc libcputrace.a -o test24 -lpthread
+g++ test25.cc libcputrace.a -o test25 -lpthread
+g++ -O2 cputrace_diff.cc -o cputrace_diff
+g++ -O2 cputrace_top.cc -o cputrace_top
+g++ -O2 cputrace_merge.cc -o cputrace_merge
@@ -4,16 +4,34 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <linux/perf_event.h>
 #include <asm/unistd.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <time.h>
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include "cputrace.h"
+#include "cputrace_symbols.h"
+#include "cputrace_shm.h"
+#include "cputrace_snapshot.h"
 
 // Global profiler instance
 static struct cputrace_profiler g_profiler;
 
+// Thread identity for the per-thread breakdown
+static struct cputrace_thread_info g_threads[CPUTRACE_MAX_THREADS];
+static int g_thread_count;
+
+static void cputrace_probe(void);
+
 static void initialize_profiler() {
     struct Arena* profiler_arena = arena_create(sizeof(struct cputrace_anchor) * CPUTRACE_MAX_ANCHORS, true);
     if (!profiler_arena) {
@@ -26,7 +44,8 @@ static void initialize_profiler() {
         arena_destroy(profiler_arena);
         exit(1);
     }
-    memset(g_profiler.anchors, 0, sizeof(struct cputrace_anchor) * CPUTRACE_MAX_ANCHORS);
+    // The arena is a fresh anonymous mapping, already zero: anchors that are
+    // never used only cost the page holding their mutex
     for (uint64_t i = 0; i < CPUTRACE_MAX_ANCHORS; i++) {
         pthread_mutex_init(&g_profiler.anchors[i].mutex, NULL);
         g_profiler.anchors[i].results_arena = arena_create(20 * 1024 * 1024, false);
@@ -42,8 +61,10 @@ static void initialize_profiler() {
             exit(1);
         }
     }
+    snprintf(g_threads[CPUTRACE_MAX_THREADS - 1].name, sizeof(g_threads[0].name), "(other)");
     g_profiler.profiling = false; // Start with profiling disabled
     pthread_mutex_init(&g_profiler.file_mutex, NULL);
+    cputrace_probe();
 }
 
 // Static variable to trigger initialization
@@ -51,561 +72,4385 @@ static struct ProfilerInitializer {
     ProfilerInitializer() { initialize_profiler(); }
 } profiler_initializer;
 
+// Errors on per-scope paths print at most once per interval and call site,
+// with a count of what was suppressed in between.
+#define CPUTRACE_LOG_INTERVAL_NS (10ULL * 1000000000ULL)
+
+struct cputrace_ratelimit {
+    uint64_t next_ns;
+    uint64_t suppressed;
+};
+
+static void log_ratelimited(struct cputrace_ratelimit* rl, const char* fmt, ...) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    uint64_t next = __atomic_load_n(&rl->next_ns, __ATOMIC_RELAXED);
+    if (now < next || !__atomic_compare_exchange_n(&rl->next_ns, &next, now + CPUTRACE_LOG_INTERVAL_NS,
+                                                   false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    uint64_t suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed) {
+        fprintf(stderr, "cputrace: %" PRIu64 " similar messages suppressed\n", suppressed);
+    }
+}
+
+#define log_limited(...)                                  \
+    do {                                                  \
+        static struct cputrace_ratelimit log_rl_;         \
+        log_ratelimited(&log_rl_, __VA_ARGS__);           \
+    } while (0)
+
 static long perf_event_open(struct perf_event_attr* hw_event, pid_t pid,
                            int cpu, int group_fd, unsigned long flags) {
     long fd = syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
     if (fd == -1) {
-        fprintf(stderr, "%s: failed: %s (errno=%d)\n", __func__, strerror(errno), errno);
+        log_limited("%s: failed: %s (errno=%d)\n", __func__, strerror(errno), errno);
     }
     return fd;
 }
 
-void HW_init(struct HW_ctx* ctx, struct HW_conf* conf) {
-    ctx->fd_swi = -1;
-    ctx->fd_cyc = -1;
-    ctx->fd_cmiss = -1;
-    ctx->fd_bmiss = -1;
-    ctx->fd_ins = -1;
-    ctx->conf = *conf;
+// Pseudo event types for metrics that are not a perf counter: read from a
+// clock, or accumulated from context switch records
+#define HW_EVENT_CLOCK PERF_TYPE_MAX
+#define HW_EVENT_SWITCH (PERF_TYPE_MAX + 1)
+#define HW_EVENT_RUSAGE (PERF_TYPE_MAX + 2)
+#define HW_EVENT_IO (PERF_TYPE_MAX + 3)
+
+struct HW_event_desc {
+    uint32_t type;
+    uint64_t config;
+    const char* short_name;
+    const char* name;
+    const char* key;
+};
+
+static const struct HW_event_desc hw_events[CPUTRACE_RESULT_LAST] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "swi", "context-switches", "context_switches" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cyc", "cycles", "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cmiss", "cache-misses", "cache_misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "bmiss", "branch-misses", "branch_misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "ins", "instructions", "instructions" },
+    { HW_EVENT_CLOCK, CLOCK_MONOTONIC, "wall", "wall-time-ns", "wall_time_ns" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task", "task-clock-ns", "task_clock_ns" },
+    { HW_EVENT_SWITCH, 0, "offv", "off-cpu-blocked-ns", "offcpu_blocked_ns" },
+    { HW_EVENT_SWITCH, 1, "offi", "off-cpu-preempted-ns", "offcpu_preempted_ns" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "pgf", "page-faults", "page_faults" },
+    { HW_EVENT_RUSAGE, 0, "minflt", "minor-faults", "minor_faults" },
+    { HW_EVENT_RUSAGE, 1, "majflt", "major-faults", "major_faults" },
+    { HW_EVENT_RUSAGE, 2, "inblk", "block-inputs", "block_inputs" },
+    { HW_EVENT_RUSAGE, 3, "oublk", "block-outputs", "block_outputs" },
+    { HW_EVENT_RUSAGE, 4, "vcsw", "voluntary-switches", "voluntary_switches" },
+    { HW_EVENT_RUSAGE, 5, "ivcsw", "involuntary-switches", "involuntary_switches" },
+    { HW_EVENT_IO, 0, "rchar", "read-chars", "read_chars" },
+    { HW_EVENT_IO, 1, "wchar", "write-chars", "write_chars" },
+    { HW_EVENT_IO, 2, "rbytes", "read-bytes", "read_bytes" },
+    { HW_EVENT_IO, 3, "wbytes", "write-bytes", "write_bytes" },
+};
+
+static bool hw_event_is_counter(int i) {
+    return hw_events[i].type < PERF_TYPE_MAX;
 }
 
-void HW_start(struct HW_ctx* ctx) {
-    struct perf_event_attr pe;
+#define HW_PROFILE_HARDWARE (HW_PROFILE_CYC | HW_PROFILE_CMISS | HW_PROFILE_BMISS | HW_PROFILE_INS)
 
-    if (ctx->conf.capture_swi) {
-        if (ctx->fd_swi == -1) {
-            memset(&pe, 0, sizeof(pe));
-            pe.size = sizeof(pe);
-            pe.type = PERF_TYPE_SOFTWARE;
-            pe.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
-            pe.disabled = 1;
-            pe.inherit = 1;
-            ctx->fd_swi = perf_event_open(&pe, 0, -1, -1, 0);
-            if (ctx->fd_swi != -1) {
-                if (ioctl(ctx->fd_swi, PERF_EVENT_IOC_RESET, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl RESET failed for swi: %s\n", __func__, strerror(errno));
-                }
-                if (ioctl(ctx->fd_swi, PERF_EVENT_IOC_ENABLE, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl ENABLE failed for swi: %s\n", __func__, strerror(errno));
-                }
-            } else {
-                ctx->conf.capture_swi = false;
-                fprintf(stderr, "%s: Failed to open swi counter\n", __func__);
-            }
-        } else {
-            if (ioctl(ctx->fd_swi, PERF_EVENT_IOC_RESET, 0) == -1) {
-                fprintf(stderr, "%s: ioctl RESET failed for swi: %s\n", __func__, strerror(errno));
-            }
+// Result of the startup probe
+static struct {
+    uint64_t supported;             // bit per metric
+    int err[CPUTRACE_RESULT_LAST];  // errno of the failed probe
+    uint64_t fallback_flags;        // software events standing in for missing hardware ones
+} g_caps;
+
+static int read_paranoid(void) {
+    int level = 2;
+    FILE* fp = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (fp) {
+        if (fscanf(fp, "%d", &level) != 1) {
+            level = 2;
         }
+        fclose(fp);
     }
+    return level;
+}
 
-    if (ctx->conf.capture_cyc) {
-        if (ctx->fd_cyc == -1) {
-            memset(&pe, 0, sizeof(pe));
-            pe.size = sizeof(pe);
-            pe.type = PERF_TYPE_HARDWARE;
-            pe.config = PERF_COUNT_HW_CPU_CYCLES;
-            pe.disabled = 1;
-            pe.inherit = 1;
-            ctx->fd_cyc = perf_event_open(&pe, 0, -1, -1, 0);
-            if (ctx->fd_cyc != -1) {
-                if (ioctl(ctx->fd_cyc, PERF_EVENT_IOC_RESET, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl RESET failed for cyc: %s\n", __func__, strerror(errno));
-                }
-                if (ioctl(ctx->fd_cyc, PERF_EVENT_IOC_ENABLE, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl ENABLE failed for cyc: %s\n", __func__, strerror(errno));
-                }
+// Privilege levels counted by the events the process opens. Kernel mode
+// is left out of every event when the probe found it forbidden
+// (perf_event_paranoid >= 2 without CAP_PERFMON), and out of hardware
+// events when cputrace_set_user_only() asked for user mode only. Software
+// events keep it then: context switches only happen in kernel mode.
+static struct {
+    bool user_only;
+    bool kernel_denied;
+} g_mode;
+
+static bool mode_user_only(void) {
+    return __atomic_load_n(&g_mode.user_only, __ATOMIC_RELAXED) || g_mode.kernel_denied;
+}
+
+static void mode_attr(struct perf_event_attr* pe) {
+    pe->exclude_kernel = g_mode.kernel_denied ||
+                         (pe->type != PERF_TYPE_SOFTWARE && __atomic_load_n(&g_mode.user_only, __ATOMIC_RELAXED));
+    pe->exclude_hv = pe->exclude_kernel;
+}
+
+void cputrace_set_user_only(bool on) {
+    __atomic_store_n(&g_mode.user_only, on, __ATOMIC_RELAXED);
+}
+
+static void cputrace_probe(void) {
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        int fd;
+        if (hw_events[i].type == HW_EVENT_CLOCK) {
+            g_caps.supported |= 1ULL << i;
+            continue;
+        }
+        if (hw_events[i].type == HW_EVENT_RUSAGE) {
+            struct rusage ru;
+            if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+                g_caps.supported |= 1ULL << i;
             } else {
-                ctx->conf.capture_cyc = false;
-                fprintf(stderr, "%s: Failed to open cyc counter\n", __func__);
-            }
-        } else {
-            if (ioctl(ctx->fd_cyc, PERF_EVENT_IOC_RESET, 0) == -1) {
-                fprintf(stderr, "%s: ioctl RESET failed for cyc: %s\n", __func__, strerror(errno));
+                g_caps.err[i] = errno;
             }
+            continue;
         }
-    }
-
-    if (ctx->conf.capture_cmiss) {
-        if (ctx->fd_cmiss == -1) {
-            memset(&pe, 0, sizeof(pe));
-            pe.size = sizeof(pe);
-            pe.type = PERF_TYPE_HARDWARE;
-            pe.config = PERF_COUNT_HW_CACHE_MISSES;
-            pe.disabled = 1;
-            pe.inherit = 1;
-            ctx->fd_cmiss = perf_event_open(&pe, 0, -1, -1, 0);
-            if (ctx->fd_cmiss != -1) {
-                if (ioctl(ctx->fd_cmiss, PERF_EVENT_IOC_RESET, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl RESET failed for cmiss: %s\n", __func__, strerror(errno));
-                }
-                if (ioctl(ctx->fd_cmiss, PERF_EVENT_IOC_ENABLE, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl ENABLE failed for cmiss: %s\n", __func__, strerror(errno));
-                }
-            } else {
-                ctx->conf.capture_cmiss = false;
-                fprintf(stderr, "%s: Failed to open cmiss counter\n", __func__);
+        if (hw_events[i].type == HW_EVENT_IO) {
+            // Needs task I/O accounting in the kernel
+            fd = open("/proc/thread-self/io", O_RDONLY);
+            if (fd == -1) {
+                g_caps.err[i] = errno;
+                continue;
             }
+            close(fd);
+            g_caps.supported |= 1ULL << i;
+            continue;
+        }
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.size = sizeof(pe);
+        if (hw_events[i].type == HW_EVENT_SWITCH) {
+            pe.type = PERF_TYPE_SOFTWARE;
+            pe.config = PERF_COUNT_SW_DUMMY;
+            pe.context_switch = 1;
         } else {
-            if (ioctl(ctx->fd_cmiss, PERF_EVENT_IOC_RESET, 0) == -1) {
-                fprintf(stderr, "%s: ioctl RESET failed for cmiss: %s\n", __func__, strerror(errno));
-            }
+            pe.type = hw_events[i].type;
+            pe.config = hw_events[i].config;
         }
+        pe.disabled = 1;
+        mode_attr(&pe);
+        fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+        if (fd == -1 && (errno == EACCES || errno == EPERM) && !pe.exclude_kernel) {
+            // Events probed before this one also work in user mode only
+            g_mode.kernel_denied = true;
+            fprintf(stderr, "cputrace: kernel-mode counting not permitted (perf_event_paranoid=%d), "
+                    "counting user mode only\n", read_paranoid());
+            mode_attr(&pe);
+            fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+        }
+        if (fd == -1) {
+            g_caps.err[i] = errno;
+            continue;
+        }
+        close(fd);
+        g_caps.supported |= 1ULL << i;
+    }
+    // Context switches happen in kernel mode: counted in user mode only
+    // they always read 0
+    if (g_mode.kernel_denied && (g_caps.supported & HW_PROFILE_SWI)) {
+        g_caps.supported &= ~(uint64_t)HW_PROFILE_SWI;
+        g_caps.err[CPUTRACE_RESULT_SWI] = EACCES;
+    }
+    g_caps.fallback_flags = 0;
+    if ((g_caps.supported & HW_PROFILE_HARDWARE) == 0) {
+        g_caps.fallback_flags = g_caps.supported & (HW_PROFILE_TASK | HW_PROFILE_PGFAULT | HW_PROFILE_SWI);
     }
+    if (g_caps.fallback_flags) {
+        fprintf(stderr, "cputrace: no hardware counters (%s), using software events\n",
+                strerror(g_caps.err[CPUTRACE_RESULT_CYC]));
+    } else if ((g_caps.supported & HW_PROFILE_HARDWARE) == 0) {
+        fprintf(stderr, "cputrace: no hardware or software counters (%s), wall time only\n",
+                strerror(g_caps.err[CPUTRACE_RESULT_CYC]));
+    }
+}
 
-    if (ctx->conf.capture_bmiss) {
-        if (ctx->fd_bmiss == -1) {
-            memset(&pe, 0, sizeof(pe));
-            pe.size = sizeof(pe);
-            pe.type = PERF_TYPE_HARDWARE;
-            pe.config = PERF_COUNT_HW_BRANCH_MISSES;
-            pe.disabled = 1;
-            pe.inherit = 1;
-            ctx->fd_bmiss = perf_event_open(&pe, 0, -1, -1, 0);
-            if (ctx->fd_bmiss != -1) {
-                if (ioctl(ctx->fd_bmiss, PERF_EVENT_IOC_RESET, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl RESET failed for bmiss: %s\n", __func__, strerror(errno));
-                }
-                if (ioctl(ctx->fd_bmiss, PERF_EVENT_IOC_ENABLE, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl ENABLE failed for bmiss: %s\n", __func__, strerror(errno));
-                }
-            } else {
-                ctx->conf.capture_bmiss = false;
-                fprintf(stderr, "%s: Failed to open bmiss counter\n", __func__);
-            }
-        } else {
-            if (ioctl(ctx->fd_bmiss, PERF_EVENT_IOC_RESET, 0) == -1) {
-                fprintf(stderr, "%s: ioctl RESET failed for bmiss: %s\n", __func__, strerror(errno));
-            }
+bool cputrace_event_supported(int metric) {
+    return metric >= 0 && metric < CPUTRACE_RESULT_LAST && (g_caps.supported & (1ULL << metric));
+}
+
+bool cputrace_software_fallback(void) {
+    return g_caps.fallback_flags != 0;
+}
+
+const char* cputrace_metric_name(int metric) {
+    return metric >= 0 && metric < CPUTRACE_RESULT_LAST ? hw_events[metric].name : "unknown";
+}
+
+int cputrace_metric_from_name(const char* name) {
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (strcmp(name, hw_events[i].key) == 0 || strcmp(name, hw_events[i].name) == 0 ||
+            strcmp(name, hw_events[i].short_name) == 0) {
+            return i;
         }
     }
+    return -1;
+}
+
+// Extra flags for every new scope while a trigger's detailed window is open
+static uint64_t g_detail_flags;
+
+// Flags a scope actually records: wall time always, software events in
+// place of hardware ones when there are none
+static uint64_t effective_flags(uint64_t flags) {
+    flags |= HW_PROFILE_WALL | __atomic_load_n(&g_detail_flags, __ATOMIC_RELAXED);
+    if (flags & HW_PROFILE_HARDWARE) {
+        flags |= g_caps.fallback_flags;
+    }
+    return flags;
+}
+
+static void HW_event_attr(struct perf_event_attr* pe, int type) {
+    memset(pe, 0, sizeof(*pe));
+    pe->size = sizeof(*pe);
+    pe->type = hw_events[type].type;
+    pe->config = hw_events[type].config;
+    mode_attr(pe);
+}
+
+void HW_init(struct HW_ctx* ctx, struct HW_conf* conf) {
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        ctx->fd[i] = -1;
+    }
+    ctx->conf = *conf;
+}
 
-    if (ctx->conf.capture_ins) {
-        if (ctx->fd_ins == -1) {
-            memset(&pe, 0, sizeof(pe));
-            pe.size = sizeof(pe);
-            pe.type = PERF_TYPE_HARDWARE;
-            pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+void HW_start(struct HW_ctx* ctx) {
+    struct perf_event_attr pe;
+
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (!ctx->conf.capture[i] || !hw_event_is_counter(i) || !(g_caps.supported & (1ULL << i))) {
+            ctx->conf.capture[i] = false;
+            continue;
+        }
+        const char* name = hw_events[i].short_name;
+        if (ctx->fd[i] == -1) {
+            HW_event_attr(&pe, i);
             pe.disabled = 1;
             pe.inherit = 1;
-            ctx->fd_ins = perf_event_open(&pe, 0, -1, -1, 0);
-            if (ctx->fd_ins != -1) {
-                if (ioctl(ctx->fd_ins, PERF_EVENT_IOC_RESET, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl RESET failed for ins: %s\n", __func__, strerror(errno));
+            ctx->fd[i] = perf_event_open(&pe, 0, -1, -1, 0);
+            if (ctx->fd[i] != -1) {
+                if (ioctl(ctx->fd[i], PERF_EVENT_IOC_RESET, 0) == -1) {
+                    log_limited("%s: ioctl RESET failed for %s: %s\n", __func__, name, strerror(errno));
                 }
-                if (ioctl(ctx->fd_ins, PERF_EVENT_IOC_ENABLE, 0) == -1) {
-                    fprintf(stderr, "%s: ioctl ENABLE failed for ins: %s\n", __func__, strerror(errno));
+                if (ioctl(ctx->fd[i], PERF_EVENT_IOC_ENABLE, 0) == -1) {
+                    log_limited("%s: ioctl ENABLE failed for %s: %s\n", __func__, name, strerror(errno));
                 }
             } else {
-                ctx->conf.capture_ins = false;
-                fprintf(stderr, "%s: Failed to open ins counter\n", __func__);
+                ctx->conf.capture[i] = false;
+                log_limited("%s: Failed to open %s counter\n", __func__, name);
             }
         } else {
-            if (ioctl(ctx->fd_ins, PERF_EVENT_IOC_RESET, 0) == -1) {
-                fprintf(stderr, "%s: ioctl RESET failed for ins: %s\n", __func__, strerror(errno));
+            if (ioctl(ctx->fd[i], PERF_EVENT_IOC_RESET, 0) == -1) {
+                log_limited("%s: ioctl RESET failed for %s: %s\n", __func__, name, strerror(errno));
             }
         }
     }
 }
 
 void HW_stop(struct HW_ctx* ctx, struct HW_measure* measure) {
-    if (ctx->conf.capture_swi && ctx->fd_swi != -1) {
-        if (ioctl(ctx->fd_swi, PERF_EVENT_IOC_DISABLE, 0) == -1) {
-            fprintf(stderr, "%s: ioctl DISABLE failed for swi: %s\n", __func__, strerror(errno));
+    measure->kernel_valid = 0;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        measure->value[i] = 0;
+        measure->kernel[i] = 0;
+        if (!ctx->conf.capture[i] || ctx->fd[i] == -1) {
+            continue;
+        }
+        const char* name = hw_events[i].short_name;
+        if (ioctl(ctx->fd[i], PERF_EVENT_IOC_DISABLE, 0) == -1) {
+            log_limited("%s: ioctl DISABLE failed for %s: %s\n", __func__, name, strerror(errno));
         }
         long long value;
-        if (read(ctx->fd_swi, &value, sizeof(long long)) == -1) {
-            fprintf(stderr, "%s: read final failed for swi: %s\n", __func__, strerror(errno));
-            measure->swi = 0;
+        if (read(ctx->fd[i], &value, sizeof(long long)) == -1) {
+            log_limited("%s: read final failed for %s: %s\n", __func__, name, strerror(errno));
         } else {
-            measure->swi = value;
+            measure->value[i] = value;
         }
     }
-    if (ctx->conf.capture_cyc && ctx->fd_cyc != -1) {
-        if (ioctl(ctx->fd_cyc, PERF_EVENT_IOC_DISABLE, 0) == -1) {
-            fprintf(stderr, "%s: ioctl DISABLE failed for cyc: %s\n", __func__, strerror(errno));
-        }
-        long long value;
-        if (read(ctx->fd_cyc, &value, sizeof(long long)) == -1) {
-            fprintf(stderr, "%s: read final failed for cyc: %s\n", __func__, strerror(errno));
-            measure->cyc = 0;
-        } else {
-            measure->cyc = value;
+}
+
+void HW_clean(struct HW_ctx* ctx) {
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (ctx->conf.capture[i] && ctx->fd[i] != -1) {
+            ioctl(ctx->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            close(ctx->fd[i]);
+            ctx->fd[i] = -1;
         }
     }
-    if (ctx->conf.capture_cmiss && ctx->fd_cmiss != -1) {
-        if (ioctl(ctx->fd_cmiss, PERF_EVENT_IOC_DISABLE, 0) == -1) {
-            fprintf(stderr, "%s: ioctl DISABLE failed for cmiss: %s\n", __func__, strerror(errno));
+}
+
+// System-wide per-CPU counters (pid=-1, cpu=N). They are opened for the
+// selected CPU set and left running; scopes read them on entry and exit to
+// get the activity of the whole core over the scope's interval. A CPU keeps
+// its slot and descriptors until cputrace_close(), so a scope still in
+// flight across a disable and the next enable never reads a recycled fd;
+// enabling again only switches counting back on for the CPUs asked for.
+static struct {
+    bool enabled;
+    bool initialized;  // slot_of_cpu filled in
+    int ncpus;         // slots opened so far
+    int slot_of_cpu[CPUTRACE_MAX_CPUS];
+    int cpu_of_slot[CPUTRACE_MAX_PERCPU];
+    bool active[CPUTRACE_MAX_PERCPU];  // in the enabled CPU set
+    int fd[CPUTRACE_MAX_PERCPU][CPUTRACE_RESULT_LAST];
+} g_percpu;
+
+static void percpu_close_all(void) {
+    for (int s = 0; s < g_percpu.ncpus; s++) {
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (g_percpu.fd[s][i] != -1) {
+                close(g_percpu.fd[s][i]);
+                g_percpu.fd[s][i] = -1;
+            }
         }
-        long long value;
-        if (read(ctx->fd_cmiss, &value, sizeof(long long)) == -1) {
-            fprintf(stderr, "%s: read final failed for cmiss: %s\n", __func__, strerror(errno));
-            measure->cmiss = 0;
-        } else {
-            measure->cmiss = value;
+        g_percpu.active[s] = false;
+    }
+    for (int c = 0; c < CPUTRACE_MAX_CPUS; c++) {
+        g_percpu.slot_of_cpu[c] = -1;
+    }
+    g_percpu.ncpus = 0;
+    g_percpu.initialized = true;
+}
+
+static void percpu_set_active(int slot, bool on) {
+    g_percpu.active[slot] = on;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (g_percpu.fd[slot][i] != -1) {
+            ioctl(g_percpu.fd[slot][i], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
         }
     }
-    if (ctx->conf.capture_bmiss && ctx->fd_bmiss != -1) {
-        if (ioctl(ctx->fd_bmiss, PERF_EVENT_IOC_DISABLE, 0) == -1) {
-            fprintf(stderr, "%s: ioctl DISABLE failed for bmiss: %s\n", __func__, strerror(errno));
+}
+
+// Opens the counters of CPU `c` into the next free slot. Returns the slot,
+// -1 when nothing could be opened and -2 when system-wide counting is not
+// permitted.
+static int percpu_open(int c, bool* supported) {
+    int slot = g_percpu.ncpus;
+    int ret = -1;
+    // All of the slot first: the error paths below close whatever is not
+    // -1, and a zeroed entry would be stdin
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        g_percpu.fd[slot][i] = -1;
+    }
+    struct perf_event_attr pe;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (!supported[i] || !hw_event_is_counter(i)) {
+            continue;
         }
-        long long value;
-        if (read(ctx->fd_bmiss, &value, sizeof(long long)) == -1) {
-            fprintf(stderr, "%s: read final failed for bmiss: %s\n", __func__, strerror(errno));
-            measure->bmiss = 0;
-        } else {
-            measure->bmiss = value;
+        HW_event_attr(&pe, i);
+        int fd = syscall(__NR_perf_event_open, &pe, -1, c, -1, 0);
+        if (fd == -1) {
+            if (errno == EACCES || errno == EPERM) {
+                ret = -2;
+                break;
+            }
+            if (errno == ENODEV || errno == ENXIO) {
+                break; // CPU offline
+            }
+            fprintf(stderr, "%s: %s not available per-CPU: %s\n", __func__,
+                    hw_events[i].name, strerror(errno));
+            supported[i] = false;
+            continue;
         }
+        g_percpu.fd[slot][i] = fd;
+        ret = ret == -1 ? slot : ret;
     }
-    if (ctx->conf.capture_ins && ctx->fd_ins != -1) {
-        if (ioctl(ctx->fd_ins, PERF_EVENT_IOC_DISABLE, 0) == -1) {
-            fprintf(stderr, "%s: ioctl DISABLE failed for ins: %s\n", __func__, strerror(errno));
-        }
-        long long value;
-        if (read(ctx->fd_ins, &value, sizeof(long long)) == -1) {
-            fprintf(stderr, "%s: read final failed for ins: %s\n", __func__, strerror(errno));
-            measure->ins = 0;
-        } else {
-            measure->ins = value;
+    if (ret < 0) {
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (g_percpu.fd[slot][i] != -1) {
+                close(g_percpu.fd[slot][i]);
+                g_percpu.fd[slot][i] = -1;
+            }
         }
+        return ret;
     }
+    g_percpu.cpu_of_slot[slot] = c;
+    g_percpu.active[slot] = true;
+    g_percpu.ncpus++;
+    g_percpu.slot_of_cpu[c] = slot;
+    return slot;
 }
 
-void HW_clean(struct HW_ctx* ctx) {
-    if (ctx->conf.capture_swi && ctx->fd_swi != -1) {
-        ioctl(ctx->fd_swi, PERF_EVENT_IOC_DISABLE, 0);
-        close(ctx->fd_swi);
-        ctx->fd_swi = -1;
+int cputrace_percpu_enable(const cpu_set_t* cpus) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_percpu.enabled) {
+        fprintf(stderr, "%s: per-CPU counters already enabled\n", __func__);
+        int active = 0;
+        for (int s = 0; s < g_percpu.ncpus; s++) {
+            active += g_percpu.active[s];
+        }
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return active;
     }
-    if (ctx->conf.capture_cyc && ctx->fd_cyc != -1) {
-        ioctl(ctx->fd_cyc, PERF_EVENT_IOC_DISABLE, 0);
-        close(ctx->fd_cyc);
-        ctx->fd_cyc = -1;
+    if (!g_percpu.initialized) {
+        percpu_close_all();
     }
-    if (ctx->conf.capture_cmiss && ctx->fd_cmiss != -1) {
-        ioctl(ctx->fd_cmiss, PERF_EVENT_IOC_DISABLE, 0);
-        close(ctx->fd_cmiss);
-        ctx->fd_cmiss = -1;
+
+    bool supported[CPUTRACE_RESULT_LAST];
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        supported[i] = true;
     }
-    if (ctx->conf.capture_bmiss && ctx->fd_bmiss != -1) {
-        ioctl(ctx->fd_bmiss, PERF_EVENT_IOC_DISABLE, 0);
-        close(ctx->fd_bmiss);
-        ctx->fd_bmiss = -1;
+    int active = 0;
+    for (int c = 0; c < CPUTRACE_MAX_CPUS; c++) {
+        if (!CPU_ISSET_S(c, sizeof(cpu_set_t), cpus)) {
+            continue;
+        }
+        int slot = g_percpu.slot_of_cpu[c];
+        if (slot >= 0) {
+            percpu_set_active(slot, true);
+            active++;
+            continue;
+        }
+        if (g_percpu.ncpus == CPUTRACE_MAX_PERCPU) {
+            continue;
+        }
+        slot = percpu_open(c, supported);
+        if (slot == -2) {
+            fprintf(stderr, "%s: system-wide counters not permitted (need CAP_PERFMON "
+                    "or perf_event_paranoid <= 0), per-CPU mode disabled\n", __func__);
+            for (int s = 0; s < g_percpu.ncpus; s++) {
+                if (g_percpu.active[s]) {
+                    percpu_set_active(s, false);
+                }
+            }
+            pthread_mutex_unlock(&g_profiler.file_mutex);
+            return -1;
+        }
+        active += slot >= 0;
     }
-    if (ctx->conf.capture_ins && ctx->fd_ins != -1) {
-        ioctl(ctx->fd_ins, PERF_EVENT_IOC_DISABLE, 0);
-        close(ctx->fd_ins);
-        ctx->fd_ins = -1;
+    if (active == 0) {
+        fprintf(stderr, "%s: no per-CPU counters could be opened, per-CPU mode disabled\n", __func__);
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
     }
+    g_percpu.enabled = true;
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return active;
 }
 
-static struct ArenaRegion* arena_region_create(size_t size) {
-    void* start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (start == MAP_FAILED) {
-        fprintf(stderr, "%s: mmap failed: %s\n", __func__, strerror(errno));
-        return NULL;
+void cputrace_percpu_disable(void) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_percpu.enabled) {
+        g_percpu.enabled = false;
+        for (int s = 0; s < g_percpu.ncpus; s++) {
+            if (g_percpu.active[s]) {
+                percpu_set_active(s, false);
+            }
+        }
     }
-    struct ArenaRegion* region = (struct ArenaRegion*)malloc(sizeof(struct ArenaRegion));
-    region->start = start;
-    region->end = (void*)((uintptr_t)start + size);
-    region->current = start;
-    region->next = NULL;
-    return region;
+    pthread_mutex_unlock(&g_profiler.file_mutex);
 }
 
-static void arena_region_destroy(struct ArenaRegion* region) {
-    munmap(region->start, (uintptr_t)region->end - (uintptr_t)region->start);
-    free(region);
+static int percpu_read(int cpu, struct HW_measure* measure) {
+    if (cpu < 0 || cpu >= CPUTRACE_MAX_CPUS || !g_percpu.initialized) {
+        return -1;
+    }
+    int slot = g_percpu.slot_of_cpu[cpu];
+    if (slot < 0 || !g_percpu.active[slot]) {
+        return -1;
+    }
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        long long value = 0;
+        if (g_percpu.fd[slot][i] != -1 && read(g_percpu.fd[slot][i], &value, sizeof(value)) == -1) {
+            value = 0;
+        }
+        measure->value[i] = value;
+    }
+    return slot;
 }
 
-static uint64_t arena_region_size(struct ArenaRegion* region) {
-    return (uintptr_t)region->end - (uintptr_t)region->start;
-}
+// CPU to NUMA node map for the per-node breakdown, read once on enable.
+// Without /sys/devices/system/node every CPU is on node 0.
+static struct {
+    bool enabled;
+    int nnodes;
+    uint8_t node_of_cpu[CPUTRACE_MAX_CPUS];
+} g_numa;
 
-struct Arena* arena_create(size_t size, bool growable) {
-    struct ArenaRegion* region = arena_region_create(size);
-    if (!region) {
-        fprintf(stderr, "%s: failed to create region\n", __func__);
-        return NULL;
-    }
-    struct Arena* arena = (struct Arena*)malloc(sizeof(struct Arena));
-    arena->growable = growable;
-    arena->regions = region;
-    arena->current_region = region;
-    return arena;
+static int numa_node_of(int cpu) {
+    return cpu >= 0 && cpu < CPUTRACE_MAX_CPUS ? g_numa.node_of_cpu[cpu] : 0;
 }
 
-void* arena_alloc(struct Arena* arena, size_t size) {
-    uint64_t possible_end = (uintptr_t)arena->current_region->current + size;
-    if (possible_end > (uintptr_t)arena->current_region->end) {
-        if (!arena->growable) {
-            fprintf(stderr, "%s: allocation failed, not growable\n", __func__);
-            return NULL;
+// Parses a cpulist such as "0-3,8-11" into the node map
+static void numa_map_cpulist(const char* list, int node) {
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
         }
-        uint64_t new_size = arena_region_size(arena->current_region);
-        if (size > new_size) {
-            new_size = size;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
         }
-        struct ArenaRegion* new_region = arena_region_create(new_size);
-        if (!new_region) {
-            fprintf(stderr, "%s: failed to create new region\n", __func__);
-            return NULL;
+        for (long c = first; c <= last && c < CPUTRACE_MAX_CPUS; c++) {
+            if (c >= 0) {
+                g_numa.node_of_cpu[c] = (uint8_t)node;
+            }
+        }
+        p = *end == ',' ? end + 1 : end;
+        if (*p == '\n') {
+            break;
         }
-        arena->current_region->next = new_region;
-        arena->current_region = new_region;
     }
-    struct ArenaRegion* region = arena->current_region;
-    void* result = region->current;
-    region->current = (void*)((uintptr_t)region->current + size);
-    return result;
 }
 
-void arena_destroy(struct Arena* arena) {
-    struct ArenaRegion* region = arena->regions;
-    while (region) {
-        struct ArenaRegion* next = region->next;
-        arena_region_destroy(region);
-        region = next;
+int cputrace_numa_enable(void) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    memset(g_numa.node_of_cpu, 0, sizeof(g_numa.node_of_cpu));
+    g_numa.nnodes = 1;
+    for (int node = 0; node < CPUTRACE_MAX_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), f)) {
+            numa_map_cpulist(list, node);
+            g_numa.nnodes = node + 1;
+        }
+        fclose(f);
     }
-    free(arena);
+    g_numa.enabled = true;
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return g_numa.nnodes;
 }
 
-static void cputrace_anchor_thread_flush(struct cputrace_anchor* anchor) {
-    if (anchor->call_count == 0) {
-        return;
-    }
+void cputrace_numa_disable(void) {
+    g_numa.enabled = false;
+}
 
-    const uint64_t overflow_threshold = UINT64_MAX / 2;
-    if (anchor->sum_swi > overflow_threshold ||
-        anchor->sum_cyc > overflow_threshold ||
-        anchor->sum_cmiss > overflow_threshold ||
-        anchor->sum_bmiss > overflow_threshold ||
-        anchor->sum_ins > overflow_threshold) {
-        fprintf(stderr, "Warning: Potential overflow in metrics for '%s'\n",
-                anchor->name ? anchor->name : "(null)");
-    }
+// Defined by cputrace_alloc.o, if the program links it
+struct cputrace_alloc_counters* cputrace_alloc_thread(void) __attribute__((weak));
 
-    printf("\nPerformance counter stats for '%s' (%" PRIu64 " calls):\n\n",
-           anchor->name ? anchor->name : "(null)", anchor->call_count);
+static bool g_alloc_enabled;
 
-    char buffer[32];
-    auto format_uint64_with_commas = [](uint64_t value, char* buf, size_t buf_size) {
-        char temp[32];
-        snprintf(temp, sizeof(temp), "%" PRIu64, value);
-        int len = strlen(temp);
-        int commas = len > 3 ? (len - 1) / 3 : 0;
-        int out_len = len + commas;
-        if (out_len >= (int)buf_size) return;
-        buf[out_len] = '\0';
-        int j = out_len - 1;
-        int k = 0;
-        for (int i = len - 1; i >= 0; i--) {
-            buf[j--] = temp[i];
-            k++;
-            if (k % 3 == 0 && i > 0) {
-                buf[j--] = ',';
-            }
-        }
-        while (j >= 0) buf[j--] = ' ';
-    };
-
-    auto format_double_with_commas = [](double value, char* buf, size_t buf_size) {
-        char temp[32];
-        snprintf(temp, sizeof(temp), "%.1f", value);
-        int len = strlen(temp);
-        int dot_pos = len - 2;
-        int whole_len = dot_pos;
-        int commas = whole_len > 3 ? (whole_len - 1) / 3 : 0;
-        int out_len = len + commas;
-        if (out_len >= (int)buf_size) return;
-        buf[out_len] = '\0';
-        int j = out_len - 1;
-        int k = 0;
-        for (int i = len - 1; i >= dot_pos; i--) {
-            buf[j--] = temp[i];
-        }
-        for (int i = dot_pos - 1; i >= 0; i--) {
-            buf[j--] = temp[i];
-            k++;
-            if (k % 3 == 0 && i > 0) {
-                buf[j--] = ',';
-            }
-        }
-        while (j >= 0) buf[j--] = ' ';
-    };
-
-    if (anchor->sum_swi > 0) {
-        format_uint64_with_commas(anchor->sum_swi, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "context-switches");
-        double avg_swi = static_cast<double>(anchor->sum_swi) / anchor->call_count;
-        format_double_with_commas(avg_swi, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "avg context-switches");
-    }
-    if (anchor->sum_cyc > 0) {
-        format_uint64_with_commas(anchor->sum_cyc, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "cycles");
-        double avg_cyc = static_cast<double>(anchor->sum_cyc) / anchor->call_count;
-        format_double_with_commas(avg_cyc, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "avg cycles");
-    }
-    if (anchor->sum_cmiss > 0) {
-        format_uint64_with_commas(anchor->sum_cmiss, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "cache-misses");
-        double avg_cmiss = static_cast<double>(anchor->sum_cmiss) / anchor->call_count;
-        format_double_with_commas(avg_cmiss, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "avg cache-misses");
-    }
-    if (anchor->sum_bmiss > 0) {
-        format_uint64_with_commas(anchor->sum_bmiss, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "branch-misses");
-        double avg_bmiss = static_cast<double>(anchor->sum_bmiss) / anchor->call_count;
-        format_double_with_commas(avg_bmiss, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "avg branch-misses");
-    }
-    if (anchor->sum_ins > 0) {
-        format_uint64_with_commas(anchor->sum_ins, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "instructions");
-        double avg_ins = static_cast<double>(anchor->sum_ins) / anchor->call_count;
-        format_double_with_commas(avg_ins, buffer, sizeof(buffer));
-        printf(" %15s %s\n", buffer, "avg instructions");
-    }
-    printf("\n");
-    fflush(stdout);
+int cputrace_alloc_enable(void) {
+    if (!cputrace_alloc_thread) {
+        fprintf(stderr, "%s: cputrace_alloc.o is not linked in\n", __func__);
+        return -1;
+    }
+    g_alloc_enabled = true;
+    return 0;
 }
 
-static void cputrace_result_add(struct cputrace_anchor* anchor,
-                              enum cputrace_result_type type, uint64_t value) {
-    pthread_mutex_lock(&anchor->mutex);
-    switch (type) {
-        case CPUTRACE_RESULT_SWI: anchor->sum_swi += value; break;
-        case CPUTRACE_RESULT_CYC: anchor->sum_cyc += value; break;
-        case CPUTRACE_RESULT_CMISS: anchor->sum_cmiss += value; break;
-        case CPUTRACE_RESULT_BMISS: anchor->sum_bmiss += value; break;
-        case CPUTRACE_RESULT_INS: anchor->sum_ins += value; break;
-        default: break;
-    }
-    pthread_mutex_unlock(&anchor->mutex);
+void cputrace_alloc_disable(void) {
+    g_alloc_enabled = false;
 }
 
-HW_profile::HW_profile(const char* function, uint64_t index, uint64_t flags) {
-    if (!g_profiler.profiling) {
-        return;
-    }
-    this->function = function;
-    this->index = index;
-    this->flags = flags;
+// Defined by cputrace_lock.o, if the program links it
+void cputrace_lock_hooks(bool on) __attribute__((weak));
 
-    struct HW_conf conf = {0};
-    if (flags & HW_PROFILE_SWI) conf.capture_swi = true;
-    if (flags & HW_PROFILE_CYC) conf.capture_cyc = true;
-    if (flags & HW_PROFILE_CMISS) conf.capture_cmiss = true;
-    if (flags & HW_PROFILE_BMISS) conf.capture_bmiss = true;
-    if (flags & HW_PROFILE_INS) conf.capture_ins = true;
+#define LOCK_UNTRACKED UINT64_MAX
 
-    HW_init(&ctx, &conf);
-    g_profiler.anchors[index].name = function;
-    HW_start(&ctx);
-}
+static bool g_lock_enabled;
+static __thread uint64_t t_lock_anchor;  // innermost scope's anchor, 0 outside scopes
 
-HW_profile::~HW_profile() {
-    if (!g_profiler.profiling) {
-        return;
+int cputrace_lock_enable(void) {
+    if (!cputrace_lock_hooks) {
+        fprintf(stderr, "%s: cputrace_lock.o is not linked in\n", __func__);
+        return -1;
     }
-    struct HW_measure measure;
-    HW_stop(&ctx, &measure);
+    g_lock_enabled = true;
+    cputrace_lock_hooks(true);
+    return 0;
+}
 
-    if (flags & HW_PROFILE_SWI) {
-        cputrace_result_add(&g_profiler.anchors[index], CPUTRACE_RESULT_SWI, measure.swi);
+void cputrace_lock_disable(void) {
+    if (cputrace_lock_hooks) {
+        cputrace_lock_hooks(false);
     }
-    if (flags & HW_PROFILE_CYC) {
-        cputrace_result_add(&g_profiler.anchors[index], CPUTRACE_RESULT_CYC, measure.cyc);
+    g_lock_enabled = false;
+}
+
+// Per-thread counters shared by every scope and span segment running on the
+// thread. Events are opened on first use and left counting, so entering or
+// leaving a scope is just a read of the current values.
+struct HW_thread_counters {
+    struct HW_ctx ctx;
+    uint64_t failed;
+    int kfd[CPUTRACE_RESULT_LAST];  // kernel-only siblings of ctx.fd
+    uint64_t kfailed;
+    uint64_t user_only;             // bit per ctx.fd opened without kernel mode
+
+    HW_thread_counters() : failed(~g_caps.supported), kfailed(0), user_only(0) {
+        struct HW_conf conf = {};
+        HW_init(&ctx, &conf);
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            kfd[i] = -1;
+        }
     }
-    if (flags & HW_PROFILE_CMISS) {
-        cputrace_result_add(&g_profiler.anchors[index], CPUTRACE_RESULT_CMISS, measure.cmiss);
+    ~HW_thread_counters() {
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (kfd[i] != -1) {
+                close(kfd[i]);
+            }
+        }
+        HW_clean(&ctx);
     }
-    if (flags & HW_PROFILE_BMISS) {
-        cputrace_result_add(&g_profiler.anchors[index], CPUTRACE_RESULT_BMISS, measure.bmiss);
+};
+
+static thread_local struct HW_thread_counters t_counters;
+
+// Bytes the profiler itself read() on this thread, taken out of rchar
+static __thread uint64_t t_self_rchar;
+
+// User/kernel split. The kernel-only event joins the group of the regular
+// (both modes) event so the two are scheduled together and cover the same
+// window; the user part is the difference.
+static struct {
+    bool enabled;
+    int denied_reported;
+} g_ksplit;
+
+// Asks the kernel rather than guessing from perf_event_paranoid and the
+// uid: CAP_PERFMON or CAP_SYS_ADMIN allow kernel counting at any level
+int cputrace_kernel_split_enable(void) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = PERF_TYPE_SOFTWARE;
+    pe.config = PERF_COUNT_SW_TASK_CLOCK;
+    pe.exclude_user = 1;
+    pe.exclude_hv = 1;
+    int fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+    if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+        fprintf(stderr, "%s: perf_event_paranoid=%d forbids kernel counting, "
+                "reporting totals only\n", __func__, read_paranoid());
+        return -1;
     }
-    if (flags & HW_PROFILE_INS) {
-        cputrace_result_add(&g_profiler.anchors[index], CPUTRACE_RESULT_INS, measure.ins);
+    if (fd != -1) {
+        close(fd);
     }
+    g_ksplit.enabled = true;
+    return 0;
+}
 
-    pthread_mutex_lock(&g_profiler.anchors[index].mutex);
-    g_profiler.anchors[index].call_count++;
-    pthread_mutex_unlock(&g_profiler.anchors[index].mutex);
+void cputrace_kernel_split_disable(void) {
+    g_ksplit.enabled = false;
+}
 
-    HW_clean(&ctx);
+static void HW_kernel_read(int i, struct HW_measure* measure) {
+    if (t_counters.kfd[i] == -1) {
+        if (t_counters.kfailed & (1ULL << i)) {
+            return;
+        }
+        struct perf_event_attr pe;
+        HW_event_attr(&pe, i);
+        pe.exclude_user = 1;
+        pe.exclude_kernel = 0;
+        pe.exclude_hv = 1;
+        t_counters.kfd[i] = syscall(__NR_perf_event_open, &pe, 0, -1, t_counters.ctx.fd[i], 0);
+        if (t_counters.kfd[i] == -1) {
+            t_counters.kfailed |= 1ULL << i;
+            if ((errno == EACCES || errno == EPERM) &&
+                __atomic_exchange_n(&g_ksplit.denied_reported, 1, __ATOMIC_RELAXED) == 0) {
+                fprintf(stderr, "%s: kernel counting not permitted (perf_event_paranoid=%d), "
+                        "reporting totals only\n", __func__, read_paranoid());
+            } else if (errno != EACCES && errno != EPERM) {
+                log_limited("%s: Failed to open kernel %s counter: %s\n", __func__,
+                        hw_events[i].short_name, strerror(errno));
+            }
+            return;
+        }
+    }
+    long long value;
+    if (read(t_counters.kfd[i], &value, sizeof(value)) == sizeof(value)) {
+        t_self_rchar += sizeof(value);
+        measure->kernel[i] = value;
+        measure->kernel_valid |= 1ULL << i;
+    }
 }
 
-void cputrace_start(void) {
-    pthread_mutex_lock(&g_profiler.file_mutex);
-    if (g_profiler.profiling) {
-        fprintf(stderr, "cputrace_start: Profiling already active\n");
-        pthread_mutex_unlock(&g_profiler.file_mutex);
-        return;
+// Per-thread perf mmap rings (hotspot samples, context switch records)
+#define RING_PAGES 8
+
+static void* ring_map(int fd, size_t* size) {
+    *size = sysconf(_SC_PAGESIZE) * (1 + RING_PAGES);
+    void* ring = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap of perf ring failed: %s\n", __func__, strerror(errno));
+        return NULL;
     }
-    g_profiler.profiling = true;
-    printf("Profiling started\n");
-    fflush(stdout);
-    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return ring;
 }
 
-void cputrace_stop(void) {
-    pthread_mutex_lock(&g_profiler.file_mutex);
-    if (!g_profiler.profiling) {
-        fprintf(stderr, "cputrace_stop: Profiling not active\n");
-        pthread_mutex_unlock(&g_profiler.file_mutex);
-        return;
+// Calls fn(header, first two payload words) for every record and frees
+// the space. Records may wrap around the end of the data area.
+template <typename F>
+static void ring_drain(void* ring, F fn) {
+    struct perf_event_mmap_page* hdr = (struct perf_event_mmap_page*)ring;
+    uint64_t head = __atomic_load_n(&hdr->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = hdr->data_tail;
+    const char* data = (const char*)ring + hdr->data_offset;
+    uint64_t size = hdr->data_size;
+    while (tail < head) {
+        char bytes[64];
+        struct perf_event_header eh;
+        uint64_t off = tail % size;
+        memcpy(&eh, data + off, sizeof(eh));  // headers never wrap
+        if (eh.size == 0) {
+            break;
+        }
+        if (eh.size <= sizeof(bytes)) {
+            uint64_t first = std::min<uint64_t>(eh.size, size - off);
+            memcpy(bytes, data + off, first);
+            memcpy(bytes + first, data, eh.size - first);
+            uint64_t payload[2] = { 0, 0 };
+            memcpy(payload, bytes + sizeof(eh), std::min<size_t>(sizeof(payload), eh.size - sizeof(eh)));
+            fn(&eh, payload);
+        }
+        tail += eh.size;
     }
-    g_profiler.profiling = false;
-    printf("Profiling stopped\n");
-    fflush(stdout);
-    pthread_mutex_unlock(&g_profiler.file_mutex);
+    __atomic_store_n(&hdr->data_tail, head, __ATOMIC_RELEASE);
 }
 
-void cputrace_reset(void) {
-    pthread_mutex_lock(&g_profiler.file_mutex);
-    for (uint64_t i = 0; i < CPUTRACE_MAX_ANCHORS; i++) {
+// Off-CPU time by reason. A dummy event with context_switch=1 logs a
+// record each time the thread is switched out (flagged when preempted)
+// and back in, timestamped with CLOCK_MONOTONIC. The ring is drained on
+// every read and the intervals summed into running per-thread totals, so a
+// scope's off-CPU time is the difference of two reads like any counter.
+struct HW_thread_switches {
+    int fd;
+    void* ring;
+    size_t ring_size;
+    bool failed;
+    uint64_t last_out;      // time of the pending switch-out, 0 if none
+    bool last_preempt;
+    uint64_t total[2];      // blocked, preempted
+
+    HW_thread_switches() : fd(-1), ring(NULL), ring_size(0), failed(false), last_out(0),
+                           last_preempt(false), total{0, 0} {}
+    ~HW_thread_switches() {
+        if (ring) {
+            munmap(ring, ring_size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+static thread_local struct HW_thread_switches t_switches;
+
+static bool switches_open(struct HW_thread_switches* sw) {
+    if (sw->fd != -1) {
+        return true;
+    }
+    if (sw->failed || !(g_caps.supported & (1ULL << CPUTRACE_RESULT_OFFCPU_BLOCKED))) {
+        return false;
+    }
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = PERF_TYPE_SOFTWARE;
+    pe.config = PERF_COUNT_SW_DUMMY;
+    pe.context_switch = 1;
+    mode_attr(&pe);
+    pe.sample_id_all = 1;
+    pe.sample_type = PERF_SAMPLE_TIME;
+    pe.use_clockid = 1;
+    pe.clockid = CLOCK_MONOTONIC;
+    sw->fd = perf_event_open(&pe, 0, -1, -1, 0);
+    if (sw->fd == -1) {
+        log_limited("%s: Failed to open context switch records\n", __func__);
+        sw->failed = true;
+        return false;
+    }
+    sw->ring = ring_map(sw->fd, &sw->ring_size);
+    if (!sw->ring) {
+        close(sw->fd);
+        sw->fd = -1;
+        sw->failed = true;
+        return false;
+    }
+    return true;
+}
+
+static void switches_read(uint64_t flags, struct HW_measure* measure) {
+    struct HW_thread_switches* sw = &t_switches;
+    if (!switches_open(sw)) {
+        return;
+    }
+    ring_drain(sw->ring, [sw](const struct perf_event_header* eh, const uint64_t* payload) {
+        if (eh->type == PERF_RECORD_LOST) {
+            sw->last_out = 0;
+        } else if (eh->type != PERF_RECORD_SWITCH) {
+            return;
+        } else if (eh->misc & PERF_RECORD_MISC_SWITCH_OUT) {
+            sw->last_out = payload[0];
+            sw->last_preempt = (eh->misc & PERF_RECORD_MISC_SWITCH_OUT_PREEMPT) != 0;
+        } else if (sw->last_out != 0) {
+            if (payload[0] > sw->last_out) {
+                sw->total[sw->last_preempt ? 1 : 0] += payload[0] - sw->last_out;
+            }
+            sw->last_out = 0;
+        }
+    });
+    if (flags & HW_PROFILE_OFFCPU_BLOCKED) {
+        measure->value[CPUTRACE_RESULT_OFFCPU_BLOCKED] = sw->total[0];
+    }
+    if (flags & HW_PROFILE_OFFCPU_PREEMPTED) {
+        measure->value[CPUTRACE_RESULT_OFFCPU_PREEMPTED] = sw->total[1];
+    }
+}
+
+static void rusage_read(uint64_t flags, struct HW_measure* measure) {
+    struct rusage ru;
+    if (!(g_caps.supported & HW_PROFILE_RUSAGE) || getrusage(RUSAGE_THREAD, &ru) == -1) {
+        return;
+    }
+    const long values[] = { ru.ru_minflt, ru.ru_majflt, ru.ru_inblock, ru.ru_oublock, ru.ru_nvcsw, ru.ru_nivcsw };
+    for (int k = 0; k < 6; k++) {
+        if (flags & (1ULL << (CPUTRACE_RESULT_MINFLT + k))) {
+            measure->value[CPUTRACE_RESULT_MINFLT + k] = values[k];
+        }
+    }
+}
+
+// /proc/thread-self/io, kept open per thread and re-read on a cadence
+static uint64_t g_io_interval_ns = 1000000;
+
+void cputrace_io_interval(uint64_t ns) {
+    __atomic_store_n(&g_io_interval_ns, ns, __ATOMIC_RELAXED);
+}
+
+struct HW_thread_io {
+    int fd;
+    bool failed;
+    uint64_t read_ns;       // CLOCK_MONOTONIC of the last read
+    uint64_t value[4];      // rchar, wchar, read_bytes, write_bytes
+
+    HW_thread_io() : fd(-1), failed(false), read_ns(0), value{0, 0, 0, 0} {}
+    ~HW_thread_io() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+static thread_local struct HW_thread_io t_io;
+
+static void io_refresh(struct HW_thread_io* io) {
+    static const char* const fields[4] = { "rchar: ", "wchar: ", "read_bytes: ", "write_bytes: " };
+    char text[512];
+    ssize_t n = pread(io->fd, text, sizeof(text) - 1, 0);
+    if (n <= 0) {
+        log_limited("%s: read failed: %s\n", __func__, n ? strerror(errno) : "empty");
+        return;
+    }
+    text[n] = '\0';
+    for (int k = 0; k < 4; k++) {
+        const char* p = strstr(text, fields[k]);
+        if (p) {
+            io->value[k] = strtoull(p + strlen(fields[k]), NULL, 10);
+        }
+    }
+    // rchar also counts the profiler's own reads, this one from the next time
+    io->value[0] -= t_self_rchar;
+    t_self_rchar += n;
+}
+
+static void io_read(uint64_t flags, struct HW_measure* measure) {
+    struct HW_thread_io* io = &t_io;
+    if (io->fd == -1) {
+        if (io->failed || !(g_caps.supported & HW_PROFILE_IO)) {
+            return;
+        }
+        io->fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+        if (io->fd == -1) {
+            log_limited("%s: Failed to open /proc/thread-self/io\n", __func__);
+            io->failed = true;
+            return;
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (io->read_ns == 0 || now - io->read_ns >= __atomic_load_n(&g_io_interval_ns, __ATOMIC_RELAXED)) {
+        io_refresh(io);
+        io->read_ns = now;
+    }
+    for (int k = 0; k < 4; k++) {
+        if (flags & (1ULL << (CPUTRACE_RESULT_RCHAR + k))) {
+            measure->value[CPUTRACE_RESULT_RCHAR + k] = io->value[k];
+        }
+    }
+}
+
+static void HW_thread_read(uint64_t flags, struct HW_measure* measure) {
+    struct HW_ctx* ctx = &t_counters.ctx;
+    measure->kernel_valid = 0;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        measure->value[i] = 0;
+        measure->kernel[i] = 0;
+        if (!(flags & (1ULL << i))) {
+            continue;
+        }
+        if (hw_events[i].type == HW_EVENT_CLOCK) {
+            struct timespec ts;
+            clock_gettime((clockid_t)hw_events[i].config, &ts);
+            measure->value[i] = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            continue;
+        }
+        if (hw_events[i].type == HW_EVENT_SWITCH || hw_events[i].type == HW_EVENT_RUSAGE ||
+            hw_events[i].type == HW_EVENT_IO) {
+            continue;  // read below, once per source
+        }
+        if (ctx->fd[i] == -1) {
+            if (t_counters.failed & (1ULL << i)) {
+                continue;
+            }
+            struct perf_event_attr pe;
+            HW_event_attr(&pe, i);
+            ctx->fd[i] = perf_event_open(&pe, 0, -1, -1, 0);
+            if (ctx->fd[i] == -1) {
+                t_counters.failed |= 1ULL << i;
+                log_limited("%s: Failed to open %s counter\n", __func__, hw_events[i].short_name);
+                continue;
+            }
+            ctx->conf.capture[i] = true;
+            if (pe.exclude_kernel) {
+                t_counters.user_only |= 1ULL << i;
+            }
+        }
+        long long value;
+        if (read(ctx->fd[i], &value, sizeof(value)) == -1) {
+            log_limited("%s: read failed for %s: %s\n", __func__, hw_events[i].short_name, strerror(errno));
+        } else {
+            measure->value[i] = value;
+            t_self_rchar += sizeof(value);
+        }
+        if (g_ksplit.enabled && hw_events[i].type == PERF_TYPE_HARDWARE) {
+            HW_kernel_read(i, measure);
+            // A user-only counter plus its kernel sibling make the total
+            if ((t_counters.user_only & measure->kernel_valid) & (1ULL << i)) {
+                measure->value[i] += measure->kernel[i];
+            }
+        }
+    }
+    if (flags & (HW_PROFILE_OFFCPU_BLOCKED | HW_PROFILE_OFFCPU_PREEMPTED)) {
+        switches_read(flags, measure);
+    }
+    if (flags & HW_PROFILE_RUSAGE) {
+        rusage_read(flags, measure);
+    }
+    if (flags & HW_PROFILE_IO) {
+        io_read(flags, measure);
+    }
+}
+
+// Hotspot sampling. Each thread owns one sampling event and its mmap ring;
+// the event is enabled by the outermost sampling scope and the ring is
+// drained into the active anchor whenever the scope ends or a nested
+// sampling scope takes over.
+
+static struct {
+    bool enabled;
+    uint32_t type;
+    uint64_t config;
+    uint64_t period;
+    uint64_t generation;
+} g_sampling;
+
+struct HW_thread_sampler {
+    int fd;
+    void* ring;
+    size_t ring_size;
+    uint64_t generation;
+    uint64_t failed_generation;
+    int anchor;
+
+    HW_thread_sampler() : fd(-1), ring(NULL), ring_size(0), generation(0), failed_generation(0), anchor(-1) {}
+    ~HW_thread_sampler() { close_event(); }
+    void close_event() {
+        if (ring) {
+            munmap(ring, ring_size);
+            ring = NULL;
+        }
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+static thread_local struct HW_thread_sampler t_sampler;
+
+int cputrace_sampling_enable(uint32_t type, uint64_t config, uint64_t period) {
+    if (period == 0) {
+        fprintf(stderr, "%s: period must be non-zero\n", __func__);
+        return -1;
+    }
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    g_sampling.type = type;
+    g_sampling.config = config;
+    g_sampling.period = period;
+    __atomic_add_fetch(&g_sampling.generation, 1, __ATOMIC_RELEASE);
+    g_sampling.enabled = true;
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return 0;
+}
+
+void cputrace_sampling_disable(void) {
+    g_sampling.enabled = false;
+}
+
+static bool sampler_open(struct HW_thread_sampler* s) {
+    uint64_t generation = __atomic_load_n(&g_sampling.generation, __ATOMIC_ACQUIRE);
+    if (s->fd != -1 && s->generation == generation) {
+        return true;
+    }
+    if (s->failed_generation == generation) {
+        return false;
+    }
+    s->close_event();
+
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = g_sampling.type;
+    pe.config = g_sampling.config;
+    pe.sample_period = g_sampling.period;
+    pe.sample_type = PERF_SAMPLE_IP;
+    pe.disabled = 1;
+    mode_attr(&pe);
+    s->fd = perf_event_open(&pe, 0, -1, -1, 0);
+    if (s->fd == -1) {
+        log_limited("%s: Failed to open sampling event\n", __func__);
+        s->failed_generation = generation;
+        return false;
+    }
+    s->ring = ring_map(s->fd, &s->ring_size);
+    if (!s->ring) {
+        s->close_event();
+        s->failed_generation = generation;
+        return false;
+    }
+    s->generation = generation;
+    return true;
+}
+
+static void sample_ip_add(struct cputrace_sample_stats* samples, uint64_t ip) {
+    uint32_t h = (uint32_t)((ip * 0x9E3779B97F4A7C15ULL) >> 32) % CPUTRACE_MAX_SAMPLE_IPS;
+    for (int p = 0; p < CPUTRACE_MAX_SAMPLE_IPS; p++) {
+        struct cputrace_sample_ip* e = &samples->ips[(h + p) % CPUTRACE_MAX_SAMPLE_IPS];
+        if (e->count == 0) {
+            e->ip = ip;
+        }
+        if (e->ip == ip) {
+            e->count++;
+            samples->samples++;
+            return;
+        }
+    }
+    samples->dropped++;
+}
+
+// Moves every record in the ring to the anchor's sample table
+static void sampler_drain(struct HW_thread_sampler* s, int index) {
+    struct perf_event_mmap_page* hdr = (struct perf_event_mmap_page*)s->ring;
+    if (__atomic_load_n(&hdr->data_head, __ATOMIC_ACQUIRE) == hdr->data_tail) {
+        return;
+    }
+    struct cputrace_anchor* anchor = &g_profiler.anchors[index];
+    pthread_mutex_lock(&anchor->mutex);
+    ring_drain(s->ring, [anchor](const struct perf_event_header* eh, const uint64_t* payload) {
+        if (eh->type == PERF_RECORD_SAMPLE) {
+            sample_ip_add(&anchor->stats.samples, payload[0]);
+        } else if (eh->type == PERF_RECORD_LOST) {
+            anchor->stats.samples.lost += payload[1];
+        }
+    });
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+// Returns the anchor that was sampling before (-1 for none), or -2 when
+// sampling is unavailable
+static int sampler_begin(int index) {
+    struct HW_thread_sampler* s = &t_sampler;
+    if (!sampler_open(s)) {
+        return -2;
+    }
+    int prev = s->anchor;
+    if (prev >= 0) {
+        sampler_drain(s, prev);
+    } else {
+        ioctl(s->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    s->anchor = index;
+    return prev;
+}
+
+static void sampler_end(int index, int prev) {
+    struct HW_thread_sampler* s = &t_sampler;
+    if (s->fd == -1 || s->anchor != index) {
+        return;  // reopened by a new configuration meanwhile
+    }
+    if (prev < 0) {
+        ioctl(s->fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    sampler_drain(s, index);
+    s->anchor = prev;
+}
+
+// Top-down lite: the level-1 breakdown of issue slots into retiring, bad
+// speculation, frontend bound and backend bound. One event group per
+// thread, so the events are always counted over the same window; ratios
+// stay right even when the group is multiplexed. Two event sets:
+//  - Intel Core from Sandy Bridge to before Ice Lake, checked by model,
+//    from the kernel's topdown-* event aliases:
+//    4 slots per cycle, UOPS_ISSUED.ANY, UOPS_RETIRED.RETIRE_SLOTS,
+//    IDQ_UOPS_NOT_DELIVERED.CORE and INT_MISC.RECOVERY_CYCLES.
+//  - The generic stalled-cycles events, where the PMU has both (AMD, some
+//    Arm cores). Bad speculation is then estimated from branch misses at a
+//    fixed penalty, and retiring is what is left.
+#define TOPDOWN_WIDTH 4
+#define TOPDOWN_BMISS_PENALTY 20
+
+enum topdown_method { TOPDOWN_NONE, TOPDOWN_INTEL_SLOTS, TOPDOWN_STALLED_CYCLES };
+
+struct topdown_event {
+    uint32_t type;
+    uint64_t config;
+};
+
+// Slot 0 is always cycles
+static const struct topdown_event topdown_events[3][CPUTRACE_TOPDOWN_EVENTS] = {
+    {},
+    {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_RAW, 0x010e },              // UOPS_ISSUED.ANY
+        { PERF_TYPE_RAW, 0x02c2 },              // UOPS_RETIRED.RETIRE_SLOTS
+        { PERF_TYPE_RAW, 0x019c },              // IDQ_UOPS_NOT_DELIVERED.CORE
+        { PERF_TYPE_RAW, 0x0100030d },          // INT_MISC.RECOVERY_CYCLES, cmask=1
+    },
+    {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    },
+};
+
+static const char* const topdown_method_names[] = { "unsupported", "intel-slots", "stalled-cycles" };
+
+static struct {
+    bool enabled;
+    int method;
+    char reason[96];    // why the breakdown is unsupported
+} g_topdown;
+
+struct topdown_read_format {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t value[CPUTRACE_TOPDOWN_EVENTS];
+};
+
+static void topdown_attr(struct perf_event_attr* pe, const struct topdown_event* ev, bool leader) {
+    memset(pe, 0, sizeof(*pe));
+    pe->size = sizeof(*pe);
+    pe->type = ev->type;
+    pe->config = ev->config;
+    pe->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    pe->disabled = leader ? 1 : 0;
+    mode_attr(pe);
+}
+
+// Opens the group of `method` on the calling thread; fds[0] is the leader
+static bool topdown_open(int method, int* fds) {
+    for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+        fds[k] = -1;
+    }
+    for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+        struct perf_event_attr pe;
+        topdown_attr(&pe, &topdown_events[method][k], k == 0);
+        fds[k] = syscall(__NR_perf_event_open, &pe, 0, -1, k == 0 ? -1 : fds[0], 0);
+        if (fds[k] == -1) {
+            int err = errno;
+            for (int j = 0; j < k; j++) {
+                close(fds[j]);
+                fds[j] = -1;
+            }
+            errno = err;
+            return false;
+        }
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+// Core models from Sandy Bridge up to, not including, Ice Lake: those whose
+// raw encodings topdown_events[TOPDOWN_INTEL_SLOTS] uses
+static const int topdown_intel_models[] = {
+    0x2a, 0x2d,                     // Sandy Bridge
+    0x3a, 0x3e,                     // Ivy Bridge
+    0x3c, 0x3f, 0x45, 0x46,         // Haswell
+    0x3d, 0x47, 0x4f, 0x56,         // Broadwell
+    0x4e, 0x5e, 0x55,               // Skylake, Cascade Lake
+    0x8e, 0x9e, 0xa5, 0xa6,         // Kaby Lake, Coffee Lake, Comet Lake
+};
+
+static bool cpu_has_intel_slots(void) {
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    if (!f) {
+        return false;
+    }
+    char line[256];
+    bool intel = false;
+    int family = -1;
+    int model = -1;
+    while (fgets(line, sizeof(line), f) && (family < 0 || model < 0)) {
+        const char* colon = strchr(line, ':');
+        if (strncmp(line, "vendor_id", 9) == 0) {
+            intel = strstr(line, "GenuineIntel") != NULL;
+        } else if (strncmp(line, "cpu family", 10) == 0) {
+            family = colon ? atoi(colon + 1) : -1;
+        } else if (strncmp(line, "model\t", 6) == 0) {
+            model = colon ? atoi(colon + 1) : -1;
+        }
+    }
+    fclose(f);
+    if (!intel || family != 6) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(topdown_intel_models) / sizeof(topdown_intel_models[0]); i++) {
+        if (model == topdown_intel_models[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int cputrace_topdown_enable(void) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    int fds[CPUTRACE_TOPDOWN_EVENTS];
+    g_topdown.method = TOPDOWN_NONE;
+    g_topdown.reason[0] = '\0';
+    if (cpu_has_intel_slots() && topdown_open(TOPDOWN_INTEL_SLOTS, fds)) {
+        g_topdown.method = TOPDOWN_INTEL_SLOTS;
+    } else if (topdown_open(TOPDOWN_STALLED_CYCLES, fds)) {
+        g_topdown.method = TOPDOWN_STALLED_CYCLES;
+    } else {
+        snprintf(g_topdown.reason, sizeof(g_topdown.reason), "no stalled-cycles events (%s)", strerror(errno));
+    }
+    if (g_topdown.method != TOPDOWN_NONE) {
+        for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+            close(fds[k]);
+        }
+    }
+    g_topdown.enabled = true;
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return g_topdown.method == TOPDOWN_NONE ? -1 : g_topdown.method;
+}
+
+void cputrace_topdown_disable(void) {
+    g_topdown.enabled = false;
+}
+
+struct HW_thread_topdown {
+    int fd[CPUTRACE_TOPDOWN_EVENTS];
+    int method;     // of the open group
+    bool failed;
+
+    HW_thread_topdown() : method(TOPDOWN_NONE), failed(false) {
+        for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+            fd[k] = -1;
+        }
+    }
+    ~HW_thread_topdown() {
+        for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+            if (fd[k] != -1) {
+                close(fd[k]);
+            }
+        }
+    }
+};
+
+static thread_local struct HW_thread_topdown t_topdown;
+
+// Current group values followed by time_running; false without a group
+static bool topdown_read(uint64_t* values) {
+    struct HW_thread_topdown* td = &t_topdown;
+    if (g_topdown.method == TOPDOWN_NONE) {
+        return false;
+    }
+    if (td->fd[0] == -1) {
+        if (td->failed) {
+            return false;
+        }
+        if (!topdown_open(g_topdown.method, td->fd)) {
+            log_limited("%s: Failed to open top-down group: %s\n", __func__, strerror(errno));
+            td->failed = true;
+            return false;
+        }
+        td->method = g_topdown.method;
+    }
+    struct topdown_read_format rf;
+    if (read(td->fd[0], &rf, sizeof(rf)) != (ssize_t)sizeof(rf)) {
+        return false;
+    }
+    t_self_rchar += sizeof(rf);
+    for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+        values[k] = rf.value[k];
+    }
+    values[CPUTRACE_TOPDOWN_EVENTS] = rf.time_running;
+    return true;
+}
+
+// Level-1 shares in percent: retiring, bad speculation, frontend, backend
+static bool topdown_breakdown(const struct cputrace_topdown_stats* td, double* pct) {
+    const uint64_t* v = td->sum;
+    double cycles = (double)v[0];
+    if (cycles == 0) {
+        return false;
+    }
+    double retiring, bad_spec, frontend;
+    if (g_topdown.method == TOPDOWN_INTEL_SLOTS) {
+        double slots = TOPDOWN_WIDTH * cycles;
+        retiring = v[2] / slots;
+        bad_spec = ((double)v[1] - (double)v[2] + TOPDOWN_WIDTH * (double)v[4]) / slots;
+        frontend = v[3] / slots;
+    } else if (g_topdown.method == TOPDOWN_STALLED_CYCLES) {
+        frontend = v[2] / cycles;
+        bad_spec = std::min(1.0 - frontend, TOPDOWN_BMISS_PENALTY * (double)v[4] / cycles);
+        retiring = 1.0 - frontend - bad_spec - v[3] / cycles;
+    } else {
+        return false;
+    }
+    double parts[3] = { retiring, bad_spec, frontend };
+    double used = 0;
+    for (int k = 0; k < 3; k++) {
+        parts[k] = std::max(0.0, std::min(1.0 - used, parts[k]));
+        used += parts[k];
+        pct[k] = 100.0 * parts[k];
+    }
+    pct[3] = 100.0 * (1.0 - used);
+    return true;
+}
+
+// Caller contexts, see cputrace_callers_enable
+static struct {
+    bool enabled;
+    int depth;
+} g_callers;
+
+int cputrace_callers_enable(int depth) {
+    if (depth < 1 || depth > CPUTRACE_CALLER_DEPTH) {
+        fprintf(stderr, "%s: depth must be 1 to %d\n", __func__, CPUTRACE_CALLER_DEPTH);
+        return -1;
+    }
+    g_callers.depth = depth;
+    g_callers.enabled = true;
+    return 0;
+}
+
+void cputrace_callers_disable(void) {
+    g_callers.enabled = false;
+}
+
+// Bounds of the thread's stack, looked up on its first walk
+static thread_local uintptr_t t_stack_lo, t_stack_hi;
+
+static void thread_stack_bounds(void) {
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    t_stack_lo = t_stack_hi = 1;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return;
+    }
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        t_stack_lo = (uintptr_t)addr;
+        t_stack_hi = (uintptr_t)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Walks the saved frame pointers up from `frame`, the scope constructor's
+// own frame, and stores up to `depth` return addresses, starting with the
+// one into the caller of the scope's function. Every step must move up the
+// thread's stack, so a function built without frame pointers ends the walk
+// (or, at worst, adds a bogus frame) but cannot make it fault or loop; a
+// scope on a foreign stack, such as a coroutine's, records no frames.
+// Returns the FNV-1a hash of the addresses.
+static uint64_t caller_walk(const void* frame, int depth, uint64_t* pc) {
+    if (t_stack_hi == 0) {
+        thread_stack_bounds();
+    }
+    uint64_t signature = 0xcbf29ce484222325ULL;
+    const uintptr_t* fp = (const uintptr_t*)frame;
+    int n = 0;
+    if ((uintptr_t)fp >= t_stack_lo && (uintptr_t)fp < t_stack_hi) {
+        while (n < depth) {
+            uintptr_t next = fp[0];
+            if (next <= (uintptr_t)fp || next > t_stack_hi - 2 * sizeof(uintptr_t) ||
+                (next & (sizeof(uintptr_t) - 1)) != 0) {
+                break;
+            }
+            fp = (const uintptr_t*)next;
+            if (fp[1] == 0) {
+                break;
+            }
+            pc[n++] = fp[1];
+            signature = (signature ^ fp[1]) * 0x100000001b3ULL;
+        }
+    }
+    for (int k = n; k < CPUTRACE_CALLER_DEPTH; k++) {
+        pc[k] = 0;
+    }
+    return signature;
+}
+
+// Each thread claims a slot and captures its kernel name on its first
+// recorded scope; threads beyond the table share the last slot.
+static thread_local int t_thread_slot = -1;
+
+static int cputrace_thread_slot(void) {
+    if (t_thread_slot >= 0) {
+        return t_thread_slot;
+    }
+    int slot = __atomic_fetch_add(&g_thread_count, 1, __ATOMIC_RELAXED);
+    if (slot >= CPUTRACE_MAX_THREADS - 1) {
+        t_thread_slot = CPUTRACE_MAX_THREADS - 1;
+        return t_thread_slot;
+    }
+    struct cputrace_thread_info* info = &g_threads[slot];
+    info->tid = (pid_t)syscall(SYS_gettid);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int)info->tid);
+    FILE* f = fopen(path, "r");
+    if (!f || !fgets(info->name, sizeof(info->name), f)) {
+        snprintf(info->name, sizeof(info->name), "tid-%d", (int)info->tid);
+    }
+    if (f) {
+        fclose(f);
+    }
+    info->name[strcspn(info->name, "\n")] = '\0';
+    t_thread_slot = slot;
+    return slot;
+}
+
+static struct ArenaRegion* arena_region_create(size_t size) {
+    void* start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap failed: %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+    struct ArenaRegion* region = (struct ArenaRegion*)malloc(sizeof(struct ArenaRegion));
+    region->start = start;
+    region->end = (void*)((uintptr_t)start + size);
+    region->current = start;
+    region->next = NULL;
+    return region;
+}
+
+static void arena_region_destroy(struct ArenaRegion* region) {
+    munmap(region->start, (uintptr_t)region->end - (uintptr_t)region->start);
+    free(region);
+}
+
+static uint64_t arena_region_size(struct ArenaRegion* region) {
+    return (uintptr_t)region->end - (uintptr_t)region->start;
+}
+
+struct Arena* arena_create(size_t size, bool growable) {
+    struct ArenaRegion* region = arena_region_create(size);
+    if (!region) {
+        fprintf(stderr, "%s: failed to create region\n", __func__);
+        return NULL;
+    }
+    struct Arena* arena = (struct Arena*)malloc(sizeof(struct Arena));
+    arena->growable = growable;
+    arena->regions = region;
+    arena->current_region = region;
+    return arena;
+}
+
+void* arena_alloc(struct Arena* arena, size_t size) {
+    uint64_t possible_end = (uintptr_t)arena->current_region->current + size;
+    if (possible_end > (uintptr_t)arena->current_region->end) {
+        if (!arena->growable) {
+            fprintf(stderr, "%s: allocation failed, not growable\n", __func__);
+            return NULL;
+        }
+        uint64_t new_size = arena_region_size(arena->current_region);
+        if (size > new_size) {
+            new_size = size;
+        }
+        struct ArenaRegion* new_region = arena_region_create(new_size);
+        if (!new_region) {
+            fprintf(stderr, "%s: failed to create new region\n", __func__);
+            return NULL;
+        }
+        arena->current_region->next = new_region;
+        arena->current_region = new_region;
+    }
+    struct ArenaRegion* region = arena->current_region;
+    void* result = region->current;
+    region->current = (void*)((uintptr_t)region->current + size);
+    return result;
+}
+
+void arena_destroy(struct Arena* arena) {
+    struct ArenaRegion* region = arena->regions;
+    while (region) {
+        struct ArenaRegion* next = region->next;
+        arena_region_destroy(region);
+        region = next;
+    }
+    free(arena);
+}
+
+// Log-linear histogram: values below 4 get their own bucket, above that
+// every power of two is split into 4 buckets (<= 25% relative error).
+int cputrace_hist_bucket(uint64_t value) {
+    if (value < 4) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 1) * 4 + (int)((value >> (msb - 2)) & 3);
+}
+
+uint64_t cputrace_hist_bucket_lower(int bucket) {
+    if (bucket < 4) {
+        return (uint64_t)bucket;
+    }
+    int msb = bucket / 4 + 1;
+    return (uint64_t)(4 + bucket % 4) << (msb - 2);
+}
+
+uint64_t cputrace_hist_percentile(const uint64_t* hist, double p) {
+    uint64_t total = 0;
+    for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(p * (double)total);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            uint64_t lower = cputrace_hist_bucket_lower(b);
+            if (b + 1 >= CPUTRACE_HIST_BUCKETS) {
+                return lower;
+            }
+            // midpoint of the bucket
+            return lower + (cputrace_hist_bucket_lower(b + 1) - lower) / 2;
+        }
+    }
+    return 0;
+}
+
+// Output buffer every dump format renders into, so that no formatting or
+// I/O happens while the profiler or an anchor is locked.
+struct cputrace_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+static void buf_printf(struct cputrace_buf* buf, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void buf_printf(struct cputrace_buf* buf, const char* fmt, ...) {
+    for (;;) {
+        size_t avail = buf->cap - buf->len;
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf->data ? buf->data + buf->len : NULL, avail, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < avail) {
+            buf->len += n;
+            return;
+        }
+        size_t cap = buf->cap ? buf->cap * 2 : 4096;
+        while (cap - buf->len <= (size_t)n) {
+            cap *= 2;
+        }
+        char* data = (char*)realloc(buf->data, cap);
+        if (!data) {
+            fprintf(stderr, "%s: out of memory\n", __func__);
+            return;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+static void format_uint64_with_commas(uint64_t value, char* buf, size_t buf_size) {
+    char temp[32];
+    snprintf(temp, sizeof(temp), "%" PRIu64, value);
+    int len = strlen(temp);
+    int commas = len > 3 ? (len - 1) / 3 : 0;
+    int out_len = len + commas;
+    if (out_len >= (int)buf_size) return;
+    buf[out_len] = '\0';
+    int j = out_len - 1;
+    int k = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        buf[j--] = temp[i];
+        k++;
+        if (k % 3 == 0 && i > 0) {
+            buf[j--] = ',';
+        }
+    }
+    while (j >= 0) buf[j--] = ' ';
+}
+
+static void format_double_with_commas(double value, char* buf, size_t buf_size) {
+    char temp[32];
+    snprintf(temp, sizeof(temp), "%.1f", value);
+    int len = strlen(temp);
+    int dot_pos = len - 2;
+    int whole_len = dot_pos;
+    int commas = whole_len > 3 ? (whole_len - 1) / 3 : 0;
+    int out_len = len + commas;
+    if (out_len >= (int)buf_size) return;
+    buf[out_len] = '\0';
+    int j = out_len - 1;
+    int k = 0;
+    for (int i = len - 1; i >= dot_pos; i--) {
+        buf[j--] = temp[i];
+    }
+    for (int i = dot_pos - 1; i >= 0; i--) {
+        buf[j--] = temp[i];
+        k++;
+        if (k % 3 == 0 && i > 0) {
+            buf[j--] = ',';
+        }
+    }
+    while (j >= 0) buf[j--] = ' ';
+}
+
+static double stats_stddev(const struct cputrace_stats* stats, int i) {
+    if (stats->call_count < 2) {
+        return 0.0;
+    }
+    double n = (double)stats->call_count;
+    double mean = (double)stats->sum[i] / n;
+    double var = (stats->sumsq[i] - n * mean * mean) / (n - 1);
+    return var > 0.0 ? sqrt(var) : 0.0;
+}
+
+// Prints totals and averages. When dist is given (anchor totals, not the
+// per-thread or per-CPU breakdowns) the spread of the per-call values is
+// printed as well.
+static void print_metrics(struct cputrace_buf* buf, const uint64_t* sum, uint64_t call_count,
+                          const char* indent, const struct cputrace_stats* dist) {
+    char buffer[32];
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (sum[i] == 0) {
+            continue;
+        }
+        format_uint64_with_commas(sum[i], buffer, sizeof(buffer));
+        buf_printf(buf, "%s %15s %s\n", indent, buffer, hw_events[i].name);
+        double avg = static_cast<double>(sum[i]) / call_count;
+        format_double_with_commas(avg, buffer, sizeof(buffer));
+        buf_printf(buf, "%s %15s avg %s\n", indent, buffer, hw_events[i].name);
+        if (!dist || call_count < 2) {
+            continue;
+        }
+        format_double_with_commas(stats_stddev(dist, i), buffer, sizeof(buffer));
+        buf_printf(buf, "%s %15s stddev %s\n", indent, buffer, hw_events[i].name);
+        format_uint64_with_commas(cputrace_hist_percentile(dist->hist[i], 0.50), buffer, sizeof(buffer));
+        buf_printf(buf, "%s %15s p50 %s\n", indent, buffer, hw_events[i].name);
+        format_uint64_with_commas(cputrace_hist_percentile(dist->hist[i], 0.99), buffer, sizeof(buffer));
+        buf_printf(buf, "%s %15s p99 %s\n", indent, buffer, hw_events[i].name);
+    }
+}
+
+static void print_mode_split(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    char user[32], kernel[32];
+    bool header = false;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (stats->split_sum[i] == 0) {
+            continue;
+        }
+        if (!header) {
+            buf_printf(buf, "\n  user/kernel split:\n");
+            header = true;
+        }
+        uint64_t k = std::min(stats->kernel_sum[i], stats->split_sum[i]);
+        format_uint64_with_commas(stats->split_sum[i] - k, user, sizeof(user));
+        format_uint64_with_commas(k, kernel, sizeof(kernel));
+        buf_printf(buf, "   %15s user %15s kernel (%4.1f%% kernel) %s\n", user, kernel,
+                   100.0 * k / stats->split_sum[i], hw_events[i].name);
+    }
+}
+
+// Sums the per-thread stats of every thread named like slot t that has not
+// been visited yet. Returns the number of threads rolled up.
+static int thread_name_rollup(const struct cputrace_stats* stats, int t, bool* done,
+                              struct cputrace_thread_stats* total) {
+    *total = stats->threads[t];
+    int nthreads = 1;
+    for (int u = t + 1; u < CPUTRACE_MAX_THREADS; u++) {
+        if (done[u] || stats->threads[u].call_count == 0 ||
+            strcmp(g_threads[t].name, g_threads[u].name) != 0) {
+            continue;
+        }
+        done[u] = true;
+        nthreads++;
+        total->call_count += stats->threads[u].call_count;
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            total->sum[i] += stats->threads[u].sum[i];
+        }
+    }
+    return nthreads;
+}
+
+static void print_thread_breakdown(struct cputrace_buf* buf, const struct cputrace_stats* stats,
+                                   uint64_t dump_flags) {
+    if (dump_flags & CPUTRACE_DUMP_THREADS) {
+        for (int t = 0; t < CPUTRACE_MAX_THREADS; t++) {
+            const struct cputrace_thread_stats* ts = &stats->threads[t];
+            if (ts->call_count == 0) {
+                continue;
+            }
+            buf_printf(buf, "\n  thread '%s' (tid %d, %" PRIu64 " calls):\n",
+                       g_threads[t].name, (int)g_threads[t].tid, ts->call_count);
+            print_metrics(buf, ts->sum, ts->call_count, "  ", NULL);
+        }
+    }
+    if (dump_flags & CPUTRACE_DUMP_THREAD_NAMES) {
+        bool done[CPUTRACE_MAX_THREADS] = {};
+        for (int t = 0; t < CPUTRACE_MAX_THREADS; t++) {
+            if (done[t] || stats->threads[t].call_count == 0) {
+                continue;
+            }
+            struct cputrace_thread_stats total;
+            int nthreads = thread_name_rollup(stats, t, done, &total);
+            buf_printf(buf, "\n  threads named '%s' (%d threads, %" PRIu64 " calls):\n",
+                       g_threads[t].name, nthreads, total.call_count);
+            print_metrics(buf, total.sum, total.call_count, "  ", NULL);
+        }
+    }
+}
+
+static void format_key_label(const struct cputrace_stats* stats, int k, char* buf, size_t size) {
+    const struct cputrace_key_stats* ks = &stats->keys[k];
+    if (k == CPUTRACE_MAX_KEYS) {
+        snprintf(buf, size, "(other)");
+    } else if (ks->name) {
+        snprintf(buf, size, "%s", ks->name);
+    } else {
+        snprintf(buf, size, "%" PRIu64, ks->slot_key - 1);
+    }
+}
+
+static void print_key_breakdown(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    char label[64];
+    for (int k = 0; k <= CPUTRACE_MAX_KEYS; k++) {
+        const struct cputrace_key_stats* ks = &stats->keys[k];
+        if (ks->call_count == 0) {
+            continue;
+        }
+        format_key_label(stats, k, label, sizeof(label));
+        buf_printf(buf, "\n  key %s (%" PRIu64 " calls):\n", label, ks->call_count);
+        print_metrics(buf, ks->sum, ks->call_count, "  ", NULL);
+    }
+}
+
+#define SAMPLE_TOP 10
+
+struct sample_row {
+    std::string label;
+    uint64_t ip;
+    uint64_t count;
+};
+
+// Hottest addresses and the same samples summed per function, both sorted
+static void sample_rows(const struct cputrace_sample_stats* samples, std::vector<struct sample_row>* ips,
+                        std::vector<struct sample_row>* funcs) {
+    char label[512];
+    for (int k = 0; k < CPUTRACE_MAX_SAMPLE_IPS; k++) {
+        const struct cputrace_sample_ip* e = &samples->ips[k];
+        if (e->count == 0) {
+            continue;
+        }
+        cputrace_symbol_format(e->ip, label, sizeof(label));
+        ips->push_back({ label, e->ip, e->count });
+
+        struct cputrace_symbol sym;
+        cputrace_symbolize(e->ip, &sym);
+        std::string func = sym.name ? sym.name : sym.module ? sym.module : "[unknown]";
+        auto it = std::find_if(funcs->begin(), funcs->end(),
+                               [&func](const struct sample_row& r) { return r.label == func; });
+        if (it == funcs->end()) {
+            funcs->push_back({ func, 0, e->count });
+        } else {
+            it->count += e->count;
+        }
+    }
+    auto by_count = [](const struct sample_row& a, const struct sample_row& b) { return a.count > b.count; };
+    std::sort(ips->begin(), ips->end(), by_count);
+    std::sort(funcs->begin(), funcs->end(), by_count);
+}
+
+static void print_samples(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    const struct cputrace_sample_stats* samples = &stats->samples;
+    if (samples->samples == 0 && samples->lost == 0) {
+        return;
+    }
+    std::vector<struct sample_row> ips, funcs;
+    sample_rows(samples, &ips, &funcs);
+    buf_printf(buf, "\n  hotspots (%" PRIu64 " samples", samples->samples);
+    if (samples->lost || samples->dropped) {
+        buf_printf(buf, ", %" PRIu64 " lost", samples->lost + samples->dropped);
+    }
+    buf_printf(buf, "):\n");
+    double total = samples->samples ? (double)samples->samples : 1.0;
+    for (size_t k = 0; k < ips.size() && k < SAMPLE_TOP; k++) {
+        buf_printf(buf, "    %5.1f%%  %s\n", 100.0 * ips[k].count / total, ips[k].label.c_str());
+    }
+    buf_printf(buf, "  by function:\n");
+    for (size_t k = 0; k < funcs.size() && k < SAMPLE_TOP; k++) {
+        buf_printf(buf, "    %5.1f%%  %s\n", 100.0 * funcs[k].count / total, funcs[k].label.c_str());
+    }
+}
+
+static void format_timestamp(uint64_t ns, char* buf, size_t size) {
+    time_t sec = (time_t)(ns / 1000000000ULL);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%06u", (unsigned)((ns % 1000000000ULL) / 1000));
+}
+
+// Top-K entries, most expensive first
+static int topk_sorted(const struct cputrace_stats* stats, const struct cputrace_topk_entry** out) {
+    int n = (int)stats->topk_count;
+    for (int k = 0; k < n; k++) {
+        out[k] = &stats->topk[k];
+    }
+    int metric = stats->topk_metric;
+    std::sort(out, out + n, [metric](const struct cputrace_topk_entry* a, const struct cputrace_topk_entry* b) {
+        return a->value[metric] > b->value[metric];
+    });
+    return n;
+}
+
+static void print_topk(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    const struct cputrace_topk_entry* entries[CPUTRACE_TOPK];
+    int n = topk_sorted(stats, entries);
+    if (n == 0) {
+        return;
+    }
+    char when[64];
+    char buffer[32];
+    buf_printf(buf, "\n  slowest calls by %s:\n", hw_events[stats->topk_metric].name);
+    for (int k = 0; k < n; k++) {
+        const struct cputrace_topk_entry* e = entries[k];
+        format_timestamp(e->timestamp_ns, when, sizeof(when));
+        buf_printf(buf, "    %s thread '%s' (tid %d)", when, g_threads[e->thread].name,
+                   (int)g_threads[e->thread].tid);
+        if (e->tag) {
+            buf_printf(buf, " tag %" PRIu64, e->tag);
+        }
+        buf_printf(buf, "\n");
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (e->value[i] == 0) {
+                continue;
+            }
+            format_uint64_with_commas(e->value[i], buffer, sizeof(buffer));
+            buf_printf(buf, "    %15s %s\n", buffer, hw_events[i].name);
+        }
+    }
+}
+
+// Off-CPU time is wall time not covered by the task clock
+static uint64_t stats_offcpu(const struct cputrace_stats* stats) {
+    uint64_t wall = stats->sum[CPUTRACE_RESULT_WALL];
+    uint64_t task = stats->sum[CPUTRACE_RESULT_TASK];
+    return wall > task ? wall - task : 0;
+}
+
+static void print_offcpu(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    if (stats->sum[CPUTRACE_RESULT_TASK] == 0 || stats->call_count == 0) {
+        return;
+    }
+    char buffer[32];
+    uint64_t off = stats_offcpu(stats);
+    format_uint64_with_commas(off, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s off-cpu-ns (%.1f%% of wall)\n", buffer,
+               100.0 * off / stats->sum[CPUTRACE_RESULT_WALL]);
+    format_double_with_commas((double)off / stats->call_count, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s avg off-cpu-ns\n", buffer);
+}
+
+static void print_numa_breakdown(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    for (int n = 0; n < CPUTRACE_MAX_NODES; n++) {
+        const struct cputrace_node_stats* ns = &stats->nodes[n];
+        if (ns->call_count == 0) {
+            continue;
+        }
+        buf_printf(buf, "\n  node %d (%" PRIu64 " calls; cpu:calls", n, ns->call_count);
+        for (int c = 0; c < CPUTRACE_MAX_CPUS; c++) {
+            if (stats->cpu_calls[c] > 0 && numa_node_of(c) == n) {
+                buf_printf(buf, " %d:%" PRIu64, c, stats->cpu_calls[c]);
+            }
+        }
+        buf_printf(buf, "):\n");
+        print_metrics(buf, ns->sum, ns->call_count, "  ", NULL);
+    }
+    if (stats->migrated.call_count > 0) {
+        buf_printf(buf, "\n  migrated mid-call (%" PRIu64 " calls, %" PRIu64 " across nodes):\n",
+                   stats->migrated.call_count, stats->node_migrated);
+        print_metrics(buf, stats->migrated.sum, stats->migrated.call_count, "  ", NULL);
+    }
+}
+
+static void print_alloc(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    const struct cputrace_alloc_stats* as = &stats->alloc;
+    if (as->call_count == 0) {
+        return;
+    }
+    char buffer[32];
+    format_uint64_with_commas(as->count, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s allocations (%.1f per call)\n", buffer, (double)as->count / as->call_count);
+    format_uint64_with_commas(as->bytes, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s bytes allocated\n", buffer);
+    format_uint64_with_commas(as->freed, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s bytes freed\n", buffer);
+    format_double_with_commas((double)as->peak_sum / as->call_count, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s avg peak outstanding bytes\n", buffer);
+    format_uint64_with_commas(as->peak_max, buffer, sizeof(buffer));
+    buf_printf(buf, " %15s max peak outstanding bytes\n", buffer);
+}
+
+// Contended locks of an anchor, longest total wait first
+static size_t lock_sites_sorted(const struct cputrace_lock_stats* ls, const struct cputrace_lock_site** out) {
+    size_t n = 0;
+    for (int k = 0; k <= CPUTRACE_LOCK_SITES; k++) {
+        if (ls->sites[k].contended > 0) {
+            out[n++] = &ls->sites[k];
+        }
+    }
+    std::sort(out, out + n, [](const struct cputrace_lock_site* a, const struct cputrace_lock_site* b) {
+        return a->wait_ns > b->wait_ns;
+    });
+    return std::min(n, (size_t)CPUTRACE_TOPK);
+}
+
+static void format_lock_label(const struct cputrace_lock_stats* ls, const struct cputrace_lock_site* site,
+                              char* buf, size_t size) {
+    if (site == &ls->sites[CPUTRACE_LOCK_SITES]) {
+        snprintf(buf, size, "(other)");
+    } else {
+        snprintf(buf, size, "0x%" PRIx64, site->lock);
+    }
+}
+
+static void print_locks(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    const struct cputrace_lock_stats* ls = &stats->lock;
+    if ((ls->contended == 0 && ls->cond_waits == 0) || stats->call_count == 0) {
+        return;
+    }
+    char buffer[32], label[32];
+    if (ls->contended > 0) {
+        format_uint64_with_commas(ls->contended, buffer, sizeof(buffer));
+        buf_printf(buf, " %15s contended lock acquires (%.2f per call)\n", buffer,
+                   (double)ls->contended / stats->call_count);
+        format_uint64_with_commas(ls->wait_ns, buffer, sizeof(buffer));
+        buf_printf(buf, " %15s lock-wait-ns", buffer);
+        if (stats->sum[CPUTRACE_RESULT_WALL] > 0) {
+            buf_printf(buf, " (%.1f%% of wall)", 100.0 * ls->wait_ns / stats->sum[CPUTRACE_RESULT_WALL]);
+        }
+        buf_printf(buf, "\n");
+    }
+    if (ls->cond_waits > 0) {
+        format_uint64_with_commas(ls->cond_waits, buffer, sizeof(buffer));
+        buf_printf(buf, " %15s condition waits\n", buffer);
+        format_uint64_with_commas(ls->cond_wait_ns, buffer, sizeof(buffer));
+        buf_printf(buf, " %15s cond-wait-ns\n", buffer);
+    }
+    const struct cputrace_lock_site* sites[CPUTRACE_LOCK_SITES + 1];
+    size_t n = lock_sites_sorted(ls, sites);
+    if (n == 0) {
+        return;
+    }
+    buf_printf(buf, "\n  most contended locks:\n");
+    for (size_t k = 0; k < n; k++) {
+        format_lock_label(ls, sites[k], label, sizeof(label));
+        format_uint64_with_commas(sites[k]->wait_ns, buffer, sizeof(buffer));
+        buf_printf(buf, "    %-18s %15s lock-wait-ns %10" PRIu64 " acquires\n", label, buffer,
+                   sites[k]->contended);
+    }
+}
+
+static void print_topdown(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    const struct cputrace_topdown_stats* td = &stats->topdown;
+    if (td->call_count == 0) {
+        return;
+    }
+    double pct[4];
+    if (g_topdown.method == TOPDOWN_NONE) {
+        buf_printf(buf, "\n  top-down: unsupported on this CPU (%s)\n", g_topdown.reason);
+    } else if (!topdown_breakdown(td, pct)) {
+        buf_printf(buf, "\n  top-down (%s): no cycles counted\n", topdown_method_names[g_topdown.method]);
+    } else {
+        buf_printf(buf, "\n  top-down (%s):\n", topdown_method_names[g_topdown.method]);
+        buf_printf(buf, "    %5.1f%% retiring\n    %5.1f%% bad-speculation\n"
+                   "    %5.1f%% frontend-bound\n    %5.1f%% backend-bound\n", pct[0], pct[1], pct[2], pct[3]);
+    }
+    if (td->unscheduled > 0 && g_topdown.method != TOPDOWN_NONE) {
+        buf_printf(buf, "    %" PRIu64 " of %" PRIu64 " calls not counted (group not scheduled)\n",
+                   td->unscheduled, td->call_count);
+    }
+}
+
+#define CALLER_TOP 10
+
+// Metric the caller contexts are ranked and folded by: cycles when they were
+// counted, else wall time, else whatever a metric filter left
+static int callers_metric(const struct cputrace_stats* stats) {
+    if (stats->sum[CPUTRACE_RESULT_CYC] > 0) {
+        return CPUTRACE_RESULT_CYC;
+    }
+    if (stats->sum[CPUTRACE_RESULT_WALL] > 0) {
+        return CPUTRACE_RESULT_WALL;
+    }
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (stats->sum[i] > 0) {
+            return i;
+        }
+    }
+    return CPUTRACE_RESULT_WALL;
+}
+
+// Contexts with calls, the overflow slot included, most expensive first
+static size_t callers_sorted(const struct cputrace_stats* stats, int metric,
+                             const struct cputrace_caller_stats** out) {
+    size_t n = 0;
+    for (int c = 0; c <= CPUTRACE_MAX_CALLERS; c++) {
+        if (stats->callers[c].call_count > 0) {
+            out[n++] = &stats->callers[c];
+        }
+    }
+    std::sort(out, out + n, [metric](const struct cputrace_caller_stats* a, const struct cputrace_caller_stats* b) {
+        return a->sum[metric] > b->sum[metric];
+    });
+    return n;
+}
+
+// A return address points after its call, so the call site is at pc - 1.
+// Folded stacks want bare function names, which is what flame graphs merge.
+static void format_caller_frame(uint64_t pc, bool offset, char* buf, size_t size) {
+    if (offset) {
+        cputrace_symbol_format(pc - 1, buf, size);
+        return;
+    }
+    struct cputrace_symbol sym;
+    if (cputrace_symbolize(pc - 1, &sym) && sym.name) {
+        snprintf(buf, size, "%s", sym.name);
+    } else if (sym.module) {
+        const char* base = strrchr(sym.module, '/');
+        snprintf(buf, size, "%s+0x%" PRIx64, base ? base + 1 : sym.module, sym.offset);
+    } else {
+        snprintf(buf, size, "0x%" PRIx64, pc - 1);
+    }
+}
+
+static bool caller_overflow(const struct cputrace_stats* stats, const struct cputrace_caller_stats* cs) {
+    return cs == &stats->callers[CPUTRACE_MAX_CALLERS];
+}
+
+static void print_callers(struct cputrace_buf* buf, const struct cputrace_stats* stats) {
+    const struct cputrace_caller_stats* callers[CPUTRACE_MAX_CALLERS + 1];
+    int metric = callers_metric(stats);
+    size_t n = callers_sorted(stats, metric, callers);
+    if (n == 0) {
+        return;
+    }
+    uint64_t total = 0;
+    for (size_t k = 0; k < n; k++) {
+        total += callers[k]->sum[metric];
+    }
+    char buffer[32];
+    char avg[32];
+    char frame[512];
+    buf_printf(buf, "\n  callers by %s (%zu contexts):\n", hw_events[metric].name, n);
+    for (size_t k = 0; k < n && k < CALLER_TOP; k++) {
+        const struct cputrace_caller_stats* cs = callers[k];
+        format_uint64_with_commas(cs->call_count, buffer, sizeof(buffer));
+        format_uint64_with_commas(cs->sum[metric] / cs->call_count, avg, sizeof(avg));
+        buf_printf(buf, "    %5.1f%% %12s calls  avg %12s  ", total ? 100.0 * cs->sum[metric] / total : 0.0,
+                   buffer, avg);
+        if (caller_overflow(stats, cs)) {
+            buf_printf(buf, "[other contexts]\n");
+            continue;
+        }
+        if (cs->pc[0] == 0) {
+            buf_printf(buf, "[no frame pointers]\n");
+            continue;
+        }
+        for (int d = 0; d < CPUTRACE_CALLER_DEPTH && cs->pc[d]; d++) {
+            format_caller_frame(cs->pc[d], true, frame, sizeof(frame));
+            buf_printf(buf, "%s%s", d ? " <- " : "", frame);
+        }
+        buf_printf(buf, "\n");
+    }
+    if (n > CALLER_TOP) {
+        buf_printf(buf, "    %zu more contexts\n", n - CALLER_TOP);
+    }
+}
+
+static void buf_append(struct cputrace_buf* buf, const void* data, size_t size) {
+    if (buf->cap - buf->len < size) {
+        size_t cap = buf->cap ? buf->cap * 2 : 4096;
+        while (cap - buf->len < size) {
+            cap *= 2;
+        }
+        char* grown = (char*)realloc(buf->data, cap);
+        if (!grown) {
+            fprintf(stderr, "%s: out of memory\n", __func__);
+            return;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, size);
+    buf->len += size;
+}
+
+static void format_text_anchor(struct cputrace_buf* buf, const char* name,
+                               const struct cputrace_stats* stats, uint64_t dump_flags) {
+    const uint64_t overflow_threshold = UINT64_MAX / 2;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (stats->sum[i] > overflow_threshold) {
+            fprintf(stderr, "Warning: Potential overflow in metrics for '%s'\n", name);
+            break;
+        }
+    }
+
+    buf_printf(buf, "\nPerformance counter stats for '%s' (%" PRIu64 " calls):\n\n",
+               name, stats->call_count);
+
+    char buffer[32];
+    print_metrics(buf, stats->sum, stats->call_count, "", stats);
+    print_offcpu(buf, stats);
+    print_alloc(buf, stats);
+    print_locks(buf, stats);
+    print_topdown(buf, stats);
+    print_callers(buf, stats);
+
+    for (int s = 0; s < CPUTRACE_MAX_PERCPU; s++) {
+        const struct cputrace_core_stats* core = &stats->core[s];
+        if (core->call_count == 0) {
+            continue;
+        }
+        buf_printf(buf, "\n  core-wide on cpu %d (%" PRIu64 " calls):\n", core->cpu, core->call_count);
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (core->sum[i] == 0) {
+                continue;
+            }
+            format_uint64_with_commas(core->sum[i], buffer, sizeof(buffer));
+            buf_printf(buf, " %15s core %s\n", buffer, hw_events[i].name);
+            if (stats->sum[i] > 0) {
+                buf_printf(buf, " %14.1f%% of core %s\n",
+                           100.0 * (double)stats->sum[i] / (double)core->sum[i], hw_events[i].name);
+            }
+        }
+    }
+    if (stats->segment_count > stats->call_count) {
+        buf_printf(buf, "\n  %" PRIu64 " on-CPU segments (%.1f per call)\n", stats->segment_count,
+                   (double)stats->segment_count / stats->call_count);
+    }
+    if (stats->core_migrated > 0) {
+        buf_printf(buf, "\n  %" PRIu64 " calls migrated or ran on unmonitored cpus\n", stats->core_migrated);
+    }
+    print_mode_split(buf, stats);
+    print_numa_breakdown(buf, stats);
+    print_key_breakdown(buf, stats);
+    print_thread_breakdown(buf, stats, dump_flags);
+    print_samples(buf, stats);
+    print_topk(buf, stats);
+    buf_printf(buf, "\n");
+}
+
+class cputrace_json_writer : public cputrace_writer {
+public:
+    explicit cputrace_json_writer(struct cputrace_buf* buf) : buf(buf), depth(0) {}
+
+    void open_object_section(const char* name) override { open(name, '{', false); }
+    void open_array_section(const char* name) override { open(name, '[', true); }
+    void close_section() override {
+        bool was_array = in_array[depth];
+        bool had_items = count[depth] > 0;
+        depth--;
+        if (had_items) {
+            newline();
+        }
+        buf_printf(buf, "%c", was_array ? ']' : '}');
+        if (depth == 0) {
+            buf_printf(buf, "\n");
+        }
+    }
+    void dump_unsigned(const char* name, uint64_t value) override {
+        key(name);
+        buf_printf(buf, "%" PRIu64, value);
+    }
+    void dump_int(const char* name, int64_t value) override {
+        key(name);
+        buf_printf(buf, "%" PRId64, value);
+    }
+    void dump_float(const char* name, double value) override {
+        key(name);
+        buf_printf(buf, "%.3f", value);
+    }
+    void dump_string(const char* name, const char* value) override {
+        key(name);
+        quote(value);
+    }
+
+private:
+    static const int max_depth = 16;
+    struct cputrace_buf* buf;
+    int depth;
+    bool in_array[max_depth];
+    int count[max_depth];
+
+    void newline() {
+        buf_printf(buf, "\n%*s", depth * 2, "");
+    }
+    void quote(const char* s) {
+        buf_printf(buf, "\"");
+        for (; *s; s++) {
+            unsigned char c = *s;
+            if (c == '"' || c == '\\') {
+                buf_printf(buf, "\\%c", c);
+            } else if (c < 0x20) {
+                buf_printf(buf, "\\u%04x", c);
+            } else {
+                buf_printf(buf, "%c", c);
+            }
+        }
+        buf_printf(buf, "\"");
+    }
+    void key(const char* name) {
+        if (depth == 0) {
+            return;
+        }
+        if (count[depth]++ > 0) {
+            buf_printf(buf, ",");
+        }
+        newline();
+        if (!in_array[depth]) {
+            quote(name);
+            buf_printf(buf, ": ");
+        }
+    }
+    void open(const char* name, char bracket, bool array) {
+        key(name);
+        buf_printf(buf, "%c", bracket);
+        if (depth + 1 < max_depth) {
+            depth++;
+        }
+        in_array[depth] = array;
+        count[depth] = 0;
+    }
+};
+
+// One row per value: anchor,section,metric,value. The section column holds
+// the path below the anchor, e.g. "threads/bstore_kv_sync:1234".
+class cputrace_csv_writer : public cputrace_writer {
+public:
+    explicit cputrace_csv_writer(struct cputrace_buf* buf) : buf(buf), depth(0) {
+        buf_printf(buf, "anchor,section,metric,value\n");
+    }
+
+    void open_object_section(const char* name) override { push(name); }
+    void open_array_section(const char* name) override { push(name); }
+    void close_section() override {
+        if (depth > 0) {
+            depth--;
+        }
+    }
+    void dump_unsigned(const char* name, uint64_t value) override {
+        row(name);
+        buf_printf(buf, "%" PRIu64 "\n", value);
+    }
+    void dump_int(const char* name, int64_t value) override {
+        row(name);
+        buf_printf(buf, "%" PRId64 "\n", value);
+    }
+    void dump_float(const char* name, double value) override {
+        row(name);
+        buf_printf(buf, "%.3f\n", value);
+    }
+    void dump_string(const char* name, const char* value) override {
+        row(name);
+        field(value);
+        buf_printf(buf, "\n");
+    }
+
+private:
+    static const int max_depth = 16;
+    struct cputrace_buf* buf;
+    int depth;
+    std::string path[max_depth];
+
+    void push(const char* name) {
+        if (depth < max_depth) {
+            path[depth] = name;
+        }
+        depth++;
+    }
+    void field(const char* s) {
+        if (strpbrk(s, ",\"\n") == NULL) {
+            buf_printf(buf, "%s", s);
+            return;
+        }
+        buf_printf(buf, "\"");
+        for (; *s; s++) {
+            buf_printf(buf, *s == '"' ? "\"\"" : "%c", *s);
+        }
+        buf_printf(buf, "\"");
+    }
+    void row(const char* name) {
+        // path[0] is the document root; anchors live in path[1] == "anchors"
+        int first = 1;
+        if (depth > 2 && path[1] == "anchors") {
+            field(path[2].c_str());
+            first = 3;
+        }
+        buf_printf(buf, ",");
+        std::string section;
+        for (int i = first; i < depth && i < max_depth; i++) {
+            if (!section.empty()) {
+                section += '/';
+            }
+            section += path[i];
+        }
+        field(section.c_str());
+        buf_printf(buf, ",");
+        field(name);
+        buf_printf(buf, ",");
+    }
+};
+
+static void dump_metrics(cputrace_writer* w, const uint64_t* sum, uint64_t call_count,
+                         const struct cputrace_stats* dist) {
+    static const struct {
+        const char* prefix;
+        double p;
+    } percentiles[] = { { "p50_", 0.50 }, { "p90_", 0.90 }, { "p99_", 0.99 } };
+
+    w->dump_unsigned("call_count", call_count);
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (sum[i] == 0) {
+            continue;
+        }
+        const char* key = hw_events[i].key;
+        w->dump_unsigned(key, sum[i]);
+        if (call_count) {
+            w->dump_float((std::string("avg_") + key).c_str(), (double)sum[i] / call_count);
+        }
+        if (!dist) {
+            continue;
+        }
+        w->dump_float((std::string("stddev_") + key).c_str(), stats_stddev(dist, i));
+        for (const auto& pct : percentiles) {
+            w->dump_unsigned((std::string(pct.prefix) + key).c_str(),
+                             cputrace_hist_percentile(dist->hist[i], pct.p));
+        }
+    }
+}
+
+// Non-empty histogram buckets keyed by their lower bound, so offline tools
+// can compare or merge distributions.
+static void dump_histograms(cputrace_writer* w, const struct cputrace_stats* stats) {
+    char label[32];
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (stats->sum[i] == 0) {
+            continue;
+        }
+        w->open_object_section((std::string("hist_") + hw_events[i].key).c_str());
+        for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+            if (stats->hist[i][b] == 0) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "%" PRIu64, cputrace_hist_bucket_lower(b));
+            w->dump_unsigned(label, stats->hist[i][b]);
+        }
+        w->close_section();
+    }
+}
+
+static void dump_topk(cputrace_writer* w, const struct cputrace_stats* stats) {
+    const struct cputrace_topk_entry* entries[CPUTRACE_TOPK];
+    int n = topk_sorted(stats, entries);
+    if (n == 0) {
+        return;
+    }
+    char label[32];
+    char when[64];
+    w->dump_string("topk_metric", hw_events[stats->topk_metric].key);
+    w->open_array_section("topk");
+    for (int k = 0; k < n; k++) {
+        const struct cputrace_topk_entry* e = entries[k];
+        snprintf(label, sizeof(label), "%d", k);
+        w->open_object_section(label);
+        w->dump_unsigned("timestamp_ns", e->timestamp_ns);
+        format_timestamp(e->timestamp_ns, when, sizeof(when));
+        w->dump_string("time", when);
+        w->dump_int("tid", g_threads[e->thread].tid);
+        w->dump_string("thread_name", g_threads[e->thread].name);
+        w->dump_unsigned("tag", e->tag);
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (e->value[i] != 0) {
+                w->dump_unsigned(hw_events[i].key, e->value[i]);
+            }
+        }
+        w->close_section();
+    }
+    w->close_section();
+}
+
+static void dump_samples(cputrace_writer* w, const struct cputrace_stats* stats) {
+    const struct cputrace_sample_stats* samples = &stats->samples;
+    if (samples->samples == 0 && samples->lost == 0) {
+        return;
+    }
+    std::vector<struct sample_row> ips, funcs;
+    sample_rows(samples, &ips, &funcs);
+    char label[32];
+    w->open_object_section("samples");
+    w->dump_unsigned("sample_count", samples->samples);
+    w->dump_unsigned("lost", samples->lost);
+    w->dump_unsigned("dropped", samples->dropped);
+    w->open_array_section("hot_ips");
+    for (size_t k = 0; k < ips.size() && k < SAMPLE_TOP; k++) {
+        snprintf(label, sizeof(label), "%zu", k);
+        w->open_object_section(label);
+        w->dump_unsigned("ip", ips[k].ip);
+        w->dump_string("symbol", ips[k].label.c_str());
+        w->dump_unsigned("count", ips[k].count);
+        w->close_section();
+    }
+    w->close_section();
+    w->open_array_section("hot_functions");
+    for (size_t k = 0; k < funcs.size() && k < SAMPLE_TOP; k++) {
+        snprintf(label, sizeof(label), "%zu", k);
+        w->open_object_section(label);
+        w->dump_string("function", funcs[k].label.c_str());
+        w->dump_unsigned("count", funcs[k].count);
+        w->close_section();
+    }
+    w->close_section();
+    w->close_section();
+}
+
+static void dump_numa(cputrace_writer* w, const struct cputrace_stats* stats) {
+    char label[32];
+    bool have_nodes = false;
+    for (int n = 0; n < CPUTRACE_MAX_NODES && !have_nodes; n++) {
+        have_nodes = stats->nodes[n].call_count > 0;
+    }
+    if (have_nodes) {
+        w->open_array_section("numa");
+        for (int n = 0; n < CPUTRACE_MAX_NODES; n++) {
+            const struct cputrace_node_stats* ns = &stats->nodes[n];
+            if (ns->call_count == 0) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "node%d", n);
+            w->open_object_section(label);
+            w->dump_int("node", n);
+            dump_metrics(w, ns->sum, ns->call_count, NULL);
+            w->open_object_section("cpu_calls");
+            for (int c = 0; c < CPUTRACE_MAX_CPUS; c++) {
+                if (stats->cpu_calls[c] > 0 && numa_node_of(c) == n) {
+                    snprintf(label, sizeof(label), "cpu%d", c);
+                    w->dump_unsigned(label, stats->cpu_calls[c]);
+                }
+            }
+            w->close_section();
+            w->close_section();
+        }
+        w->close_section();
+    }
+    if (stats->migrated.call_count > 0) {
+        w->open_object_section("migrated");
+        dump_metrics(w, stats->migrated.sum, stats->migrated.call_count, NULL);
+        w->dump_unsigned("cross_node", stats->node_migrated);
+        w->close_section();
+    }
+}
+
+static void dump_topdown(cputrace_writer* w, const struct cputrace_stats* stats) {
+    const struct cputrace_topdown_stats* td = &stats->topdown;
+    if (td->call_count == 0) {
+        return;
+    }
+    double pct[4];
+    w->open_object_section("topdown");
+    w->dump_string("method", topdown_method_names[g_topdown.method]);
+    if (g_topdown.method == TOPDOWN_NONE) {
+        w->dump_string("reason", g_topdown.reason);
+    } else if (topdown_breakdown(td, pct)) {
+        w->dump_float("retiring_pct", pct[0]);
+        w->dump_float("bad_speculation_pct", pct[1]);
+        w->dump_float("frontend_bound_pct", pct[2]);
+        w->dump_float("backend_bound_pct", pct[3]);
+    }
+    w->dump_unsigned("call_count", td->call_count);
+    w->dump_unsigned("unscheduled", td->unscheduled);
+    w->close_section();
+}
+
+static void dump_callers(cputrace_writer* w, const struct cputrace_stats* stats) {
+    const struct cputrace_caller_stats* callers[CPUTRACE_MAX_CALLERS + 1];
+    int metric = callers_metric(stats);
+    size_t n = callers_sorted(stats, metric, callers);
+    if (n == 0) {
+        return;
+    }
+    char label[32];
+    char frame[512];
+    w->open_object_section("callers");
+    w->dump_string("ranked_by", hw_events[metric].key);
+    w->open_array_section("contexts");
+    for (size_t k = 0; k < n; k++) {
+        const struct cputrace_caller_stats* cs = callers[k];
+        snprintf(label, sizeof(label), "%zu", k);
+        w->open_object_section(label);
+        snprintf(label, sizeof(label), "%016" PRIx64, cs->signature);
+        w->dump_string("signature", caller_overflow(stats, cs) ? "overflow" : label);
+        dump_metrics(w, cs->sum, cs->call_count, NULL);
+        w->open_array_section("frames");
+        for (int d = 0; d < CPUTRACE_CALLER_DEPTH && cs->pc[d]; d++) {
+            snprintf(label, sizeof(label), "%d", d);
+            format_caller_frame(cs->pc[d], true, frame, sizeof(frame));
+            w->dump_string(label, frame);
+        }
+        w->close_section();
+        w->close_section();
+    }
+    w->close_section();
+    w->close_section();
+}
+
+static void dump_locks(cputrace_writer* w, const struct cputrace_stats* stats) {
+    const struct cputrace_lock_stats* ls = &stats->lock;
+    if (ls->contended == 0 && ls->cond_waits == 0) {
+        return;
+    }
+    char label[32];
+    w->open_object_section("locks");
+    w->dump_unsigned("contended", ls->contended);
+    w->dump_unsigned("wait_ns", ls->wait_ns);
+    w->dump_unsigned("cond_waits", ls->cond_waits);
+    w->dump_unsigned("cond_wait_ns", ls->cond_wait_ns);
+    const struct cputrace_lock_site* sites[CPUTRACE_LOCK_SITES + 1];
+    size_t n = lock_sites_sorted(ls, sites);
+    w->open_array_section("top");
+    for (size_t k = 0; k < n; k++) {
+        format_lock_label(ls, sites[k], label, sizeof(label));
+        w->open_object_section(label);
+        w->dump_string("lock", label);
+        w->dump_unsigned("contended", sites[k]->contended);
+        w->dump_unsigned("wait_ns", sites[k]->wait_ns);
+        w->close_section();
+    }
+    w->close_section();
+    w->close_section();
+}
+
+static void dump_anchor(cputrace_writer* w, const char* name, const struct cputrace_stats* stats,
+                        uint64_t dump_flags) {
+    char label[64];
+    w->open_object_section(name);
+    w->dump_string("name", name);
+    dump_metrics(w, stats->sum, stats->call_count, stats);
+    if (stats->sum[CPUTRACE_RESULT_TASK] > 0 && stats->call_count > 0) {
+        w->dump_unsigned("offcpu_ns", stats_offcpu(stats));
+        w->dump_float("avg_offcpu_ns", (double)stats_offcpu(stats) / stats->call_count);
+    }
+    if (stats->alloc.call_count > 0) {
+        const struct cputrace_alloc_stats* as = &stats->alloc;
+        w->open_object_section("alloc");
+        w->dump_unsigned("call_count", as->call_count);
+        w->dump_unsigned("allocations", as->count);
+        w->dump_unsigned("bytes_allocated", as->bytes);
+        w->dump_unsigned("bytes_freed", as->freed);
+        w->dump_float("avg_peak_bytes", (double)as->peak_sum / as->call_count);
+        w->dump_unsigned("max_peak_bytes", as->peak_max);
+        w->close_section();
+    }
+    dump_locks(w, stats);
+    dump_topdown(w, stats);
+    dump_callers(w, stats);
+    dump_histograms(w, stats);
+    if (stats->segment_count > stats->call_count) {
+        w->dump_unsigned("segment_count", stats->segment_count);
+    }
+
+    bool have_core = false;
+    for (int s = 0; s < CPUTRACE_MAX_PERCPU && !have_core; s++) {
+        have_core = stats->core[s].call_count > 0;
+    }
+    if (have_core) {
+        w->open_array_section("core");
+        for (int s = 0; s < CPUTRACE_MAX_PERCPU; s++) {
+            const struct cputrace_core_stats* core = &stats->core[s];
+            if (core->call_count == 0) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "cpu%d", core->cpu);
+            w->open_object_section(label);
+            w->dump_int("cpu", core->cpu);
+            dump_metrics(w, core->sum, core->call_count, NULL);
+            w->close_section();
+        }
+        w->close_section();
+    }
+    if (stats->core_migrated > 0) {
+        w->dump_unsigned("core_migrated", stats->core_migrated);
+    }
+    dump_numa(w, stats);
+
+    bool have_split = false;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST && !have_split; i++) {
+        have_split = stats->split_sum[i] > 0;
+    }
+    if (have_split) {
+        w->open_object_section("mode_split");
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (stats->split_sum[i] == 0) {
+                continue;
+            }
+            uint64_t k = std::min(stats->kernel_sum[i], stats->split_sum[i]);
+            snprintf(label, sizeof(label), "user_%s", hw_events[i].key);
+            w->dump_unsigned(label, stats->split_sum[i] - k);
+            snprintf(label, sizeof(label), "kernel_%s", hw_events[i].key);
+            w->dump_unsigned(label, k);
+        }
+        w->close_section();
+    }
+
+    bool have_keys = false;
+    for (int k = 0; k <= CPUTRACE_MAX_KEYS && !have_keys; k++) {
+        have_keys = stats->keys[k].call_count > 0;
+    }
+    if (have_keys) {
+        w->open_array_section("keys");
+        for (int k = 0; k <= CPUTRACE_MAX_KEYS; k++) {
+            const struct cputrace_key_stats* ks = &stats->keys[k];
+            if (ks->call_count == 0) {
+                continue;
+            }
+            format_key_label(stats, k, label, sizeof(label));
+            w->open_object_section(label);
+            if (k == CPUTRACE_MAX_KEYS) {
+                w->dump_string("key", "(other)");
+            } else if (ks->name) {
+                w->dump_string("key", ks->name);
+            } else {
+                w->dump_unsigned("key", ks->slot_key - 1);
+            }
+            dump_metrics(w, ks->sum, ks->call_count, NULL);
+            w->close_section();
+        }
+        w->close_section();
+    }
+
+    if (dump_flags & CPUTRACE_DUMP_THREADS) {
+        w->open_array_section("threads");
+        for (int t = 0; t < CPUTRACE_MAX_THREADS; t++) {
+            const struct cputrace_thread_stats* ts = &stats->threads[t];
+            if (ts->call_count == 0) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "%s:%d", g_threads[t].name, (int)g_threads[t].tid);
+            w->open_object_section(label);
+            w->dump_int("tid", g_threads[t].tid);
+            w->dump_string("thread_name", g_threads[t].name);
+            dump_metrics(w, ts->sum, ts->call_count, NULL);
+            w->close_section();
+        }
+        w->close_section();
+    }
+    if (dump_flags & CPUTRACE_DUMP_THREAD_NAMES) {
+        bool done[CPUTRACE_MAX_THREADS] = {};
+        w->open_array_section("thread_names");
+        for (int t = 0; t < CPUTRACE_MAX_THREADS; t++) {
+            if (done[t] || stats->threads[t].call_count == 0) {
+                continue;
+            }
+            struct cputrace_thread_stats total;
+            int nthreads = thread_name_rollup(stats, t, done, &total);
+            w->open_object_section(g_threads[t].name);
+            w->dump_string("thread_name", g_threads[t].name);
+            w->dump_int("threads", nthreads);
+            dump_metrics(w, total.sum, total.call_count, NULL);
+            w->close_section();
+        }
+        w->close_section();
+    }
+    dump_samples(w, stats);
+    dump_topk(w, stats);
+    w->close_section();
+}
+
+static int g_topk_metric = CPUTRACE_METRIC_AUTO;
+
+void cputrace_set_topk_metric(int metric) {
+    if (metric != CPUTRACE_METRIC_AUTO && (metric < 0 || metric >= CPUTRACE_RESULT_LAST)) {
+        fprintf(stderr, "%s: invalid metric %d\n", __func__, metric);
+        return;
+    }
+    g_topk_metric = metric;
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called with the anchor mutex held once the call beat the current minimum
+static void topk_insert(struct cputrace_stats* stats, const struct HW_measure* measure,
+                        int thread, uint64_t tag, uint64_t start_time) {
+    int metric = stats->topk_metric;
+    struct cputrace_topk_entry* e;
+    if (stats->topk_count < CPUTRACE_TOPK) {
+        e = &stats->topk[stats->topk_count++];
+    } else {
+        e = &stats->topk[0];
+        for (uint32_t k = 1; k < CPUTRACE_TOPK; k++) {
+            if (stats->topk[k].value[metric] < e->value[metric]) {
+                e = &stats->topk[k];
+            }
+        }
+    }
+    e->timestamp_ns = start_time ? start_time
+                                 : realtime_ns() - measure->value[CPUTRACE_RESULT_WALL];
+    e->tag = tag;
+    e->thread = thread;
+    memcpy(e->value, measure->value, sizeof(e->value));
+
+    if (stats->topk_count < CPUTRACE_TOPK) {
+        return;
+    }
+    stats->topk_min = stats->topk[0].value[metric];
+    for (uint32_t k = 1; k < CPUTRACE_TOPK; k++) {
+        if (stats->topk[k].value[metric] < stats->topk_min) {
+            stats->topk_min = stats->topk[k].value[metric];
+        }
+    }
+}
+
+static pthread_mutex_t g_intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<char*> g_interned;
+
+const char* cputrace_intern(const char* name) {
+    pthread_mutex_lock(&g_intern_mutex);
+    for (char* s : g_interned) {
+        if (strcmp(s, name) == 0) {
+            pthread_mutex_unlock(&g_intern_mutex);
+            return s;
+        }
+    }
+    char* copy = strdup(name);
+    if (!copy) {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        pthread_mutex_unlock(&g_intern_mutex);
+        return "(unknown)";
+    }
+    g_interned.push_back(copy);
+    pthread_mutex_unlock(&g_intern_mutex);
+    return copy;
+}
+
+// Runtime anchors are taken from the slots above the macro range, which the
+// profiling macros never name.
+int cputrace_anchor_register(const char* name) {
+    int slot = -1;
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    for (int i = CPUTRACE_MACRO_ANCHORS; i < CPUTRACE_MAX_ANCHORS; i++) {
+        const char* cur = g_profiler.anchors[i].name;
+        if (cur && strcmp(cur, name) == 0) {
+            pthread_mutex_unlock(&g_profiler.file_mutex);
+            return i;
+        }
+        if (!cur && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        g_profiler.anchors[slot].name = name;
+    }
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return slot;
+}
+
+// Open addressing over the anchor's key table, under the anchor mutex; when
+// the table is full the key goes to the overflow slot.
+static struct cputrace_key_stats* key_slot(struct cputrace_stats* stats, const struct cputrace_key* key) {
+    uint64_t want = key->value + 1;
+    if (want == 0) {
+        return &stats->keys[CPUTRACE_MAX_KEYS];
+    }
+    uint32_t h = (uint32_t)((key->value * 0x9E3779B97F4A7C15ULL) >> 32) % CPUTRACE_MAX_KEYS;
+    for (int p = 0; p < CPUTRACE_MAX_KEYS; p++) {
+        struct cputrace_key_stats* ks = &stats->keys[(h + p) % CPUTRACE_MAX_KEYS];
+        if (ks->slot_key == 0) {
+            ks->slot_key = want;
+            ks->name = key->name;
+        }
+        if (ks->slot_key == want) {
+            return ks;
+        }
+    }
+    return &stats->keys[CPUTRACE_MAX_KEYS];
+}
+
+// Called with the anchor mutex held
+static void cputrace_key_add(struct cputrace_stats* stats, uint64_t flags,
+                             const struct HW_measure* measure, const struct cputrace_key* key) {
+    struct cputrace_key_stats* ks = key_slot(stats, key);
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (flags & (1ULL << i)) {
+            ks->sum[i] += measure->value[i];
+        }
+    }
+    ks->call_count++;
+}
+
+// Open addressing keyed by the lock address. Lock-free, because the
+// interposer calls in while the thread may hold any lock; a free slot is
+// claimed with a CAS, so two threads racing for the same lock end up in
+// the same slot.
+static struct cputrace_lock_site* lock_site(struct cputrace_lock_stats* ls, uint64_t lock) {
+    uint32_t h = (uint32_t)((lock * 0x9E3779B97F4A7C15ULL) >> 32) % CPUTRACE_LOCK_SITES;
+    for (int p = 0; p < CPUTRACE_LOCK_SITES; p++) {
+        struct cputrace_lock_site* site = &ls->sites[(h + p) % CPUTRACE_LOCK_SITES];
+        uint64_t cur = __atomic_load_n(&site->lock, __ATOMIC_ACQUIRE);
+        if (cur == 0 && __atomic_compare_exchange_n(&site->lock, &cur, lock, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return site;
+        }
+        if (cur == lock) {
+            return site;
+        }
+    }
+    return &ls->sites[CPUTRACE_LOCK_SITES];
+}
+
+// Called by the interposer after a wait; must not lock anything itself
+void cputrace_lock_wait(const void* lock, uint64_t wait_ns, bool cond) {
+    uint64_t index = t_lock_anchor;
+    if (index == 0 || !g_lock_enabled) {
+        return;
+    }
+    struct cputrace_lock_stats* ls = &g_profiler.anchors[index].stats.lock;
+    if (cond) {
+        __atomic_fetch_add(&ls->cond_waits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ls->cond_wait_ns, wait_ns, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&ls->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ls->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    struct cputrace_lock_site* site = lock_site(ls, (uintptr_t)lock);
+    __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->wait_ns, wait_ns, __ATOMIC_RELAXED);
+}
+
+// Triggered capture. While triggers are armed every recorded call also goes
+// to a ring of per-call records. When a rule fires, every new scope records
+// the detail flags as well for a bounded window; after the window the ring
+// is frozen, holding the history before the trigger and the calls of the
+// window, until cputrace_trigger_dump() reads it and re-arms. The window
+// may fill only the half of the ring after the firing record, so a long
+// window cannot overwrite the context that led up to it.
+#define CPUTRACE_MAX_TRIGGERS 16
+#define TRIGGER_EWMA_WARMUP 256
+
+// TRIGGER_FIRING is held by the one thread that fired while it fills in the
+// fired_* fields and the window end, which are published by the release
+// store of TRIGGER_DETAIL.
+enum trigger_state { TRIGGER_OFF, TRIGGER_ARMED, TRIGGER_FIRING, TRIGGER_DETAIL, TRIGGER_CAPTURED };
+
+struct trigger_rule {
+    const char* anchor;
+    int metric;
+    uint64_t threshold;
+    double rise_pct;
+    // Rolling averages over calls of the anchor, under its mutex
+    uint64_t calls;
+    double fast;   // recent, alpha 1/16
+    double slow;   // baseline, alpha 1/1024
+};
+
+struct trigger_record {
+    uint64_t timestamp_ns;  // CLOCK_REALTIME at scope entry
+    uint64_t flags;
+    int anchor;
+    int thread;
+    uint64_t value[CPUTRACE_RESULT_LAST];
+};
+
+static struct {
+    int state;
+    struct cputrace_trigger_opts opts;
+    struct trigger_rule rules[CPUTRACE_MAX_TRIGGERS];
+    int rule_count;
+    uint64_t generation;  // bumped when rules change, anchors rebind
+    struct trigger_record* ring;
+    uint32_t ring_size;   // records allocated, kept across enables
+    uint64_t head;
+    uint64_t head_limit;  // records past this are dropped, UINT64_MAX while armed
+    uint64_t window_end_ns;  // CLOCK_MONOTONIC
+    // The call that fired
+    int fired_rule;
+    uint64_t fired_value;
+    uint64_t fired_ns;
+} g_trigger;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void cputrace_trigger_opts_init(struct cputrace_trigger_opts* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->detail_flags = HW_PROFILE_HARDWARE | HW_PROFILE_OFFCPU | HW_PROFILE_PGFAULT |
+                         HW_PROFILE_SWI | HW_PROFILE_SAMPLE;
+    opts->window_ms = 1000;
+    opts->history = 4096;
+}
+
+int cputrace_trigger_enable(const struct cputrace_trigger_opts* opts) {
+    struct cputrace_trigger_opts defaults;
+    if (!opts) {
+        cputrace_trigger_opts_init(&defaults);
+        opts = &defaults;
+    }
+    if (opts->history == 0) {
+        fprintf(stderr, "%s: history must be non-zero\n", __func__);
+        return -1;
+    }
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_trigger.state != TRIGGER_OFF) {
+        fprintf(stderr, "%s: triggers already enabled\n", __func__);
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    // Never freed, only replaced by a larger one: a thread may still be
+    // writing a record after disable
+    if (opts->history > g_trigger.ring_size) {
+        struct trigger_record* ring = (struct trigger_record*)calloc(opts->history, sizeof(struct trigger_record));
+        if (!ring) {
+            fprintf(stderr, "%s: out of memory\n", __func__);
+            pthread_mutex_unlock(&g_profiler.file_mutex);
+            return -1;
+        }
+        g_trigger.ring = ring;
+        g_trigger.ring_size = opts->history;
+    } else {
+        memset(g_trigger.ring, 0, sizeof(struct trigger_record) * opts->history);
+    }
+    g_trigger.opts = *opts;
+    g_trigger.head = 0;
+    g_trigger.head_limit = UINT64_MAX;
+    __atomic_store_n(&g_trigger.state, TRIGGER_ARMED, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return 0;
+}
+
+int cputrace_trigger_add(const char* anchor, int metric, uint64_t threshold, double rise_pct) {
+    if (metric < 0 || metric >= CPUTRACE_RESULT_LAST || (threshold == 0 && rise_pct <= 0)) {
+        fprintf(stderr, "%s: invalid rule for %s\n", __func__, anchor);
+        return -1;
+    }
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_trigger.rule_count == CPUTRACE_MAX_TRIGGERS) {
+        fprintf(stderr, "%s: too many triggers\n", __func__);
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    struct trigger_rule* rule = &g_trigger.rules[g_trigger.rule_count];
+    memset(rule, 0, sizeof(*rule));
+    rule->anchor = cputrace_intern(anchor);
+    rule->metric = metric;
+    rule->threshold = threshold;
+    rule->rise_pct = rise_pct;
+    __atomic_store_n(&g_trigger.rule_count, g_trigger.rule_count + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&g_trigger.generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return 0;
+}
+
+void cputrace_trigger_disable(void) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (__atomic_exchange_n(&g_trigger.state, TRIGGER_OFF, __ATOMIC_ACQ_REL) == TRIGGER_DETAIL) {
+        __atomic_store_n(&g_detail_flags, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&g_trigger.rule_count, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&g_trigger.generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+}
+
+static void trigger_record(int anchor, uint64_t flags, const struct HW_measure* measure,
+                           int thread, uint64_t start_time) {
+    uint64_t n = __atomic_fetch_add(&g_trigger.head, 1, __ATOMIC_RELAXED);
+    if (n >= __atomic_load_n(&g_trigger.head_limit, __ATOMIC_RELAXED)) {
+        return;
+    }
+    struct trigger_record* r = &g_trigger.ring[n % g_trigger.opts.history];
+    r->timestamp_ns = start_time ? start_time : realtime_ns() - measure->value[CPUTRACE_RESULT_WALL];
+    r->flags = flags;
+    r->anchor = anchor;
+    r->thread = thread;
+    memcpy(r->value, measure->value, sizeof(r->value));
+}
+
+static void trigger_fire(int rule, uint64_t value) {
+    int state = TRIGGER_ARMED;
+    if (!__atomic_compare_exchange_n(&g_trigger.state, &state, TRIGGER_FIRING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;  // another anchor fired first
+    }
+    g_trigger.fired_rule = rule;
+    g_trigger.fired_value = value;
+    g_trigger.fired_ns = realtime_ns();
+    g_trigger.window_end_ns = monotonic_ns() + g_trigger.opts.window_ms * 1000000ULL;
+    uint64_t history = g_trigger.opts.history;
+    __atomic_store_n(&g_trigger.head_limit,
+                     __atomic_load_n(&g_trigger.head, __ATOMIC_RELAXED) + history - history / 2,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&g_detail_flags, g_trigger.opts.detail_flags, __ATOMIC_RELAXED);
+    state = TRIGGER_FIRING;
+    if (!__atomic_compare_exchange_n(&g_trigger.state, &state, TRIGGER_DETAIL, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&g_detail_flags, 0, __ATOMIC_RELAXED);  // disabled meanwhile
+        return;
+    }
+    log_limited("cputrace: trigger on %s fired, detailed profiling for %" PRIu64 " ms\n",
+                g_trigger.rules[rule].anchor, g_trigger.opts.window_ms);
+}
+
+// Ends an expired detailed window; called on recorded calls and dumps
+static void trigger_window_check(void) {
+    if (monotonic_ns() < g_trigger.window_end_ns) {
+        return;
+    }
+    int detail = TRIGGER_DETAIL;
+    if (__atomic_compare_exchange_n(&g_trigger.state, &detail, TRIGGER_CAPTURED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&g_detail_flags, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Called with the anchor mutex held. Rules are bound to the anchor by name
+// once per rule change, and every rule bound to it is evaluated. The
+// per-call check is a compare on the measured value, plus two multiply-adds
+// for rules on the rolling average.
+static void trigger_check(struct cputrace_anchor* anchor, uint64_t flags,
+                          const struct HW_measure* measure, int thread, uint64_t start_time) {
+    int state = __atomic_load_n(&g_trigger.state, __ATOMIC_ACQUIRE);
+    if (state == TRIGGER_CAPTURED) {
+        return;
+    }
+    int index = (int)(anchor - g_profiler.anchors);
+    trigger_record(index, flags, measure, thread, start_time);
+    if (state != TRIGGER_ARMED) {
+        if (state == TRIGGER_DETAIL) {
+            trigger_window_check();
+        }
+        return;
+    }
+    uint64_t generation = __atomic_load_n(&g_trigger.generation, __ATOMIC_ACQUIRE);
+    if (anchor->trigger_gen != generation) {
+        anchor->triggers = 0;
+        int count = __atomic_load_n(&g_trigger.rule_count, __ATOMIC_ACQUIRE);
+        for (int r = 0; r < count; r++) {
+            if (strcmp(g_trigger.rules[r].anchor, anchor->name) == 0) {
+                anchor->triggers |= 1U << r;
+            }
+        }
+        anchor->trigger_gen = generation;
+    }
+    for (uint32_t bits = anchor->triggers; bits; bits &= bits - 1) {
+        int r = __builtin_ctz(bits);
+        struct trigger_rule* rule = &g_trigger.rules[r];
+        uint64_t value = (uint64_t)measure->value[rule->metric];
+        if (rule->threshold && value > rule->threshold) {
+            trigger_fire(r, value);
+            continue;
+        }
+        if (rule->rise_pct > 0) {
+            if (rule->calls++ == 0) {
+                rule->fast = rule->slow = (double)value;
+            }
+            rule->fast += ((double)value - rule->fast) / 16;
+            rule->slow += ((double)value - rule->slow) / 1024;
+            if (rule->calls > TRIGGER_EWMA_WARMUP && rule->fast > rule->slow * (1.0 + rule->rise_pct / 100.0)) {
+                trigger_fire(r, value);
+            }
+        }
+    }
+}
+
+int cputrace_trigger_dump(FILE* fp) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (__atomic_load_n(&g_trigger.state, __ATOMIC_ACQUIRE) == TRIGGER_DETAIL) {
+        trigger_window_check();
+    }
+    if (__atomic_load_n(&g_trigger.state, __ATOMIC_ACQUIRE) != TRIGGER_CAPTURED) {
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    struct cputrace_buf buf = {};
+    const struct trigger_rule* rule = &g_trigger.rules[g_trigger.fired_rule];
+    char when[64], num[32];
+    format_timestamp(g_trigger.fired_ns, when, sizeof(when));
+    format_uint64_with_commas(g_trigger.fired_value, num, sizeof(num));
+    buf_printf(&buf, "cputrace capture: %s %s %s at %s", rule->anchor, num,
+               hw_events[rule->metric].name, when);
+    if (rule->threshold && g_trigger.fired_value > rule->threshold) {
+        format_uint64_with_commas(rule->threshold, num, sizeof(num));
+        buf_printf(&buf, " (threshold %s)\n", num);
+    } else {
+        buf_printf(&buf, " (rolling average up %.0f%%)\n", rule->rise_pct);
+    }
+
+    uint64_t history = g_trigger.opts.history;
+    uint64_t head = std::min(g_trigger.head, g_trigger.head_limit);
+    uint64_t first = head > history ? head - history : 0;
+    for (uint64_t n = first; n < head; n++) {
+        const struct trigger_record* r = &g_trigger.ring[n % history];
+        const struct cputrace_thread_info* info = &g_threads[r->thread];
+        format_timestamp(r->timestamp_ns, when, sizeof(when));
+        buf_printf(&buf, "  %s %s '%s' (tid %d) %s",
+                   when, r->timestamp_ns >= g_trigger.fired_ns ? "+" : "-", info->name, (int)info->tid,
+                   g_profiler.anchors[r->anchor].name);
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (r->flags & g_caps.supported & (1ULL << i)) {
+                buf_printf(&buf, " %s=%" PRIu64, hw_events[i].short_name, r->value[i]);
+            }
+        }
+        buf_printf(&buf, "\n");
+    }
+    int ret = 0;
+    if (buf.len > 0 && fwrite(buf.data, 1, buf.len, fp) != buf.len) {
+        fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+    fflush(fp);
+    free(buf.data);
+
+    memset(g_trigger.ring, 0, sizeof(struct trigger_record) * history);
+    g_trigger.head = 0;
+    __atomic_store_n(&g_trigger.head_limit, UINT64_MAX, __ATOMIC_RELAXED);
+    for (int r = 0; r < g_trigger.rule_count; r++) {
+        g_trigger.rules[r].calls = 0;
+    }
+    __atomic_store_n(&g_trigger.state, TRIGGER_ARMED, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return ret;
+}
+
+// A/B experiments, see cputrace_experiment_create
+
+struct cputrace_variant {
+    char* name;
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+struct cputrace_experiment {
+    char* name;
+    struct cputrace_experiment_opts opts;
+    uint64_t flags;     // effective, as counted
+    uint64_t seed;      // the one used
+    int variant_count;
+    struct cputrace_variant variants[CPUTRACE_MAX_VARIANTS];
+    bool done;
+    // Per-call values, [block][variant][metric]
+    std::vector<double> samples;
+};
+
+void cputrace_experiment_opts_init(struct cputrace_experiment_opts* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->flags = HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_TASK;
+    opts->blocks = 30;
+    opts->calls_per_block = 100;
+    opts->warmup_blocks = 1;
+}
+
+struct cputrace_experiment* cputrace_experiment_create(const char* name,
+                                                       const struct cputrace_experiment_opts* opts) {
+    struct cputrace_experiment_opts defaults;
+    if (!opts) {
+        cputrace_experiment_opts_init(&defaults);
+        opts = &defaults;
+    }
+    if (opts->blocks == 0 || opts->calls_per_block == 0) {
+        fprintf(stderr, "%s: blocks and calls_per_block must be non-zero\n", __func__);
+        return NULL;
+    }
+    struct cputrace_experiment* exp = new struct cputrace_experiment();
+    exp->name = strdup(name);
+    exp->opts = *opts;
+    return exp;
+}
+
+int cputrace_experiment_add(struct cputrace_experiment* exp, const char* variant, void (*fn)(void* arg),
+                            void* arg) {
+    if (exp->done || exp->variant_count == CPUTRACE_MAX_VARIANTS) {
+        fprintf(stderr, "%s: cannot add '%s' to experiment '%s'\n", __func__, variant, exp->name);
+        return -1;
+    }
+    struct cputrace_variant* v = &exp->variants[exp->variant_count];
+    v->name = strdup(variant);
+    v->fn = fn;
+    v->arg = arg;
+    return exp->variant_count++;
+}
+
+void cputrace_experiment_destroy(struct cputrace_experiment* exp) {
+    if (!exp) {
+        return;
+    }
+    for (int v = 0; v < exp->variant_count; v++) {
+        free(exp->variants[v].name);
+    }
+    free(exp->name);
+    delete exp;
+}
+
+static inline size_t experiment_sample(const struct cputrace_experiment* exp, uint32_t block, int variant) {
+    return ((size_t)block * exp->variant_count + variant) * CPUTRACE_RESULT_LAST;
+}
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int cputrace_experiment_run(struct cputrace_experiment* exp) {
+    if (exp->variant_count < 2) {
+        fprintf(stderr, "%s: experiment '%s' needs at least two variants\n", __func__, exp->name);
+        return -1;
+    }
+    const struct cputrace_experiment_opts* opts = &exp->opts;
+    exp->flags = effective_flags(opts->flags) & ((1ULL << CPUTRACE_RESULT_LAST) - 1);
+    exp->seed = opts->seed ? opts->seed : monotonic_ns() ^ ((uint64_t)getpid() << 32);
+    exp->samples.assign((size_t)opts->blocks * exp->variant_count * CPUTRACE_RESULT_LAST, 0.0);
+    uint64_t rng = exp->seed;
+    int order[CPUTRACE_MAX_VARIANTS];
+    for (uint32_t b = 0; b < opts->warmup_blocks + opts->blocks; b++) {
+        // Fisher-Yates: a fresh order for every block
+        for (int v = 0; v < exp->variant_count; v++) {
+            order[v] = v;
+        }
+        for (int v = exp->variant_count - 1; v > 0; v--) {
+            std::swap(order[v], order[xorshift64(&rng) % (v + 1)]);
+        }
+        for (int k = 0; k < exp->variant_count; k++) {
+            const struct cputrace_variant* variant = &exp->variants[order[k]];
+            struct HW_measure start, end;
+            HW_thread_read(exp->flags, &start);
+            for (uint32_t c = 0; c < opts->calls_per_block; c++) {
+                variant->fn(variant->arg);
+            }
+            HW_thread_read(exp->flags, &end);
+            if (b < opts->warmup_blocks) {
+                continue;
+            }
+            double* sample = &exp->samples[experiment_sample(exp, b - opts->warmup_blocks, order[k])];
+            for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+                sample[i] = (double)(end.value[i] - start.value[i]) / opts->calls_per_block;
+            }
+        }
+    }
+    exp->done = true;
+    return 0;
+}
+
+// Median of sorted values with a distribution-free 95% confidence interval:
+// the order statistics of rank n/2 - 1.96 sqrt(n)/2 and 1 + n/2 + 1.96
+// sqrt(n)/2 (normal approximation of the binomial). With 8 values or fewer
+// that is the whole sample.
+static double median_ci(const std::vector<double>& sorted, double* lo, double* hi) {
+    long n = (long)sorted.size();
+    double half = 1.96 * sqrt((double)n) / 2;
+    long j = lround(n / 2.0 - half);
+    long k = lround(1 + n / 2.0 + half);
+    *lo = sorted[std::max(1L, j) - 1];
+    *hi = sorted[std::min(n, k) - 1];
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+static double variant_median(const struct cputrace_experiment* exp, int variant, int metric, double* lo,
+                             double* hi) {
+    std::vector<double> values;
+    for (uint32_t b = 0; b < exp->opts.blocks; b++) {
+        values.push_back(exp->samples[experiment_sample(exp, b, variant) + metric]);
+    }
+    std::sort(values.begin(), values.end());
+    return median_ci(values, lo, hi);
+}
+
+// The two variants with the lowest medians and the interval of their paired
+// per-block differences, best minus runner-up
+static void experiment_compare(const struct cputrace_experiment* exp, int metric, int* best, int* runner_up,
+                               double* diff, double* lo, double* hi) {
+    double medians[CPUTRACE_MAX_VARIANTS], unused;
+    int rank[CPUTRACE_MAX_VARIANTS];
+    for (int v = 0; v < exp->variant_count; v++) {
+        medians[v] = variant_median(exp, v, metric, &unused, &unused);
+        rank[v] = v;
+    }
+    std::stable_sort(rank, rank + exp->variant_count, [&medians](int a, int b) { return medians[a] < medians[b]; });
+    *best = rank[0];
+    *runner_up = rank[1];
+    std::vector<double> diffs;
+    for (uint32_t b = 0; b < exp->opts.blocks; b++) {
+        diffs.push_back(exp->samples[experiment_sample(exp, b, *best) + metric] -
+                        exp->samples[experiment_sample(exp, b, *runner_up) + metric]);
+    }
+    std::sort(diffs.begin(), diffs.end());
+    *diff = median_ci(diffs, lo, hi);
+}
+
+double cputrace_experiment_median(const struct cputrace_experiment* exp, int variant, int metric) {
+    if (!exp->done || variant < 0 || variant >= exp->variant_count || metric < 0 ||
+        metric >= CPUTRACE_RESULT_LAST) {
+        return 0.0;
+    }
+    double lo, hi;
+    return variant_median(exp, variant, metric, &lo, &hi);
+}
+
+int cputrace_experiment_winner(const struct cputrace_experiment* exp, int metric) {
+    if (!exp->done || metric < 0 || metric >= CPUTRACE_RESULT_LAST || !(exp->flags & (1ULL << metric))) {
+        return -1;
+    }
+    int best, runner_up;
+    double diff, lo, hi;
+    experiment_compare(exp, metric, &best, &runner_up, &diff, &lo, &hi);
+    return hi < 0 ? best : -1;
+}
+
+int cputrace_experiment_report(const struct cputrace_experiment* exp, FILE* fp) {
+    if (!exp->done) {
+        return -1;
+    }
+    struct cputrace_buf buf = {};
+    buf_printf(&buf, "experiment '%s': %d variants, %u blocks of %u calls, seed %" PRIu64 "\n", exp->name,
+               exp->variant_count, exp->opts.blocks, exp->opts.calls_per_block, exp->seed);
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (!(exp->flags & (1ULL << i))) {
+            continue;
+        }
+        bool counted = false;
+        for (size_t k = i; k < exp->samples.size() && !counted; k += CPUTRACE_RESULT_LAST) {
+            counted = exp->samples[k] != 0.0;
+        }
+        if (!counted) {
+            continue;
+        }
+        buf_printf(&buf, "\n  %s per call:\n", hw_events[i].name);
+        buf_printf(&buf, "    %-20s %14s   %s\n", "variant", "median", "95% CI");
+        for (int v = 0; v < exp->variant_count; v++) {
+            double lo, hi;
+            double median = variant_median(exp, v, i, &lo, &hi);
+            buf_printf(&buf, "    %-20s %14.1f   [%.1f, %.1f]\n", exp->variants[v].name, median, lo, hi);
+        }
+        int best, runner_up;
+        double diff, lo, hi;
+        experiment_compare(exp, i, &best, &runner_up, &diff, &lo, &hi);
+        const char* best_name = exp->variants[best].name;
+        const char* runner_name = exp->variants[runner_up].name;
+        if (hi < 0) {
+            double best_median = cputrace_experiment_median(exp, best, i);
+            double runner_median = cputrace_experiment_median(exp, runner_up, i);
+            buf_printf(&buf, "    winner: %s, %.2fx lower than %s", best_name,
+                       best_median > 0 ? runner_median / best_median : 0.0, runner_name);
+        } else {
+            buf_printf(&buf, "    no winner: %s vs %s not significant", best_name, runner_name);
+        }
+        buf_printf(&buf, " (paired difference %.1f, 95%% CI [%.1f, %.1f])\n", diff, lo, hi);
+    }
+    int ret = 0;
+    if (buf.len > 0 && fwrite(buf.data, 1, buf.len, fp) != buf.len) {
+        fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+    fflush(fp);
+    free(buf.data);
+    return ret;
+}
+
+// Shared-memory export. The table is written where the stats are already
+// updated, under the anchor mutex, so readers cost the process nothing.
+static_assert(CPUTRACE_RESULT_LAST <= CPUTRACE_SHM_METRICS, "shm layout too small");
+
+static struct {
+    struct cputrace_shm_header* header;
+    struct cputrace_shm_anchor* anchors;
+    size_t size;
+    char name[64];
+} g_shm;
+
+// Called with the anchor mutex held
+static void shm_publish(const struct cputrace_anchor* anchor) {
+    struct cputrace_shm_anchor* a = __atomic_load_n(&g_shm.anchors, __ATOMIC_ACQUIRE);
+    if (!a) {
+        return;
+    }
+    a += anchor - g_profiler.anchors;
+    uint64_t seq = a->seq;
+    __atomic_store_n(&a->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (a->name[0] == '\0' && anchor->name) {
+        snprintf(a->name, sizeof(a->name), "%s", anchor->name);
+    }
+    a->call_count = anchor->stats.call_count;
+    memcpy(a->sum, anchor->stats.sum, sizeof(anchor->stats.sum));
+    __atomic_store_n(&a->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int cputrace_shm_enable(const char* name) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_shm.header) {
+        fprintf(stderr, "%s: already exporting to %s\n", __func__, g_shm.name);
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    if (name) {
+        snprintf(g_shm.name, sizeof(g_shm.name), "%s", name);
+    } else {
+        snprintf(g_shm.name, sizeof(g_shm.name), "/cputrace.%d", (int)getpid());
+    }
+    size_t size = sizeof(struct cputrace_shm_header) +
+                  sizeof(struct cputrace_shm_anchor) * CPUTRACE_MAX_ANCHORS;
+    int fd = shm_open(g_shm.name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        fprintf(stderr, "%s: cannot create %s: %s\n", __func__, g_shm.name, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(g_shm.name);
+        }
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap failed: %s\n", __func__, strerror(errno));
+        shm_unlink(g_shm.name);
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    struct cputrace_shm_header* h = (struct cputrace_shm_header*)map;
+    h->version = CPUTRACE_SHM_VERSION;
+    h->header_size = sizeof(struct cputrace_shm_header);
+    h->anchor_size = sizeof(struct cputrace_shm_anchor);
+    h->anchor_count = CPUTRACE_MAX_ANCHORS;
+    h->metric_count = CPUTRACE_RESULT_LAST;
+    h->pid = (int32_t)getpid();
+    h->supported = g_caps.supported;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        snprintf(h->metric_key[i], sizeof(h->metric_key[i]), "%s", hw_events[i].key);
+    }
+    g_shm.size = size;
+    g_shm.header = h;
+    // Anchors that already have calls
+    for (uint64_t i = 0; i < CPUTRACE_MAX_ANCHORS; i++) {
+        struct cputrace_anchor* anchor = &g_profiler.anchors[i];
+        pthread_mutex_lock(&anchor->mutex);
+        __atomic_store_n(&g_shm.anchors, cputrace_shm_anchors(h), __ATOMIC_RELEASE);
+        if (anchor->stats.call_count > 0) {
+            shm_publish(anchor);
+        }
+        pthread_mutex_unlock(&anchor->mutex);
+    }
+    // Readers accept the table once the magic is there
+    __atomic_store_n(&h->magic, CPUTRACE_SHM_MAGIC, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return 0;
+}
+
+// Stops publishing and removes the name. The mapping stays: a scope that
+// already loaded the table pointer may still write to it.
+void cputrace_shm_disable(void) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_shm.header) {
+        __atomic_store_n(&g_shm.anchors, (struct cputrace_shm_anchor*)NULL, __ATOMIC_RELEASE);
+        shm_unlink(g_shm.name);
+        g_shm.header = NULL;
+    }
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+}
+
+static void cputrace_result_add(struct cputrace_anchor* anchor, uint64_t flags,
+                                const struct HW_measure* measure, uint64_t segments,
+                                uint64_t tag, uint64_t start_time, const struct cputrace_key* key) {
+    struct cputrace_stats* stats = &anchor->stats;
+    int thread = cputrace_thread_slot();
+    struct cputrace_thread_stats* ts = &stats->threads[thread];
+    pthread_mutex_lock(&anchor->mutex);
+    if (key->set) {
+        cputrace_key_add(stats, flags, measure, key);
+    }
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (flags & (1ULL << i)) {
+            uint64_t value = measure->value[i];
+            stats->sum[i] += value;
+            stats->sumsq[i] += (double)value * (double)value;
+            stats->hist[i][cputrace_hist_bucket(value)]++;
+            ts->sum[i] += value;
+            if (measure->kernel_valid & (1ULL << i)) {
+                stats->split_sum[i] += value;
+                stats->kernel_sum[i] += measure->kernel[i];
+            }
+        }
+    }
+    stats->call_count++;
+    ts->call_count++;
+    stats->segment_count += segments;
+
+    if (stats->topk_count == 0) {
+        int metric = g_topk_metric;
+        if (metric == CPUTRACE_METRIC_AUTO) {
+            metric = measure->value[CPUTRACE_RESULT_CYC] > 0 ? CPUTRACE_RESULT_CYC : CPUTRACE_RESULT_WALL;
+        }
+        stats->topk_metric = metric;
+    }
+    if ((uint64_t)measure->value[stats->topk_metric] > stats->topk_min) {
+        topk_insert(stats, measure, thread, tag, start_time);
+    }
+    if (__atomic_load_n(&g_trigger.state, __ATOMIC_RELAXED) != TRIGGER_OFF) {
+        trigger_check(anchor, flags, measure, thread, start_time);
+    }
+    shm_publish(anchor);
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+static void cputrace_core_add(struct cputrace_anchor* anchor, int start_cpu,
+                              const struct HW_measure* core_start) {
+    struct HW_measure core_end;
+    int cpu = sched_getcpu();
+    int slot = cpu == start_cpu ? percpu_read(cpu, &core_end) : -1;
+    pthread_mutex_lock(&anchor->mutex);
+    if (slot < 0) {
+        anchor->stats.core_migrated++;
+    } else {
+        struct cputrace_core_stats* core = &anchor->stats.core[slot];
+        core->cpu = cpu;
+        core->call_count++;
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            core->sum[i] += core_end.value[i] - core_start->value[i];
+        }
+    }
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+static void cputrace_node_add(struct cputrace_anchor* anchor, uint64_t flags,
+                              const struct HW_measure* measure, int entry_cpu, int exit_cpu) {
+    struct cputrace_stats* stats = &anchor->stats;
+    int node = numa_node_of(entry_cpu);
+    struct cputrace_node_stats* ns = &stats->migrated;
+    pthread_mutex_lock(&anchor->mutex);
+    if (entry_cpu == exit_cpu) {
+        ns = &stats->nodes[node];
+        stats->cpu_calls[entry_cpu < CPUTRACE_MAX_CPUS ? entry_cpu : CPUTRACE_MAX_CPUS - 1]++;
+    } else if (numa_node_of(exit_cpu) != node) {
+        stats->node_migrated++;
+    }
+    ns->call_count++;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (flags & (1ULL << i)) {
+            ns->sum[i] += measure->value[i];
+        }
+    }
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+static void cputrace_topdown_add(struct cputrace_anchor* anchor, const uint64_t* start, const uint64_t* end,
+                                 bool counted) {
+    struct cputrace_topdown_stats* td = &anchor->stats.topdown;
+    pthread_mutex_lock(&anchor->mutex);
+    td->call_count++;
+    if (!counted || end[CPUTRACE_TOPDOWN_EVENTS] == start[CPUTRACE_TOPDOWN_EVENTS]) {
+        td->unscheduled++;
+    } else {
+        for (int k = 0; k < CPUTRACE_TOPDOWN_EVENTS; k++) {
+            td->sum[k] += end[k] - start[k];
+        }
+    }
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+// Same open addressing as key_slot
+static void cputrace_callers_add(struct cputrace_anchor* anchor, uint64_t flags, const struct HW_measure* measure,
+                                 uint64_t signature, const uint64_t* pc) {
+    struct cputrace_caller_stats* callers = anchor->stats.callers;
+    struct cputrace_caller_stats* cs = &callers[CPUTRACE_MAX_CALLERS];
+    uint32_t h = (uint32_t)((signature * 0x9E3779B97F4A7C15ULL) >> 32) % CPUTRACE_MAX_CALLERS;
+    pthread_mutex_lock(&anchor->mutex);
+    for (int p = 0; p < CPUTRACE_MAX_CALLERS; p++) {
+        struct cputrace_caller_stats* slot = &callers[(h + p) % CPUTRACE_MAX_CALLERS];
+        if (slot->signature == 0) {
+            slot->signature = signature;
+            memcpy(slot->pc, pc, sizeof(slot->pc));
+        }
+        if (slot->signature == signature) {
+            cs = slot;
+            break;
+        }
+    }
+    cs->call_count++;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (flags & (1ULL << i)) {
+            cs->sum[i] += measure->value[i];
+        }
+    }
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+static void cputrace_alloc_add(struct cputrace_anchor* anchor, const struct cputrace_alloc_counters* start,
+                               const struct cputrace_alloc_counters* end, uint64_t peak) {
+    struct cputrace_alloc_stats* as = &anchor->stats.alloc;
+    pthread_mutex_lock(&anchor->mutex);
+    as->call_count++;
+    as->count += end->count - start->count;
+    as->bytes += end->bytes - start->bytes;
+    as->freed += end->freed - start->freed;
+    as->peak_sum += peak;
+    as->peak_max = std::max(as->peak_max, peak);
+    pthread_mutex_unlock(&anchor->mutex);
+}
+
+// Names the anchor of a scope on entry. A slot of the runtime range keeps
+// the name it was registered with, so a scope may only use it under that
+// name; a macro index past the macro range is not counted.
+static bool anchor_enter(uint64_t index, const char* function) {
+    if (index < CPUTRACE_MACRO_ANCHORS) {
+        g_profiler.anchors[index].name = function;
+        return true;
+    }
+    const char* cur = index < CPUTRACE_MAX_ANCHORS ? g_profiler.anchors[index].name : NULL;
+    if (cur && (cur == function || strcmp(cur, function) == 0)) {
+        return true;
+    }
+    static bool warned = false;
+    if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "%s: anchor %lu of %s is past the macro range, not counting\n",
+                __func__, (unsigned long)index, function);
+    }
+    return false;
+}
+
+HW_profile::HW_profile(const char* function, uint64_t index, uint64_t flags)
+    : function(function), index(index), flags(effective_flags(flags)), active(false), cpu(-1),
+      entry_cpu(-1), sample_prev(-2), tag(0), alloc(NULL), lock_prev(LOCK_UNTRACKED), topdown(false),
+      caller_signature(0) {
+    key.set = false;
+    if (!g_profiler.profiling || !anchor_enter(index, function)) {
+        return;
+    }
+    active = true;
+
+    if (g_percpu.enabled) {
+        cpu = sched_getcpu();
+        if (percpu_read(cpu, &core_start) < 0) {
+            cpu = -2;
+        }
+    }
+    if ((this->flags & HW_PROFILE_SAMPLE) && g_sampling.enabled) {
+        sample_prev = sampler_begin((int)index);
+    }
+    if (g_numa.enabled) {
+        entry_cpu = sched_getcpu();
+    }
+    if (g_lock_enabled) {
+        lock_prev = t_lock_anchor;
+        t_lock_anchor = index;
+    }
+    if ((this->flags & HW_PROFILE_TOPDOWN) && g_topdown.enabled) {
+        topdown = true;
+        if (!topdown_read(topdown_start)) {
+            topdown_start[CPUTRACE_TOPDOWN_EVENTS] = UINT64_MAX;
+        }
+    }
+    if ((this->flags & HW_PROFILE_CALLERS) && g_callers.enabled) {
+        caller_signature = caller_walk(__builtin_frame_address(0), g_callers.depth, caller_pc);
+    }
+    HW_thread_read(this->flags, &start);
+    // After the counters, which allocate on a thread's first scope. The
+    // thread's peak restarts at the current level for this scope and is
+    // folded back into the enclosing scope's peak on exit.
+    if (g_alloc_enabled) {
+        alloc = cputrace_alloc_thread();
+        alloc_start = *alloc;
+        alloc->peak = alloc->outstanding;
+    }
+}
+
+HW_profile::~HW_profile() {
+    if (!active) {
+        return;
+    }
+    struct HW_measure end;
+    HW_thread_read(flags, &end);
+    int exit_cpu = entry_cpu >= 0 ? sched_getcpu() : -1;
+    uint64_t topdown_end[CPUTRACE_TOPDOWN_EVENTS + 1];
+    bool topdown_counted = topdown && topdown_start[CPUTRACE_TOPDOWN_EVENTS] != UINT64_MAX &&
+                           topdown_read(topdown_end);
+    // The profiler's own anchor locks below are charged to no anchor
+    if (lock_prev != LOCK_UNTRACKED) {
+        t_lock_anchor = 0;
+    }
+    struct cputrace_alloc_counters alloc_end = {};
+    if (alloc) {
+        alloc_end = *alloc;
+        alloc->peak = std::max(alloc->peak, alloc_start.peak);
+    }
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        end.value[i] -= start.value[i];
+        end.kernel[i] -= start.kernel[i];
+    }
+    end.kernel_valid &= start.kernel_valid;
+    if (sample_prev != -2) {
+        sampler_end((int)index, sample_prev);
+    }
+
+    struct cputrace_anchor* anchor = &g_profiler.anchors[index];
+    cputrace_result_add(anchor, flags, &end, 1, tag, 0, &key);
+    if (cpu != -1 && g_percpu.enabled) {
+        cputrace_core_add(anchor, cpu, &core_start);
+    }
+    if (entry_cpu >= 0 && exit_cpu >= 0) {
+        cputrace_node_add(anchor, flags, &end, entry_cpu, exit_cpu);
+    }
+    if (topdown) {
+        cputrace_topdown_add(anchor, topdown_start, topdown_end, topdown_counted);
+    }
+    if (caller_signature) {
+        cputrace_callers_add(anchor, flags, &end, caller_signature, caller_pc);
+    }
+    if (alloc) {
+        cputrace_alloc_add(anchor, &alloc_start, &alloc_end,
+                           (uint64_t)(alloc_end.peak - alloc_start.outstanding));
+    }
+    if (lock_prev != LOCK_UNTRACKED) {
+        t_lock_anchor = lock_prev;
+    }
+}
+
+HW_span::HW_span(const char* function, uint64_t index, uint64_t flags)
+    : function(function), index(index), flags(effective_flags(flags)), active(false), running(false),
+      segments(0), tag(0), start_time(0) {
+    key.set = false;
+    memset(&total, 0, sizeof(total));
+    total.kernel_valid = ~0ULL;
+    if (!g_profiler.profiling || !anchor_enter(index, function)) {
+        return;
+    }
+    active = true;
+    start_time = realtime_ns();
+    resume();
+}
+
+HW_span::~HW_span() {
+    finish();
+}
+
+void HW_span::pause() {
+    if (!active || !running) {
+        return;
+    }
+    struct HW_measure end;
+    HW_thread_read(flags, &end);
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        total.value[i] += end.value[i] - start.value[i];
+        total.kernel[i] += end.kernel[i] - start.kernel[i];
+    }
+    total.kernel_valid &= start.kernel_valid & end.kernel_valid;
+    running = false;
+}
+
+void HW_span::resume() {
+    if (!active || running) {
+        return;
+    }
+    HW_thread_read(flags, &start);
+    running = true;
+    segments++;
+}
+
+void HW_span::finish() {
+    if (!active) {
+        return;
+    }
+    pause();
+    cputrace_result_add(&g_profiler.anchors[index], flags, &total, segments, tag, start_time, &key);
+    active = false;
+}
+
+int cputrace_set_profiling(bool on) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    if (g_profiler.profiling == on) {
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        return -1;
+    }
+    g_profiler.profiling = on;
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return 0;
+}
+
+void cputrace_clear(void) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    for (uint64_t i = 0; i < CPUTRACE_MAX_ANCHORS; i++) {
+        if (!g_profiler.anchors[i].name) {
+            continue;  // never used, still zero
+        }
         pthread_mutex_lock(&g_profiler.anchors[i].mutex);
-        g_profiler.anchors[i].call_count = 0;
-        g_profiler.anchors[i].sum_swi = 0;
-        g_profiler.anchors[i].sum_cyc = 0;
-        g_profiler.anchors[i].sum_cmiss = 0;
-        g_profiler.anchors[i].sum_bmiss = 0;
-        g_profiler.anchors[i].sum_ins = 0;
+        memset(&g_profiler.anchors[i].stats, 0, sizeof(g_profiler.anchors[i].stats));
+        shm_publish(&g_profiler.anchors[i]);
         pthread_mutex_unlock(&g_profiler.anchors[i].mutex);
     }
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+}
+
+void cputrace_start(void) {
+    if (cputrace_set_profiling(true) < 0) {
+        fprintf(stderr, "cputrace_start: Profiling already active\n");
+        return;
+    }
+    printf("Profiling started\n");
+    fflush(stdout);
+}
+
+void cputrace_stop(void) {
+    if (cputrace_set_profiling(false) < 0) {
+        fprintf(stderr, "cputrace_stop: Profiling not active\n");
+        return;
+    }
+    printf("Profiling stopped\n");
+    fflush(stdout);
+}
+
+void cputrace_reset(void) {
+    cputrace_clear();
     printf("Profiling counters reset\n");
     fflush(stdout);
+}
+
+struct cputrace_snapshot_entry {
+    const char* name;
+    struct cputrace_stats stats;
+};
+
+static bool snapshot_wanted(const struct cputrace_anchor* anchor, const char* filter) {
+    return anchor->name && (!filter || strstr(anchor->name, filter));
+}
+
+// Copies the stats of every anchor with calls into an array sized for the
+// named anchors, not the whole table. Each anchor is locked only for the
+// copy; sorting and formatting work on the private copy. The caller frees
+// the array.
+static struct cputrace_snapshot_entry* cputrace_snapshot_take(const char* filter, size_t* count) {
+    *count = 0;
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    size_t named = 0;
+    for (uint64_t i = 0; g_profiler.anchors && i < CPUTRACE_MAX_ANCHORS; i++) {
+        named += snapshot_wanted(&g_profiler.anchors[i], filter);
+    }
+    struct cputrace_snapshot_entry* entries = (struct cputrace_snapshot_entry*)malloc(
+        sizeof(struct cputrace_snapshot_entry) * std::max<size_t>(named, 1));
+    if (!entries) {
+        pthread_mutex_unlock(&g_profiler.file_mutex);
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        return NULL;
+    }
+    // Scopes name macro anchors without the file mutex, so more may be
+    // named by now than were counted
+    for (uint64_t i = 0; g_profiler.anchors && i < CPUTRACE_MAX_ANCHORS && *count < named; i++) {
+        struct cputrace_anchor* anchor = &g_profiler.anchors[i];
+        if (!snapshot_wanted(anchor, filter)) {
+            continue;
+        }
+        pthread_mutex_lock(&anchor->mutex);
+        if (anchor->stats.call_count > 0) {
+            entries[*count].name = anchor->name;
+            memcpy(&entries[*count].stats, &anchor->stats, sizeof(anchor->stats));
+            (*count)++;
+        }
+        pthread_mutex_unlock(&anchor->mutex);
+    }
     pthread_mutex_unlock(&g_profiler.file_mutex);
+    return entries;
 }
 
-void cputrace_dump(void) {
+static struct cputrace_anchor* anchor_by_name(const char* name) {
+    for (uint64_t i = 0; g_profiler.anchors && i < CPUTRACE_MAX_ANCHORS; i++) {
+        const char* cur = g_profiler.anchors[i].name;
+        if (cur && strcmp(cur, name) == 0) {
+            return &g_profiler.anchors[i];
+        }
+    }
+    return NULL;
+}
+
+int cputrace_query(const char* name, struct cputrace_anchor_summary* out) {
+    memset(out, 0, sizeof(*out));
+    struct cputrace_stats* stats = (struct cputrace_stats*)malloc(sizeof(struct cputrace_stats));
+    if (!stats) {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        return -1;
+    }
     pthread_mutex_lock(&g_profiler.file_mutex);
-    for (uint64_t i = 0; i < CPUTRACE_MAX_ANCHORS; i++) {
-        pthread_mutex_lock(&g_profiler.anchors[i].mutex);
-        if (g_profiler.anchors[i].name && g_profiler.anchors[i].call_count > 0) {
-            cputrace_anchor_thread_flush(&g_profiler.anchors[i]);
+    struct cputrace_anchor* anchor = anchor_by_name(name);
+    if (anchor) {
+        pthread_mutex_lock(&anchor->mutex);
+        memcpy(stats, &anchor->stats, sizeof(*stats));
+        pthread_mutex_unlock(&anchor->mutex);
+        out->name = anchor->name;
+    }
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    if (!anchor || stats->call_count == 0) {
+        free(stats);
+        return -1;
+    }
+    out->call_count = stats->call_count;
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        struct cputrace_metric_summary* m = &out->metric[i];
+        uint64_t counted = 0;
+        for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+            counted += stats->hist[i][b];
         }
-        pthread_mutex_unlock(&g_profiler.anchors[i].mutex);
+        if (counted == 0 || !(g_caps.supported & (1ULL << i))) {
+            continue;
+        }
+        out->recorded |= 1ULL << i;
+        m->total = stats->sum[i];
+        m->avg = (double)stats->sum[i] / stats->call_count;
+        m->stddev = stats_stddev(stats, i);
+        m->p50 = cputrace_hist_percentile(stats->hist[i], 0.50);
+        m->p90 = cputrace_hist_percentile(stats->hist[i], 0.90);
+        m->p99 = cputrace_hist_percentile(stats->hist[i], 0.99);
+    }
+    free(stats);
+    return 0;
+}
+
+int cputrace_clear_anchor(const char* name) {
+    pthread_mutex_lock(&g_profiler.file_mutex);
+    struct cputrace_anchor* anchor = anchor_by_name(name);
+    if (anchor) {
+        pthread_mutex_lock(&anchor->mutex);
+        memset(&anchor->stats, 0, sizeof(anchor->stats));
+        pthread_mutex_unlock(&anchor->mutex);
+    }
+    pthread_mutex_unlock(&g_profiler.file_mutex);
+    return anchor ? 0 : -1;
+}
+
+static void format_capabilities(struct cputrace_buf* buf) {
+    buf_printf(buf, "cputrace metrics:");
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (g_caps.supported & (1ULL << i)) {
+            buf_printf(buf, " %s", hw_events[i].name);
+        }
+    }
+    buf_printf(buf, "\n");
+    if (g_caps.supported != (1ULL << CPUTRACE_RESULT_LAST) - 1) {
+        buf_printf(buf, "unavailable:");
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (!(g_caps.supported & (1ULL << i))) {
+                buf_printf(buf, " %s (%s)", hw_events[i].name, strerror(g_caps.err[i]));
+            }
+        }
+        buf_printf(buf, "\n");
+    }
+    if (g_caps.fallback_flags) {
+        buf_printf(buf, "software fallback: hardware metrics replaced by");
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            if (g_caps.fallback_flags & (1ULL << i)) {
+                buf_printf(buf, " %s", hw_events[i].name);
+            }
+        }
+        buf_printf(buf, "\n");
+    }
+    if (g_mode.kernel_denied) {
+        buf_printf(buf, "counting user mode only (kernel mode not permitted)\n");
+    } else if (mode_user_only()) {
+        buf_printf(buf, "counting hardware events in user mode only\n");
+    }
+}
+
+static void dump_capabilities(cputrace_writer* w) {
+    w->open_object_section("capabilities");
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        w->dump_string(hw_events[i].key,
+                       (g_caps.supported & (1ULL << i)) ? "supported" : strerror(g_caps.err[i]));
+    }
+    w->dump_int("software_fallback", g_caps.fallback_flags != 0);
+    w->dump_int("user_mode_only", mode_user_only());
+    w->close_section();
+}
+
+static void dump_anchors(cputrace_writer* w, const std::vector<const struct cputrace_snapshot_entry*>& order,
+                         uint64_t dump_flags) {
+    dump_capabilities(w);
+    w->open_array_section("anchors");
+    for (const struct cputrace_snapshot_entry* e : order) {
+        dump_anchor(w, e->name, &e->stats, dump_flags);
+    }
+    w->close_section();
+}
+
+// Clears every metric but `keep` from a snapshot so the dump skips them
+static void snapshot_keep_metric(struct cputrace_stats* stats, int keep) {
+    memset(&stats->alloc, 0, sizeof(stats->alloc));
+    memset(&stats->lock, 0, sizeof(stats->lock));
+    memset(&stats->topdown, 0, sizeof(stats->topdown));
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        if (i == keep) {
+            continue;
+        }
+        stats->sum[i] = 0;
+        stats->sumsq[i] = 0;
+        memset(stats->hist[i], 0, sizeof(stats->hist[i]));
+        stats->split_sum[i] = 0;
+        for (int s = 0; s < CPUTRACE_MAX_PERCPU; s++) {
+            stats->core[s].sum[i] = 0;
+        }
+        for (int n = 0; n < CPUTRACE_MAX_NODES; n++) {
+            stats->nodes[n].sum[i] = 0;
+        }
+        stats->migrated.sum[i] = 0;
+        for (int t = 0; t < CPUTRACE_MAX_THREADS; t++) {
+            stats->threads[t].sum[i] = 0;
+        }
+        for (int k = 0; k <= CPUTRACE_MAX_KEYS; k++) {
+            stats->keys[k].sum[i] = 0;
+        }
+        for (int c = 0; c <= CPUTRACE_MAX_CALLERS; c++) {
+            stats->callers[c].sum[i] = 0;
+        }
+        for (uint32_t k = 0; k < stats->topk_count; k++) {
+            stats->topk[k].value[i] = 0;
+        }
+    }
+}
+
+static double snapshot_sort_key(const struct cputrace_snapshot_entry* e, int sort_by, bool avg) {
+    if (sort_by == CPUTRACE_SORT_CALLS) {
+        return (double)e->stats.call_count;
+    }
+    double value = (double)e->stats.sum[sort_by];
+    return avg ? value / e->stats.call_count : value;
+}
+
+// Takes a snapshot and orders it as the options ask. The caller frees the
+// returned entries.
+static struct cputrace_snapshot_entry* snapshot_ordered(const struct cputrace_dump_opts* opts,
+                                                         std::vector<const struct cputrace_snapshot_entry*>* out) {
+    size_t count;
+    struct cputrace_snapshot_entry* entries = cputrace_snapshot_take(opts->filter, &count);
+    if (!entries) {
+        return NULL;
+    }
+    int keep = opts->metric ? cputrace_metric_from_name(opts->metric) : -1;
+
+    std::vector<const struct cputrace_snapshot_entry*>& order = *out;
+    for (size_t i = 0; i < count; i++) {
+        if (opts->metric) {
+            snapshot_keep_metric(&entries[i].stats, keep);
+        }
+        order.push_back(&entries[i]);
+    }
+    int sort_by = opts->sort_by;
+    if (sort_by >= CPUTRACE_SORT_CALLS && sort_by < CPUTRACE_RESULT_LAST) {
+        bool avg = opts->sort_by_avg;
+        std::stable_sort(order.begin(), order.end(),
+                         [sort_by, avg](const struct cputrace_snapshot_entry* a,
+                                        const struct cputrace_snapshot_entry* b) {
+                             return snapshot_sort_key(a, sort_by, avg) > snapshot_sort_key(b, sort_by, avg);
+                         });
+    }
+    if (opts->top_n > 0 && order.size() > opts->top_n) {
+        order.resize(opts->top_n);
+    }
+    return entries;
+}
+
+size_t cputrace_dump_writer(cputrace_writer* w, const struct cputrace_dump_opts* opts) {
+    struct cputrace_dump_opts defaults;
+    if (!opts) {
+        cputrace_dump_opts_init(&defaults);
+        opts = &defaults;
+    }
+    std::vector<const struct cputrace_snapshot_entry*> order;
+    struct cputrace_snapshot_entry* entries = snapshot_ordered(opts, &order);
+    if (!entries) {
+        return 0;
+    }
+    dump_anchors(w, order, opts->flags);
+    free(entries);
+    return order.size();
+}
+
+// Binary snapshot, layout in cputrace_snapshot.h
+static void format_snapshot(struct cputrace_buf* buf, const std::vector<const struct cputrace_snapshot_entry*>& order) {
+    size_t start = buf->len;
+    int nthreads = std::min(__atomic_load_n(&g_thread_count, __ATOMIC_RELAXED), CPUTRACE_MAX_THREADS);
+    struct cputrace_snap_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = CPUTRACE_SNAP_MAGIC;
+    h.version = CPUTRACE_SNAP_VERSION;
+    h.header_size = sizeof(h);
+    h.metric_count = CPUTRACE_RESULT_LAST;
+    h.hist_buckets = CPUTRACE_HIST_BUCKETS;
+    h.anchor_count = (uint32_t)order.size();
+    h.thread_count = (uint32_t)nthreads;
+    h.pid = (int32_t)getpid();
+    h.timestamp_ns = realtime_ns();
+    h.supported = g_caps.supported;
+    gethostname(h.host, sizeof(h.host) - 1);
+    buf_append(buf, &h, sizeof(h));
+
+    for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+        char key[CPUTRACE_SNAP_KEY_LEN] = {};
+        snprintf(key, sizeof(key), "%s", hw_events[i].key);
+        buf_append(buf, key, sizeof(key));
+    }
+    for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+        uint64_t lower = cputrace_hist_bucket_lower(b);
+        buf_append(buf, &lower, sizeof(lower));
+    }
+    for (int t = 0; t < nthreads; t++) {
+        struct cputrace_snap_thread th;
+        memset(&th, 0, sizeof(th));
+        th.tid = g_threads[t].tid;
+        memcpy(th.name, g_threads[t].name, sizeof(th.name));
+        buf_append(buf, &th, sizeof(th));
+    }
+
+    for (const struct cputrace_snapshot_entry* e : order) {
+        const struct cputrace_stats* stats = &e->stats;
+        size_t rec_start = buf->len;
+        struct cputrace_snap_anchor a;
+        memset(&a, 0, sizeof(a));
+        snprintf(a.name, sizeof(a.name), "%s", e->name);
+        a.call_count = stats->call_count;
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+                a.hist_entries += stats->hist[i][b] > 0;
+            }
+        }
+        for (int t = 0; t < nthreads; t++) {
+            a.thread_entries += stats->threads[t].call_count > 0;
+        }
+        buf_append(buf, &a, sizeof(a));
+        buf_append(buf, stats->sum, sizeof(stats->sum));
+        buf_append(buf, stats->sumsq, sizeof(stats->sumsq));
+        for (int i = 0; i < CPUTRACE_RESULT_LAST; i++) {
+            for (int b = 0; b < CPUTRACE_HIST_BUCKETS; b++) {
+                if (stats->hist[i][b] > 0) {
+                    struct cputrace_snap_bucket bucket = { (uint32_t)i, (uint32_t)b, stats->hist[i][b] };
+                    buf_append(buf, &bucket, sizeof(bucket));
+                }
+            }
+        }
+        for (int t = 0; t < nthreads; t++) {
+            const struct cputrace_thread_stats* ts = &stats->threads[t];
+            if (ts->call_count == 0) {
+                continue;
+            }
+            struct cputrace_snap_thread_stats th = { (uint32_t)t, 0, ts->call_count };
+            buf_append(buf, &th, sizeof(th));
+            buf_append(buf, ts->sum, sizeof(ts->sum));
+        }
+        if (buf->len - rec_start >= sizeof(a)) {
+            ((struct cputrace_snap_anchor*)(buf->data + rec_start))->record_size = buf->len - rec_start;
+        }
+    }
+    if (buf->len - start >= sizeof(h)) {
+        ((struct cputrace_snap_header*)(buf->data + start))->total_size = buf->len - start;
+    }
+}
+
+// One line per caller context, outermost frame first and the anchor as the
+// leaf, with the context's total of the ranking metric: the input format of
+// flamegraph.pl and most flame graph viewers. The values are inclusive, so
+// anchors nested in each other are counted once per anchor.
+static void format_folded(struct cputrace_buf* buf, const std::vector<const struct cputrace_snapshot_entry*>& order) {
+    const struct cputrace_caller_stats* callers[CPUTRACE_MAX_CALLERS + 1];
+    char frame[512];
+    for (const struct cputrace_snapshot_entry* e : order) {
+        int metric = callers_metric(&e->stats);
+        size_t n = callers_sorted(&e->stats, metric, callers);
+        for (size_t k = 0; k < n; k++) {
+            const struct cputrace_caller_stats* cs = callers[k];
+            if (cs->sum[metric] == 0) {
+                continue;
+            }
+            if (caller_overflow(&e->stats, cs)) {
+                buf_printf(buf, "[other contexts];");
+            }
+            int depth = 0;
+            while (depth < CPUTRACE_CALLER_DEPTH && cs->pc[depth]) {
+                depth++;
+            }
+            for (int d = depth - 1; d >= 0; d--) {
+                format_caller_frame(cs->pc[d], false, frame, sizeof(frame));
+                for (char* c = frame; *c; c++) {
+                    if (*c == ';') {
+                        *c = ':';
+                    }
+                }
+                buf_printf(buf, "%s;", frame);
+            }
+            buf_printf(buf, "%s %" PRIu64 "\n", e->name, cs->sum[metric]);
+        }
+    }
+}
+
+static size_t cputrace_render(const struct cputrace_dump_opts* opts, struct cputrace_buf* buf) {
+    struct cputrace_dump_opts defaults;
+    if (!opts) {
+        cputrace_dump_opts_init(&defaults);
+        opts = &defaults;
+    }
+    std::vector<const struct cputrace_snapshot_entry*> order;
+    struct cputrace_snapshot_entry* entries = snapshot_ordered(opts, &order);
+    if (!entries) {
+        return 0;
+    }
+
+    if (opts->format == CPUTRACE_FORMAT_TEXT) {
+        format_capabilities(buf);
+        for (const struct cputrace_snapshot_entry* e : order) {
+            format_text_anchor(buf, e->name, &e->stats, opts->flags);
+        }
+    } else if (opts->format == CPUTRACE_FORMAT_BINARY) {
+        format_snapshot(buf, order);
+    } else if (opts->format == CPUTRACE_FORMAT_FOLDED) {
+        format_folded(buf, order);
+    } else if (opts->format == CPUTRACE_FORMAT_CSV) {
+        cputrace_csv_writer csv(buf);
+        csv.open_object_section("cputrace");
+        dump_anchors(&csv, order, opts->flags);
+        csv.close_section();
+    } else {
+        cputrace_json_writer json(buf);
+        json.open_object_section("cputrace");
+        dump_anchors(&json, order, opts->flags);
+        json.close_section();
+    }
+    free(entries);
+    return order.size();
+}
+
+void cputrace_dump_opts_init(struct cputrace_dump_opts* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->format = CPUTRACE_FORMAT_TEXT;
+    opts->sort_by = CPUTRACE_SORT_NONE;
+}
+
+int cputrace_dump_fd(int fd, const struct cputrace_dump_opts* opts) {
+    struct cputrace_buf buf = {};
+    cputrace_render(opts, &buf);
+    size_t off = 0;
+    while (off < buf.len) {
+        ssize_t n = write(fd, buf.data + off, buf.len - off);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(errno));
+            free(buf.data);
+            return -1;
+        }
+        off += n;
+    }
+    free(buf.data);
+    return 0;
+}
+
+int cputrace_dump_file(FILE* fp, const struct cputrace_dump_opts* opts) {
+    struct cputrace_buf buf = {};
+    cputrace_render(opts, &buf);
+    int ret = 0;
+    if (buf.len > 0 && fwrite(buf.data, 1, buf.len, fp) != buf.len) {
+        fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(errno));
+        ret = -1;
     }
+    fflush(fp);
+    free(buf.data);
+    return ret;
+}
+
+char* cputrace_dump_buffer(const struct cputrace_dump_opts* opts, size_t* len) {
+    struct cputrace_buf buf = {};
+    cputrace_render(opts, &buf);
+    buf_printf(&buf, "%s", "");
+    if (len) {
+        *len = buf.len;
+    }
+    return buf.data;
+}
+
+void cputrace_dump(void) {
+    cputrace_dump_ex(0);
+}
+
+void cputrace_dump_ex(uint64_t dump_flags) {
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.flags = dump_flags;
+    cputrace_dump_file(stdout, &opts);
     printf("Profiling data dumped\n");
     fflush(stdout);
-    pthread_mutex_unlock(&g_profiler.file_mutex);
 }
 
 void cputrace_close(void) {
+    cputrace_dump_file(stdout, NULL);
     pthread_mutex_lock(&g_profiler.file_mutex);
     if (!g_profiler.anchors) {
         pthread_mutex_unlock(&g_profiler.file_mutex);
         return;
     }
     for (uint64_t i = 0; i < CPUTRACE_MAX_ANCHORS; i++) {
-        pthread_mutex_lock(&g_profiler.anchors[i].mutex);
-        if (g_profiler.anchors[i].name && g_profiler.anchors[i].call_count > 0) {
-            cputrace_anchor_thread_flush(&g_profiler.anchors[i]);
-        }
-        pthread_mutex_unlock(&g_profiler.anchors[i].mutex);
         pthread_mutex_destroy(&g_profiler.anchors[i].mutex);
         if (g_profiler.anchors[i].results_arena) {
             arena_destroy(g_profiler.anchors[i].results_arena);
@@ -620,6 +4465,8 @@ void cputrace_close(void) {
         }
         g_profiler.anchors = NULL;
     }
+    g_percpu.enabled = false;
+    percpu_close_all();
     pthread_mutex_destroy(&g_profiler.file_mutex);
     printf("Profiling closed\n");
     fflush(stdout);
@@ -2,35 +2,70 @@
 #define CPUTRACE_H
 
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <linux/perf_event.h>
 
-#define CPUTRACE_MAX_ANCHORS 128
+// The profiling macros use the __COUNTER__ indices below
+// CPUTRACE_MACRO_ANCHORS; cputrace_anchor_register() hands out the slots
+// above them.
+#define CPUTRACE_MACRO_ANCHORS 128
+#define CPUTRACE_RUNTIME_ANCHORS 384
+#define CPUTRACE_MAX_ANCHORS (CPUTRACE_MACRO_ANCHORS + CPUTRACE_RUNTIME_ANCHORS)
+#define CPUTRACE_MAX_CPUS 1024
+#define CPUTRACE_MAX_PERCPU 64
+#define CPUTRACE_MAX_THREADS 256
+#define CPUTRACE_HIST_BUCKETS 252
+#define CPUTRACE_TOPK 8
+#define CPUTRACE_MAX_KEYS 16
+#define CPUTRACE_MAX_SAMPLE_IPS 128
+#define CPUTRACE_MAX_NODES 8
+#define CPUTRACE_LOCK_SITES 16
+#define CPUTRACE_TOPDOWN_EVENTS 5
+#define CPUTRACE_CALLER_DEPTH 8
+#define CPUTRACE_MAX_CALLERS 32
+
+enum cputrace_result_type {
+    CPUTRACE_RESULT_SWI = 0,
+    CPUTRACE_RESULT_CYC = 1,
+    CPUTRACE_RESULT_CMISS = 2,
+    CPUTRACE_RESULT_BMISS = 3,
+    CPUTRACE_RESULT_INS = 4,
+    CPUTRACE_RESULT_WALL = 5,
+    CPUTRACE_RESULT_TASK = 6,
+    CPUTRACE_RESULT_OFFCPU_BLOCKED = 7,
+    CPUTRACE_RESULT_OFFCPU_PREEMPTED = 8,
+    CPUTRACE_RESULT_PGFAULT = 9,
+    CPUTRACE_RESULT_MINFLT = 10,
+    CPUTRACE_RESULT_MAJFLT = 11,
+    CPUTRACE_RESULT_INBLOCK = 12,
+    CPUTRACE_RESULT_OUBLOCK = 13,
+    CPUTRACE_RESULT_NVCSW = 14,
+    CPUTRACE_RESULT_NIVCSW = 15,
+    CPUTRACE_RESULT_RCHAR = 16,
+    CPUTRACE_RESULT_WCHAR = 17,
+    CPUTRACE_RESULT_READ_BYTES = 18,
+    CPUTRACE_RESULT_WRITE_BYTES = 19,
+    CPUTRACE_RESULT_LAST = 20
+};
 
 struct HW_conf {
-    bool capture_swi;
-    bool capture_cyc;
-    bool capture_cmiss;
-    bool capture_bmiss;
-    bool capture_ins;
+    bool capture[CPUTRACE_RESULT_LAST];
 };
 
 struct HW_ctx {
-    int fd_swi;
-    int fd_cyc;
-    int fd_cmiss;
-    int fd_bmiss;
-    int fd_ins;
+    int fd[CPUTRACE_RESULT_LAST];
     struct HW_conf conf;
 };
 
 struct HW_measure {
-    long long swi;
-    long long cyc;
-    long long cmiss;
-    long long bmiss;
-    long long ins;
+    long long value[CPUTRACE_RESULT_LAST];
+    long long kernel[CPUTRACE_RESULT_LAST];  // kernel-mode part of value
+    uint64_t kernel_valid;                   // bit i set when kernel[i] was read
 };
 
 struct ArenaRegion {
@@ -46,25 +81,160 @@ struct Arena {
     bool growable;
 };
 
-struct cputrace_anchor {
+// Core-wide activity of one monitored CPU, summed over the scopes of an
+// anchor that started and finished on that CPU.
+struct cputrace_core_stats {
+    int cpu;
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_RESULT_LAST];
+};
+
+// The anchor's own counters summed over the calls that started and ended on
+// one NUMA node's CPUs, or over the calls that migrated
+struct cputrace_node_stats {
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_RESULT_LAST];
+};
+
+// Heap activity of an anchor's scopes, see cputrace_alloc_enable
+struct cputrace_alloc_stats {
+    uint64_t call_count;
+    uint64_t count;         // allocations, including reallocs
+    uint64_t bytes;         // allocated
+    uint64_t freed;
+    uint64_t peak_sum;      // per call: highest outstanding bytes above entry
+    uint64_t peak_max;
+};
+
+// One lock waited for inside an anchor's scopes
+struct cputrace_lock_site {
+    uint64_t lock;          // address, 0 while the slot is free
+    uint64_t contended;
+    uint64_t wait_ns;
+};
+
+// Lock waits inside an anchor's scopes, charged to the innermost active
+// scope of the waiting thread. Updated lock-free by that thread; locks that
+// find no free slot are added to sites[CPUTRACE_LOCK_SITES].
+struct cputrace_lock_stats {
+    uint64_t contended;     // acquires that had to wait
+    uint64_t wait_ns;
+    uint64_t cond_waits;
+    uint64_t cond_wait_ns;
+    struct cputrace_lock_site sites[CPUTRACE_LOCK_SITES + 1];
+};
+
+// Top-down event group totals, see cputrace_topdown_enable
+struct cputrace_topdown_stats {
+    uint64_t call_count;
+    uint64_t unscheduled;   // calls during which the PMU never ran the group
+    uint64_t sum[CPUTRACE_TOPDOWN_EVENTS];
+};
+
+// One caller context of an anchor: the return addresses above the scope's
+// function, see cputrace_callers_enable. Contexts that find no free slot
+// are added to callers[CPUTRACE_MAX_CALLERS].
+struct cputrace_caller_stats {
+    uint64_t signature;     // hash of pc, 0 while the slot is free
+    uint64_t pc[CPUTRACE_CALLER_DEPTH];  // nearest caller first, 0 after the last
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_RESULT_LAST];
+};
+
+// Running heap totals of one thread, kept by the interposer
+struct cputrace_alloc_counters {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t freed;
+    int64_t outstanding;
+    int64_t peak;           // highest outstanding since the innermost scope began
+};
+
+struct cputrace_thread_info {
+    pid_t tid;
+    char name[16];
+};
+
+struct cputrace_thread_stats {
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_RESULT_LAST];
+};
+
+// Per-key totals of a tagged anchor, claimed under the anchor mutex; keys
+// that find no free slot are added to the overflow slot keys[CPUTRACE_MAX_KEYS].
+struct cputrace_key_stats {
+    uint64_t slot_key;      // key + 1, 0 while the slot is free
+    const char* name;       // interned name for string keys, NULL otherwise
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_RESULT_LAST];
+};
+
+// Runtime key of a scope: a small integer or an interned string
+struct cputrace_key {
+    bool set;
+    uint64_t value;
     const char* name;
-    pthread_mutex_t mutex;
-    struct Arena* results_arena;
+};
+
+// Instruction addresses sampled while the anchor's scopes were active
+struct cputrace_sample_ip {
+    uint64_t ip;
+    uint64_t count;
+};
+
+struct cputrace_sample_stats {
+    uint64_t samples;
+    uint64_t lost;      // overwritten in the ring before the scope ended
+    uint64_t dropped;   // table full
+    struct cputrace_sample_ip ips[CPUTRACE_MAX_SAMPLE_IPS];
+};
+
+// One of the most expensive calls of an anchor
+struct cputrace_topk_entry {
+    uint64_t timestamp_ns;  // CLOCK_REALTIME at scope entry
+    uint64_t tag;
+    int thread;             // slot in the thread table
+    uint64_t value[CPUTRACE_RESULT_LAST];
+};
+
+// Everything aggregated for an anchor. Updated under the anchor mutex and
+// copied out as a whole when a snapshot is taken.
+struct cputrace_stats {
     uint64_t call_count;
-    uint64_t sum_swi;
-    uint64_t sum_cyc;
-    uint64_t sum_cmiss;
-    uint64_t sum_bmiss;
-    uint64_t sum_ins;
+    uint64_t sum[CPUTRACE_RESULT_LAST];
+    double sumsq[CPUTRACE_RESULT_LAST];
+    uint64_t hist[CPUTRACE_RESULT_LAST][CPUTRACE_HIST_BUCKETS];
+    uint64_t segment_count;
+    uint64_t core_migrated;
+    struct cputrace_core_stats core[CPUTRACE_MAX_PERCPU];
+    struct cputrace_thread_stats threads[CPUTRACE_MAX_THREADS];
+    int topk_metric;
+    uint32_t topk_count;
+    uint64_t topk_min;
+    struct cputrace_topk_entry topk[CPUTRACE_TOPK];
+    struct cputrace_key_stats keys[CPUTRACE_MAX_KEYS + 1];
+    struct cputrace_sample_stats samples;
+    // User/kernel split, over the calls where the kernel part was counted
+    uint64_t split_sum[CPUTRACE_RESULT_LAST];
+    uint64_t kernel_sum[CPUTRACE_RESULT_LAST];
+    // NUMA breakdown, see cputrace_numa_enable
+    uint64_t cpu_calls[CPUTRACE_MAX_CPUS];
+    struct cputrace_node_stats nodes[CPUTRACE_MAX_NODES];
+    struct cputrace_node_stats migrated;
+    uint64_t node_migrated;  // migrated calls that also changed node
+    struct cputrace_alloc_stats alloc;
+    struct cputrace_lock_stats lock;
+    struct cputrace_topdown_stats topdown;
+    struct cputrace_caller_stats callers[CPUTRACE_MAX_CALLERS + 1];
 };
 
-enum cputrace_result_type {
-    CPUTRACE_RESULT_SWI = 0,
-    CPUTRACE_RESULT_CYC = 1,
-    CPUTRACE_RESULT_CMISS = 2,
-    CPUTRACE_RESULT_BMISS = 3,
-    CPUTRACE_RESULT_INS = 4,
-    CPUTRACE_RESULT_LAST = 5
+struct cputrace_anchor {
+    const char* name;
+    pthread_mutex_t mutex;
+    struct Arena* results_arena;
+    struct cputrace_stats stats;
+    uint32_t triggers;      // bit per trigger rule bound to this anchor
+    uint64_t trigger_gen;   // rule generation the binding is for
 };
 
 struct cputrace_result {
@@ -90,25 +260,374 @@ void arena_destroy(struct Arena* arena);
 void cputrace_start(void);
 void cputrace_stop(void);
 void cputrace_reset(void);
+// Same as start/stop/reset without printing; for embedders with their own
+// output. cputrace_set_profiling returns -1 if already in that state.
+int cputrace_set_profiling(bool on);
+void cputrace_clear(void);
 void cputrace_dump(void);
+void cputrace_dump_ex(uint64_t dump_flags);
 void cputrace_close(void);
 
+// Metric used to rank the top-K calls of each anchor. CPUTRACE_METRIC_AUTO
+// picks cycles when they are counted and wall time otherwise.
+#define CPUTRACE_METRIC_AUTO (-1)
+void cputrace_set_topk_metric(int metric);
+
+// Returns one stable pointer per distinct string, for use as a scope key.
+// Takes a lock; look names up once and keep the result.
+const char* cputrace_intern(const char* name);
+
+// Anchor index for a name known only at runtime, the same index for the
+// same name. `name` must outlive the profiler. Slots come from the
+// CPUTRACE_RUNTIME_ANCHORS above the macro range; returns -1 when those are
+// taken.
+int cputrace_anchor_register(const char* name);
+
+// Automatic instrumentation of code built with -finstrument-functions.
+// Every function address is symbolized and filtered once, on its first
+// entry, and the decision is cached; functions that pass get an anchor named
+// after them and are measured with `flags`. The filter is `regex`, a POSIX
+// extended regular expression over the demangled name, plus the names added
+// with cputrace_auto_allow() before enabling; with neither, every
+// instrumented function is measured. Re-enabling discards the cache.
+int cputrace_auto_enable(const char* regex, uint64_t flags);
+void cputrace_auto_allow(const char* name);
+void cputrace_auto_disable(void);
+
+// Which metrics work on this system, probed once at startup. Unsupported
+// events are skipped for the life of the process. Without any hardware
+// counter, scopes asking for one count task-clock, page-faults and
+// context-switches instead (software fallback).
+bool cputrace_event_supported(int metric);
+bool cputrace_software_fallback(void);
+
+// Metric for a dump key ("cycles"), event name ("wall-time-ns") or short
+// name ("cyc"); -1 if unknown
+int cputrace_metric_from_name(const char* name);
+const char* cputrace_metric_name(int metric);
+
+// Hotspot sampling: scopes declared with HW_PROFILE_SAMPLE arm a per-thread
+// overflow-sampling event (perf type/config, one sample every `period`
+// events) and attribute the sampled instruction addresses to the anchor.
+// The event only runs while such a scope is active.
+int cputrace_sampling_enable(uint32_t type, uint64_t config, uint64_t period);
+void cputrace_sampling_disable(void);
+
+// Counts every hardware event a second time in kernel mode only, in the same
+// event group, so dumps can split each counter into user and kernel time.
+// Returns -1 when the process may not count kernel mode (perf_event_paranoid
+// >= 2 without CAP_PERFMON or CAP_SYS_ADMIN).
+int cputrace_kernel_split_enable(void);
+void cputrace_kernel_split_disable(void);
+
+// Counts user mode only in every hardware event opened from now on, as
+// perf's ":u" modifier does; kernel mode can then be added with the split
+// above. Software events such as context switches still count kernel mode.
+void cputrace_set_user_only(bool on);
+
+// Control channel for a running process, served by a background thread.
+// Commands are single lines on the Unix socket at `socket_path`:
+//   start [SECONDS]   profile, optionally for a bounded window only
+//   stop | reset
+//   dump [format=text|json|csv|binary|folded] [filter=NAME] [metric=KEY] [sort=KEY|calls]
+//        [avg] [top=N] [threads] [thread_names]
+//   capture           cputrace_trigger_dump()
+// The reply is written back on the connection. A non-zero `dump_signal`
+// (e.g. SIGUSR2) makes the thread write a text dump to stderr; the handler
+// itself only wakes the thread. Either may be NULL / 0.
+int cputrace_control_start(const char* socket_path, int dump_signal);
+void cputrace_control_stop(void);
+
+// Triggered capture. A rule fires when one call of the named anchor exceeds
+// `threshold` (metric units, e.g. cycles or ns; 0 for none) or when its
+// rolling average rises `rise_pct` percent over its long-run baseline (0 for
+// none). Then every new scope also records `detail_flags` for `window_ms`.
+// The calls before and during the window are kept in a ring of `history`
+// records, at most half of it for the window, that cputrace_trigger_dump()
+// prints; it returns -1 while nothing has been
+// captured and re-arms the triggers after printing.
+struct cputrace_trigger_opts {
+    uint64_t detail_flags;  // HW_PROFILE_* added while detailed
+    uint64_t window_ms;
+    uint32_t history;       // per-call records kept
+};
+
+void cputrace_trigger_opts_init(struct cputrace_trigger_opts* opts);
+int cputrace_trigger_enable(const struct cputrace_trigger_opts* opts);
+int cputrace_trigger_add(const char* anchor, int metric, uint64_t threshold, double rise_pct);
+void cputrace_trigger_disable(void);
+int cputrace_trigger_dump(FILE* fp);
+
+// A/B experiments. Two or more variants of a code path are registered under
+// one experiment and run by cputrace_experiment_run on the calling thread,
+// in randomized blocks: every block runs each variant `calls_per_block`
+// times, in a fresh random order, and records its per-call value of every
+// metric. Drift in clock speed, caches or background load then falls on all
+// variants alike. The report gives each variant's median over the blocks
+// with a 95% confidence interval and, per metric, the winner when its
+// per-block differences to the runner-up are significant.
+#define CPUTRACE_MAX_VARIANTS 8
+
+struct cputrace_experiment_opts {
+    uint64_t flags;             // HW_PROFILE_* to count; wall time always
+    uint32_t blocks;            // samples per variant
+    uint32_t calls_per_block;
+    uint32_t warmup_blocks;     // run first, not recorded
+    uint64_t seed;              // of the block order, 0 for a random one
+};
+
+struct cputrace_experiment;
+
+void cputrace_experiment_opts_init(struct cputrace_experiment_opts* opts);
+struct cputrace_experiment* cputrace_experiment_create(const char* name,
+                                                       const struct cputrace_experiment_opts* opts);
+// Returns the variant's index, -1 when the experiment is full or has run
+int cputrace_experiment_add(struct cputrace_experiment* exp, const char* variant, void (*fn)(void* arg),
+                            void* arg);
+int cputrace_experiment_run(struct cputrace_experiment* exp);
+// -1 until the experiment has run
+int cputrace_experiment_report(const struct cputrace_experiment* exp, FILE* fp);
+double cputrace_experiment_median(const struct cputrace_experiment* exp, int variant, int metric);
+// Index of the variant with the significantly lowest median, -1 for none
+int cputrace_experiment_winner(const struct cputrace_experiment* exp, int metric);
+void cputrace_experiment_destroy(struct cputrace_experiment* exp);
+
+// Publishes the anchor table to a POSIX shared-memory segment (layout in
+// cputrace_shm.h) for cputrace_top. `name` defaults to "/cputrace.<pid>".
+int cputrace_shm_enable(const char* name);
+void cputrace_shm_disable(void);
+
+// Records the CPU every scope starts and ends on. Calls that stayed on one
+// CPU are broken down by that CPU and its NUMA node (from
+// /sys/devices/system/node); calls that migrated are reported apart.
+int cputrace_numa_enable(void);
+void cputrace_numa_disable(void);
+
+// Allocation accounting. With cputrace_alloc.o linked into the program,
+// malloc, free and friends (and so new and delete) keep thread-local
+// totals; once enabled, every HW_profile scope is charged the allocations,
+// bytes allocated and freed, and peak outstanding bytes of its thread while
+// it ran, nested scopes included. Returns -1 when the interposer is not
+// linked in.
+int cputrace_alloc_enable(void);
+void cputrace_alloc_disable(void);
+struct cputrace_alloc_counters* cputrace_alloc_thread(void);
+
+// Lock contention. With cputrace_lock.o linked into the program,
+// pthread_mutex_lock, the rwlock acquires and the condition waits are
+// interposed; once enabled, an acquire that finds its lock taken is timed,
+// and the wait is charged to the waiting thread's innermost HW_profile scope
+// together with the lock's address. Uncontended acquires only pay for a
+// trylock. Returns -1 when the interposer is not linked in.
+int cputrace_lock_enable(void);
+void cputrace_lock_disable(void);
+// Between the interposer and the profiler
+void cputrace_lock_hooks(bool on);
+void cputrace_lock_wait(const void* lock, uint64_t wait_ns, bool cond);
+
+// The /proc/thread-self/io counters cost a read of a proc file, so a
+// thread re-reads them at most once per `ns` (default 1 ms) and otherwise
+// reuses the last values. Bytes are then charged to the call during which
+// they were picked up: right in total over many calls, approximate per call.
+// 0 reads them on every scope entry and exit.
+void cputrace_io_interval(uint64_t ns);
+
+// Top-down lite. Scopes declared with HW_PROFILE_TOPDOWN count an extra
+// event group and dumps show their level-1 breakdown: retiring, bad
+// speculation, frontend bound and backend bound, in percent of issue slots.
+// Uses Intel's topdown events on Intel Core models before Ice Lake and the
+// generic stalled-cycles events elsewhere. Returns -1, and dumps say "unsupported", when the CPU has
+// neither.
+int cputrace_topdown_enable(void);
+void cputrace_topdown_disable(void);
+
+// Caller contexts. Scopes declared with HW_PROFILE_CALLERS record the
+// `depth` (at most CPUTRACE_CALLER_DEPTH) return addresses above their
+// function, found by walking frame pointers, and their counters are also
+// summed per distinct call stack. Dumps list the most expensive contexts,
+// symbolized; CPUTRACE_FORMAT_FOLDED writes them as folded stacks for flame
+// graphs. The walk stays on the thread's stack and stops at the first frame
+// without a frame pointer, so build callers with -fno-omit-frame-pointer.
+int cputrace_callers_enable(int depth);
+void cputrace_callers_disable(void);
+
+int cputrace_percpu_enable(const cpu_set_t* cpus);
+void cputrace_percpu_disable(void);
+
 struct HW_profile {
-    struct HW_ctx ctx;
     const char* function;
     uint64_t index;
     uint64_t flags;
+    bool active;
+    int cpu;
+    int entry_cpu;
+    int sample_prev;
+    uint64_t tag;
+    struct cputrace_key key;
+    struct HW_measure start;
+    struct HW_measure core_start;
+    struct cputrace_alloc_counters* alloc;
+    struct cputrace_alloc_counters alloc_start;
+    uint64_t lock_prev;     // enclosing scope's anchor, while lock waits are charged
+    bool topdown;
+    uint64_t topdown_start[CPUTRACE_TOPDOWN_EVENTS + 1];  // group values, time running
+    uint64_t caller_signature;  // 0 when callers are not recorded
+    uint64_t caller_pc[CPUTRACE_CALLER_DEPTH];
 
     HW_profile(const char* function, uint64_t index, uint64_t flags);
+    // Inline, so that the first constructor is always called from the
+    // scope's own function and the caller walk skips the same frames
+    __attribute__((always_inline)) HW_profile(const char* function, uint64_t index, uint64_t flags,
+                                              uint64_t key)
+        : HW_profile(function, index, flags) {
+        set_key(key);
+    }
+    __attribute__((always_inline)) HW_profile(const char* function, uint64_t index, uint64_t flags,
+                                              const char* key)
+        : HW_profile(function, index, flags) {
+        set_key_name(key);
+    }
     ~HW_profile();
+    void set_tag(uint64_t value) { tag = value; }
+    void set_key(uint64_t value) { key.set = true; key.value = value; key.name = NULL; }
+    void set_key_name(const char* name) { key.set = true; key.value = (uintptr_t)name; key.name = name; }
+};
+
+// A span is a scope that can be suspended and continued later, possibly on
+// another thread. Only the on-CPU segments between resume() and pause() are
+// counted; their deltas are summed and recorded as a single call of the
+// anchor by finish() (or the destructor). A span must not be used by two
+// threads at the same time.
+struct HW_span {
+    const char* function;
+    uint64_t index;
+    uint64_t flags;
+    bool active;
+    bool running;
+    uint64_t segments;
+    uint64_t tag;
+    uint64_t start_time;
+    struct cputrace_key key;
+    struct HW_measure start;
+    struct HW_measure total;
+
+    HW_span(const char* function, uint64_t index, uint64_t flags);
+    ~HW_span();
+    void set_tag(uint64_t value) { tag = value; }
+    void set_key(uint64_t value) { key.set = true; key.value = value; key.name = NULL; }
+    void set_key_name(const char* name) { key.set = true; key.value = (uintptr_t)name; key.name = name; }
+    void pause();
+    void resume();
+    void finish();
+};
+
+enum cputrace_dump_flags {
+    CPUTRACE_DUMP_THREADS = 1,      // per thread, by kernel name and TID
+    CPUTRACE_DUMP_THREAD_NAMES = 2  // threads sharing a name rolled up
 };
 
+enum cputrace_format {
+    CPUTRACE_FORMAT_TEXT = 0,
+    CPUTRACE_FORMAT_JSON = 1,
+    CPUTRACE_FORMAT_CSV = 2,
+    CPUTRACE_FORMAT_BINARY = 3, // snapshot for cputrace_merge, see cputrace_snapshot.h
+    CPUTRACE_FORMAT_FOLDED = 4  // caller contexts as folded stacks, one line each
+};
+
+// Sort keys besides the cputrace_result_type metrics
+#define CPUTRACE_SORT_NONE  (-2)
+#define CPUTRACE_SORT_CALLS (-1)
+
+struct cputrace_dump_opts {
+    enum cputrace_format format;
+    uint64_t flags;       // cputrace_dump_flags
+    int sort_by;          // cputrace_result_type or CPUTRACE_SORT_*
+    bool sort_by_avg;     // rank by per-call average instead of total
+    uint32_t top_n;       // 0 for all anchors
+    const char* filter;   // only anchors whose name contains this, NULL for all
+    const char* metric;   // only this metric key (e.g. "cycles"), NULL for all
+};
+
+// Structured output sink. The section/dump calls mirror ceph::Formatter so
+// the same emitter drives JSON, CSV and the Ceph adapter.
+class cputrace_writer {
+public:
+    virtual ~cputrace_writer() {}
+    virtual void open_object_section(const char* name) = 0;
+    virtual void open_array_section(const char* name) = 0;
+    virtual void close_section() = 0;
+    virtual void dump_unsigned(const char* name, uint64_t value) = 0;
+    virtual void dump_int(const char* name, int64_t value) = 0;
+    virtual void dump_float(const char* name, double value) = 0;
+    virtual void dump_string(const char* name, const char* value) = 0;
+};
+
+// Programmatic results for one anchor, e.g. for performance assertions in
+// tests (see cputrace_test.h). Percentiles come from the histograms and are
+// bucket midpoints.
+struct cputrace_metric_summary {
+    uint64_t total;
+    double avg;
+    double stddev;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+};
+
+struct cputrace_anchor_summary {
+    const char* name;
+    uint64_t call_count;
+    uint64_t recorded;  // bit per metric that was counted
+    struct cputrace_metric_summary metric[CPUTRACE_RESULT_LAST];
+};
+
+// Returns -1 when the anchor is unknown or has no calls
+int cputrace_query(const char* anchor, struct cputrace_anchor_summary* out);
+int cputrace_clear_anchor(const char* anchor);
+
+int cputrace_hist_bucket(uint64_t value);
+uint64_t cputrace_hist_bucket_lower(int bucket);
+uint64_t cputrace_hist_percentile(const uint64_t* hist, double p);
+
+void cputrace_dump_opts_init(struct cputrace_dump_opts* opts);
+int cputrace_dump_fd(int fd, const struct cputrace_dump_opts* opts);
+int cputrace_dump_file(FILE* fp, const struct cputrace_dump_opts* opts);
+// Emits the capabilities and anchors sections into the caller's open
+// section. Returns the number of anchors written.
+size_t cputrace_dump_writer(cputrace_writer* w, const struct cputrace_dump_opts* opts);
+char* cputrace_dump_buffer(const struct cputrace_dump_opts* opts, size_t* len);
+
 enum HW_profile_flags {
     HW_PROFILE_SWI = 1,
     HW_PROFILE_CYC = 2,
     HW_PROFILE_CMISS = 4,
     HW_PROFILE_BMISS = 8,
-    HW_PROFILE_INS = 16
+    HW_PROFILE_INS = 16,
+    HW_PROFILE_WALL = 32,   // always recorded
+    HW_PROFILE_TASK = 64,   // on-CPU time; off-CPU time is wall - task
+    HW_PROFILE_OFFCPU_BLOCKED = 128,    // off-CPU time split by reason,
+    HW_PROFILE_OFFCPU_PREEMPTED = 256,  // from PERF_RECORD_SWITCH
+    HW_PROFILE_OFFCPU = HW_PROFILE_TASK | HW_PROFILE_OFFCPU_BLOCKED | HW_PROFILE_OFFCPU_PREEMPTED,
+    HW_PROFILE_PGFAULT = 512,
+    // getrusage(RUSAGE_THREAD) deltas
+    HW_PROFILE_MINFLT = 1 << 10,
+    HW_PROFILE_MAJFLT = 1 << 11,
+    HW_PROFILE_INBLOCK = 1 << 12,   // block input operations
+    HW_PROFILE_OUBLOCK = 1 << 13,
+    HW_PROFILE_NVCSW = 1 << 14,     // voluntary context switches
+    HW_PROFILE_NIVCSW = 1 << 15,
+    HW_PROFILE_RUSAGE = HW_PROFILE_MINFLT | HW_PROFILE_MAJFLT | HW_PROFILE_INBLOCK |
+                        HW_PROFILE_OUBLOCK | HW_PROFILE_NVCSW | HW_PROFILE_NIVCSW,
+    // /proc/thread-self/io byte counts, see cputrace_io_interval
+    HW_PROFILE_RCHAR = 1 << 16,     // read by syscalls, page cache hits included
+    HW_PROFILE_WCHAR = 1 << 17,
+    HW_PROFILE_READ_BYTES = 1 << 18,    // fetched from storage
+    HW_PROFILE_WRITE_BYTES = 1 << 19,   // sent to storage, charged to the dirtier
+    HW_PROFILE_IO = HW_PROFILE_RCHAR | HW_PROFILE_WCHAR | HW_PROFILE_READ_BYTES | HW_PROFILE_WRITE_BYTES,
+    // Options sit above the metric bits
+    HW_PROFILE_SAMPLE = 0x40000000, // hotspot sampling, see cputrace_sampling_enable
+    HW_PROFILE_TOPDOWN = 0x20000000, // top-down breakdown, see cputrace_topdown_enable
+    HW_PROFILE_CALLERS = 0x10000000  // caller contexts, see cputrace_callers_enable
 };
 
 #define NameConcat2(A, B) A##B
@@ -117,5 +636,15 @@ enum HW_profile_flags {
     struct HW_profile variable(label, (uint64_t)(__COUNTER__ + 1), HW_PROFILE_CYC)
 #define HWProfileFunctionF(variable, label, flags) \
     struct HW_profile variable(label, (uint64_t)(__COUNTER__ + 1), flags)
+// Tagged scopes: counters are also broken down by a runtime key, either a
+// small integer or a string literal / cputrace_intern() result.
+#define HWProfileFunctionKeyF(variable, label, flags, key) \
+    struct HW_profile variable(label, (uint64_t)(__COUNTER__ + 1), flags, (uint64_t)(key))
+#define HWProfileFunctionNameF(variable, label, flags, name) \
+    struct HW_profile variable(label, (uint64_t)(__COUNTER__ + 1), flags, (const char*)(name))
+#define HWProfileSpanF(variable, label, flags) \
+    struct HW_span variable(label, (uint64_t)(__COUNTER__ + 1), flags)
+#define HWProfileSpanNew(label, flags) \
+    (new HW_span(label, (uint64_t)(__COUNTER__ + 1), flags))
 
 #endif // CPUTRACE_H
\ No newline at end of file
@@ -0,0 +1,118 @@
+// Heap allocation interposer for the per-anchor allocation accounting (see
+// cputrace_alloc_enable). Link this object into the program, ahead of the C
+// library; libstdc++'s operator new and delete then come through here too.
+// The hooks forward to glibc's __libc_* entry points and only touch
+// thread-local counters: no locks, no allocation, no calls back into
+// cputrace. Sizes are malloc_usable_size() so that frees balance allocations.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+#include "cputrace.h"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+static __thread struct cputrace_alloc_counters g_alloc_tls __attribute__((tls_model("initial-exec")));
+
+static inline void alloc_count(void* ptr) {
+    struct cputrace_alloc_counters* c = &g_alloc_tls;
+    size_t size = malloc_usable_size(ptr);
+    c->count++;
+    c->bytes += size;
+    c->outstanding += (int64_t)size;
+    if (c->outstanding > c->peak) {
+        c->peak = c->outstanding;
+    }
+}
+
+static inline void free_count(size_t size) {
+    struct cputrace_alloc_counters* c = &g_alloc_tls;
+    c->freed += size;
+    c->outstanding -= (int64_t)size;
+}
+
+struct cputrace_alloc_counters* cputrace_alloc_thread(void) {
+    return &g_alloc_tls;
+}
+
+extern "C" {
+
+void* malloc(size_t size) {
+    void* ptr = __libc_malloc(size);
+    if (ptr) {
+        alloc_count(ptr);
+    }
+    return ptr;
+}
+
+void* calloc(size_t n, size_t size) {
+    void* ptr = __libc_calloc(n, size);
+    if (ptr) {
+        alloc_count(ptr);
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void* out = __libc_realloc(ptr, size);
+    if (out) {
+        free_count(old);
+        alloc_count(out);
+    } else if (ptr && size == 0) {
+        free_count(old);  // glibc frees on realloc(ptr, 0)
+    }
+    return out;
+}
+
+void free(void* ptr) {
+    if (ptr) {
+        free_count(malloc_usable_size(ptr));
+        __libc_free(ptr);
+    }
+}
+
+// glibc's own aligned allocators do not go through malloc, so blocks from
+// them would be freed here without ever having been counted
+void* memalign(size_t alignment, size_t size) {
+    void* ptr = __libc_memalign(alignment, size);
+    if (ptr) {
+        alloc_count(ptr);
+    }
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = memalign(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+}
@@ -0,0 +1,220 @@
+// Hooks for code compiled with -finstrument-functions. Nothing in here may be
+// instrumented itself, and the hooks must stay cheap for the functions the
+// filter rejects: one flag test and one probe of the address cache.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <regex.h>
+#include <new>
+#include <set>
+#include <string>
+#include "cputrace.h"
+#include "cputrace_symbols.h"
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+#define AUTO_CACHE_SIZE 8192  // function addresses, power of two
+#define AUTO_CACHE_PROBES 32
+#define AUTO_MAX_DEPTH 64
+
+// Decision for one function address. anchor is 0 while the claiming thread
+// is still resolving it, then the anchor index or AUTO_SKIP.
+#define AUTO_SKIP (-1)
+
+struct auto_cache_entry {
+    uintptr_t fn;
+    const char* name;
+    int anchor;
+};
+
+struct auto_cache {
+    struct auto_cache_entry entries[AUTO_CACHE_SIZE];
+};
+
+static bool g_auto_enabled;
+static uint64_t g_auto_flags;
+static struct auto_cache* g_auto_cache;
+
+// Filter, only read while resolving a new address
+static pthread_mutex_t g_auto_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::set<std::string> g_auto_allow;
+static regex_t g_auto_regex;
+static bool g_auto_have_regex;
+
+struct auto_frame {
+    uintptr_t fn;
+    alignas(HW_profile) unsigned char profile[sizeof(HW_profile)];
+};
+
+// Measured functions active on the thread, innermost last
+struct auto_thread {
+    struct auto_frame* frames;
+    int depth;
+    int skipped;  // measured entries beyond AUTO_MAX_DEPTH
+    bool busy;    // inside a hook; calls made from the hooks are ignored
+
+    ~auto_thread() { free(frames); }
+};
+
+static thread_local struct auto_thread t_auto;
+
+NO_INSTRUMENT static bool auto_match(const char* name) {
+    if (g_auto_allow.empty() && !g_auto_have_regex) {
+        return true;
+    }
+    // Allowlist entries may leave out the parameter list
+    if (g_auto_allow.count(name) || g_auto_allow.count(std::string(name, strcspn(name, "(")))) {
+        return true;
+    }
+    return g_auto_have_regex && regexec(&g_auto_regex, name, 0, NULL, 0) == 0;
+}
+
+NO_INSTRUMENT static int auto_resolve(uintptr_t fn, const char** name) {
+    struct cputrace_symbol sym;
+    if (cputrace_symbolize(fn, &sym)) {
+        *name = sym.name;
+    } else {
+        char buf[256];
+        cputrace_symbol_format(fn, buf, sizeof(buf));
+        *name = cputrace_intern(buf);
+    }
+    pthread_mutex_lock(&g_auto_mutex);
+    bool match = auto_match(*name);
+    pthread_mutex_unlock(&g_auto_mutex);
+    if (!match) {
+        return AUTO_SKIP;
+    }
+    int index = cputrace_anchor_register(*name);
+    if (index < 0) {
+        fprintf(stderr, "%s: anchor table full, not measuring %s\n", __func__, *name);
+        return AUTO_SKIP;
+    }
+    return index;
+}
+
+// The first thread to see an address claims its slot and resolves it; until
+// it is done other threads skip the function.
+NO_INSTRUMENT static struct auto_cache_entry* auto_lookup(uintptr_t fn) {
+    struct auto_cache* cache = __atomic_load_n(&g_auto_cache, __ATOMIC_ACQUIRE);
+    if (!cache) {
+        return NULL;
+    }
+    uint32_t h = (uint32_t)((fn * 0x9E3779B97F4A7C15ULL) >> 32);
+    for (int p = 0; p < AUTO_CACHE_PROBES; p++) {
+        struct auto_cache_entry* e = &cache->entries[(h + p) & (AUTO_CACHE_SIZE - 1)];
+        uintptr_t cur = __atomic_load_n(&e->fn, __ATOMIC_ACQUIRE);
+        if (cur == 0 && __atomic_compare_exchange_n(&e->fn, &cur, fn, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            const char* name;
+            int anchor = auto_resolve(fn, &name);
+            e->name = name;
+            __atomic_store_n(&e->anchor, anchor, __ATOMIC_RELEASE);
+            return e;
+        }
+        if (cur == fn) {
+            return e;
+        }
+    }
+    return NULL;  // cache full, the function is not measured
+}
+
+NO_INSTRUMENT static int auto_anchor(const struct auto_cache_entry* e) {
+    return e ? __atomic_load_n(&e->anchor, __ATOMIC_ACQUIRE) : AUTO_SKIP;
+}
+
+extern "C" NO_INSTRUMENT void __cyg_profile_func_enter(void* fn, void* call_site) {
+    (void)call_site;
+    if (!__atomic_load_n(&g_auto_enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    struct auto_thread* t = &t_auto;
+    if (t->busy) {
+        return;
+    }
+    t->busy = true;
+    struct auto_cache_entry* e = auto_lookup((uintptr_t)fn);
+    int index = auto_anchor(e);
+    if (index > 0) {
+        if (!t->frames) {
+            t->frames = (struct auto_frame*)malloc(sizeof(struct auto_frame) * AUTO_MAX_DEPTH);
+        }
+        if (t->depth == AUTO_MAX_DEPTH) {
+            t->skipped++;
+        } else if (t->frames) {
+            struct auto_frame* f = &t->frames[t->depth++];
+            f->fn = (uintptr_t)fn;
+            new (f->profile) HW_profile(e->name, (uint64_t)index,
+                                        __atomic_load_n(&g_auto_flags, __ATOMIC_RELAXED));
+        }
+    }
+    t->busy = false;
+}
+
+extern "C" NO_INSTRUMENT void __cyg_profile_func_exit(void* fn, void* call_site) {
+    (void)call_site;
+    struct auto_thread* t = &t_auto;
+    if ((t->depth == 0 && t->skipped == 0) || t->busy) {
+        return;
+    }
+    t->busy = true;
+    if (t->skipped > 0 && auto_anchor(auto_lookup((uintptr_t)fn)) > 0) {
+        t->skipped--;
+    } else {
+        // Usually the innermost frame. Frames above the match were left by a
+        // longjmp and are recorded as ending here.
+        for (int d = t->depth - 1; d >= 0; d--) {
+            if (t->frames[d].fn != (uintptr_t)fn) {
+                continue;
+            }
+            while (t->depth > d) {
+                struct auto_frame* f = &t->frames[--t->depth];
+                ((HW_profile*)f->profile)->~HW_profile();
+            }
+            break;
+        }
+    }
+    t->busy = false;
+}
+
+void cputrace_auto_allow(const char* name) {
+    pthread_mutex_lock(&g_auto_mutex);
+    g_auto_allow.insert(name);
+    pthread_mutex_unlock(&g_auto_mutex);
+}
+
+int cputrace_auto_enable(const char* regex, uint64_t flags) {
+    struct auto_cache* cache = (struct auto_cache*)calloc(1, sizeof(struct auto_cache));
+    if (!cache) {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        return -1;
+    }
+    pthread_mutex_lock(&g_auto_mutex);
+    if (g_auto_have_regex) {
+        regfree(&g_auto_regex);
+        g_auto_have_regex = false;
+    }
+    if (regex) {
+        int err = regcomp(&g_auto_regex, regex, REG_EXTENDED | REG_NOSUB);
+        if (err != 0) {
+            char msg[128];
+            regerror(err, &g_auto_regex, msg, sizeof(msg));
+            fprintf(stderr, "%s: bad regex '%s': %s\n", __func__, regex, msg);
+            pthread_mutex_unlock(&g_auto_mutex);
+            free(cache);
+            return -1;
+        }
+        g_auto_have_regex = true;
+    }
+    // The previous cache is left in place for threads still probing it
+    __atomic_store_n(&g_auto_flags, flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_auto_cache, cache, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_auto_enabled, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_auto_mutex);
+    return 0;
+}
+
+void cputrace_auto_disable(void) {
+    __atomic_store_n(&g_auto_enabled, false, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,394 @@
+// Runtime control of a live process. A background thread serves a Unix
+// socket; the optional dump signal only writes a byte to a pipe that the
+// same thread watches, so no formatting ever runs in signal context and
+// instrumented threads never wait on a client.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "cputrace.h"
+
+#define CONTROL_LINE_MAX 512
+#define CONTROL_MAX_SECONDS (365L * 24 * 3600)  // longest timed start, one year
+
+static struct {
+    pthread_mutex_t mutex;
+    bool running;
+    pthread_t thread;
+    int listen_fd;
+    int pipe_fd[2];
+    int signal;
+    struct sigaction old_action;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    uint64_t window_end_ns;  // CLOCK_MONOTONIC end of a timed start, 0 for none
+} g_control = { PTHREAD_MUTEX_INITIALIZER, false, 0, -1, { -1, -1 }, 0, {}, "", 0 };
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void control_signal_handler(int sig) {
+    (void)sig;
+    int saved = errno;
+    char c = 'd';
+    ssize_t n = write(g_control.pipe_fd[1], &c, 1);
+    (void)n;  // pipe full: a dump is already pending
+    errno = saved;
+}
+
+// MSG_NOSIGNAL: a client that hangs up early must not SIGPIPE the process
+static void send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void reply(int fd, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply(int fd, const char* fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    if (len >= (int)sizeof(msg)) {
+        len = sizeof(msg) - 1;
+    }
+    send_all(fd, msg, len > 0 ? len : 0);
+}
+
+// dump [format=text|json|csv|binary|folded] [filter=NAME] [metric=KEY] [sort=KEY|calls]
+//      [avg] [top=N] [threads] [thread_names]
+static int parse_dump_args(char* args, struct cputrace_dump_opts* opts, char* err, size_t err_size) {
+    cputrace_dump_opts_init(opts);
+    char* save = NULL;
+    for (char* tok = strtok_r(args, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        char* value = strchr(tok, '=');
+        if (value) {
+            *value++ = '\0';
+        }
+        if (strcmp(tok, "format") == 0 && value) {
+            if (strcmp(value, "text") == 0) {
+                opts->format = CPUTRACE_FORMAT_TEXT;
+            } else if (strcmp(value, "json") == 0) {
+                opts->format = CPUTRACE_FORMAT_JSON;
+            } else if (strcmp(value, "csv") == 0) {
+                opts->format = CPUTRACE_FORMAT_CSV;
+            } else if (strcmp(value, "binary") == 0) {
+                opts->format = CPUTRACE_FORMAT_BINARY;
+            } else if (strcmp(value, "folded") == 0) {
+                opts->format = CPUTRACE_FORMAT_FOLDED;
+            } else {
+                snprintf(err, err_size, "unknown format '%s'", value);
+                return -1;
+            }
+        } else if (strcmp(tok, "filter") == 0 && value) {
+            opts->filter = value;
+        } else if (strcmp(tok, "metric") == 0 && value) {
+            if (cputrace_metric_from_name(value) < 0) {
+                snprintf(err, err_size, "unknown metric '%s'", value);
+                return -1;
+            }
+            opts->metric = value;
+        } else if (strcmp(tok, "sort") == 0 && value) {
+            opts->sort_by = strcmp(value, "calls") == 0 ? CPUTRACE_SORT_CALLS
+                                                        : cputrace_metric_from_name(value);
+            if (opts->sort_by == -1 && strcmp(value, "calls") != 0) {
+                snprintf(err, err_size, "unknown sort key '%s'", value);
+                return -1;
+            }
+        } else if (strcmp(tok, "avg") == 0 && !value) {
+            opts->sort_by_avg = true;
+        } else if (strcmp(tok, "top") == 0 && value) {
+            opts->top_n = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(tok, "threads") == 0 && !value) {
+            opts->flags |= CPUTRACE_DUMP_THREADS;
+        } else if (strcmp(tok, "thread_names") == 0 && !value) {
+            opts->flags |= CPUTRACE_DUMP_THREAD_NAMES;
+        } else {
+            snprintf(err, err_size, "unknown dump argument '%s'", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void handle_command(int fd, char* line) {
+    char* args = line + strcspn(line, " \t");
+    if (*args) {
+        *args++ = '\0';
+    }
+    if (strcmp(line, "start") == 0) {
+        char* end = args;
+        errno = 0;
+        long seconds = *args ? strtol(args, &end, 10) : 0;
+        if (end == args && *args) {
+            seconds = -1;
+        }
+        end += strspn(end, " \t");
+        if (errno || *end || seconds < 0 || seconds > CONTROL_MAX_SECONDS) {
+            reply(fd, "error: bad duration '%s' (whole seconds, at most %ld)\n", args, CONTROL_MAX_SECONDS);
+        } else if (cputrace_set_profiling(true) < 0) {
+            reply(fd, "error: profiling already active\n");
+        } else {
+            g_control.window_end_ns = seconds ? monotonic_ns() + seconds * 1000000000ULL : 0;
+            if (seconds) {
+                reply(fd, "ok: profiling started for %ld s\n", seconds);
+            } else {
+                reply(fd, "ok: profiling started\n");
+            }
+        }
+    } else if (strcmp(line, "stop") == 0) {
+        g_control.window_end_ns = 0;
+        if (cputrace_set_profiling(false) < 0) {
+            reply(fd, "error: profiling not active\n");
+        } else {
+            reply(fd, "ok: profiling stopped\n");
+        }
+    } else if (strcmp(line, "reset") == 0) {
+        cputrace_clear();
+        reply(fd, "ok: counters reset\n");
+    } else if (strcmp(line, "dump") == 0) {
+        struct cputrace_dump_opts opts;
+        char err[128];
+        if (parse_dump_args(args, &opts, err, sizeof(err)) < 0) {
+            reply(fd, "error: %s\n", err);
+        } else {
+            size_t len;
+            char* data = cputrace_dump_buffer(&opts, &len);
+            if (data) {
+                send_all(fd, data, len);
+                free(data);
+            }
+        }
+    } else if (strcmp(line, "capture") == 0) {
+        char* data = NULL;
+        size_t len = 0;
+        FILE* fp = open_memstream(&data, &len);
+        if (!fp) {
+            reply(fd, "error: out of memory\n");
+            return;
+        }
+        int ret = cputrace_trigger_dump(fp);
+        fclose(fp);
+        if (ret < 0) {
+            reply(fd, "error: no capture\n");
+        } else {
+            send_all(fd, data, len);
+        }
+        free(data);
+    } else {
+        reply(fd, "error: unknown command '%s' (start [SECONDS], stop, reset, dump [ARGS], capture)\n", line);
+    }
+}
+
+// One command per connection. A client that sends nothing times out rather
+// than holding up the control thread.
+static void serve_client(int fd) {
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char line[CONTROL_LINE_MAX];
+    size_t len = 0;
+    while (len < sizeof(line) - 1) {
+        ssize_t n = read(fd, line + len, sizeof(line) - 1 - len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len += n;
+        if (memchr(line, '\n', len)) {
+            break;
+        }
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    if (len > 0) {
+        handle_command(fd, line);
+    }
+    close(fd);
+}
+
+static void* control_thread(void* arg) {
+    (void)arg;
+    struct pollfd fds[2];
+    fds[0].fd = g_control.pipe_fd[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = g_control.listen_fd;
+    fds[1].events = POLLIN;
+    nfds_t nfds = g_control.listen_fd != -1 ? 2 : 1;
+    for (;;) {
+        int timeout = -1;
+        if (g_control.window_end_ns) {
+            // Windows beyond INT_MAX ms (24.8 days) take several polls
+            uint64_t now = monotonic_ns();
+            uint64_t ms = now >= g_control.window_end_ns ? 0 : (g_control.window_end_ns - now + 999999) / 1000000;
+            timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+        }
+        int n = poll(fds, nfds, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: poll failed: %s\n", __func__, strerror(errno));
+            break;
+        }
+        if (g_control.window_end_ns && monotonic_ns() >= g_control.window_end_ns) {
+            g_control.window_end_ns = 0;
+            cputrace_set_profiling(false);
+            fprintf(stderr, "cputrace: profiling window ended\n");
+        }
+        if (fds[0].revents & POLLIN) {
+            char cmds[64];
+            ssize_t len = read(g_control.pipe_fd[0], cmds, sizeof(cmds));
+            if (len > 0 && memchr(cmds, 'q', len)) {
+                break;
+            }
+            if (len > 0) {
+                cputrace_dump_fd(STDERR_FILENO, NULL);
+            }
+        }
+        if (nfds == 2 && (fds[1].revents & POLLIN)) {
+            int fd = accept4(g_control.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                serve_client(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int control_listen(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long: %s\n", __func__, path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    // Replace a stale socket from an earlier run, never any other file
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: %s exists and is not a socket\n", __func__, path);
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "%s: socket failed: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1 ||
+        listen(fd, 4) == -1) {
+        fprintf(stderr, "%s: cannot listen on %s: %s\n", __func__, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int cputrace_control_start(const char* socket_path, int dump_signal) {
+    pthread_mutex_lock(&g_control.mutex);
+    if (g_control.running) {
+        fprintf(stderr, "%s: control channel already running\n", __func__);
+        pthread_mutex_unlock(&g_control.mutex);
+        return -1;
+    }
+    if (pipe2(g_control.pipe_fd, O_CLOEXEC | O_NONBLOCK) == -1) {
+        fprintf(stderr, "%s: pipe failed: %s\n", __func__, strerror(errno));
+        pthread_mutex_unlock(&g_control.mutex);
+        return -1;
+    }
+    g_control.listen_fd = socket_path ? control_listen(socket_path) : -1;
+    if (socket_path && g_control.listen_fd == -1) {
+        goto fail_pipe;
+    }
+    snprintf(g_control.path, sizeof(g_control.path), "%s", socket_path ? socket_path : "");
+    g_control.signal = dump_signal;
+    if (dump_signal) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = control_signal_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(dump_signal, &sa, &g_control.old_action) == -1) {
+            fprintf(stderr, "%s: sigaction(%d) failed: %s\n", __func__, dump_signal, strerror(errno));
+            goto fail_socket;
+        }
+    }
+    if (pthread_create(&g_control.thread, NULL, control_thread, NULL) != 0) {
+        fprintf(stderr, "%s: pthread_create failed\n", __func__);
+        if (dump_signal) {
+            sigaction(dump_signal, &g_control.old_action, NULL);
+        }
+        goto fail_socket;
+    }
+    g_control.running = true;
+    pthread_mutex_unlock(&g_control.mutex);
+    return 0;
+
+fail_socket:
+    if (g_control.listen_fd != -1) {
+        close(g_control.listen_fd);
+        g_control.listen_fd = -1;
+        unlink(g_control.path);
+    }
+fail_pipe:
+    close(g_control.pipe_fd[0]);
+    close(g_control.pipe_fd[1]);
+    g_control.pipe_fd[0] = g_control.pipe_fd[1] = -1;
+    pthread_mutex_unlock(&g_control.mutex);
+    return -1;
+}
+
+void cputrace_control_stop(void) {
+    pthread_mutex_lock(&g_control.mutex);
+    if (!g_control.running) {
+        pthread_mutex_unlock(&g_control.mutex);
+        return;
+    }
+    if (g_control.signal) {
+        sigaction(g_control.signal, &g_control.old_action, NULL);
+    }
+    char c = 'q';
+    while (write(g_control.pipe_fd[1], &c, 1) == -1 && errno == EINTR) {
+    }
+    pthread_join(g_control.thread, NULL);
+    if (g_control.listen_fd != -1) {
+        close(g_control.listen_fd);
+        g_control.listen_fd = -1;
+        unlink(g_control.path);
+    }
+    close(g_control.pipe_fd[0]);
+    close(g_control.pipe_fd[1]);
+    g_control.pipe_fd[0] = g_control.pipe_fd[1] = -1;
+    g_control.running = false;
+    pthread_mutex_unlock(&g_control.mutex);
+}
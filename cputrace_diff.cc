@@ -0,0 +1,306 @@
+// cputrace_diff: compare two cputrace CSV dumps (CPUTRACE_FORMAT_CSV) and
+// flag regressions.
+//
+//   cputrace_diff [options] <baseline.csv> <candidate.csv>
+//
+// Anchors are matched by name. For every metric the absolute and relative
+// delta is reported. Averages are tested with Welch's t-test using the
+// per-call standard deviation, percentiles with a two-sample
+// Kolmogorov-Smirnov test on the histograms, when the dumps contain them.
+// The exit status is 1 when a gated metric grew by more than the threshold
+// and the change is significant (or cannot be tested), 2 on usage errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+struct anchor_data {
+    std::map<std::string, double> metrics;
+    std::map<std::string, std::map<double, double>> hists;
+};
+
+typedef std::map<std::string, anchor_data> profile;
+
+static bool split_csv_line(const std::string& line, std::vector<std::string>* fields) {
+    fields->clear();
+    std::string cur;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                cur += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                cur += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields->push_back(cur);
+            cur.clear();
+        } else if (c != '\r') {
+            cur += c;
+        }
+    }
+    fields->push_back(cur);
+    return !quoted;
+}
+
+static bool load_profile(const char* path, profile* out) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cputrace_diff: cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    bool header = true;
+    std::vector<std::string> f;
+    while ((n = getline(&line, &cap, fp)) != -1) {
+        std::string s(line, n);
+        while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) {
+            s.pop_back();
+        }
+        if (s.empty()) {
+            continue;
+        }
+        if (header) {
+            header = false;
+            if (s != "anchor,section,metric,value") {
+                fprintf(stderr, "cputrace_diff: %s is not a cputrace CSV dump\n", path);
+                free(line);
+                fclose(fp);
+                return false;
+            }
+            continue;
+        }
+        if (!split_csv_line(s, &f) || f.size() != 4 || f[0].empty()) {
+            continue;
+        }
+        anchor_data& a = (*out)[f[0]];
+        char* end;
+        double value = strtod(f[3].c_str(), &end);
+        if (*end != '\0') {
+            continue; // string values such as names
+        }
+        if (f[1].empty()) {
+            a.metrics[f[2]] = value;
+        } else if (f[1].compare(0, 5, "hist_") == 0) {
+            a.hists[f[1].substr(5)][strtod(f[2].c_str(), NULL)] = value;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return true;
+}
+
+// Two-sided 5% critical values of Student's t for small degrees of freedom
+static double t_critical(double df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (df < 1) {
+        return INFINITY;
+    }
+    if (df <= 30) {
+        return table[(int)df - 1];
+    }
+    return 1.96;
+}
+
+enum significance { SIG_UNKNOWN, SIG_NO, SIG_YES };
+
+static significance welch_test(const anchor_data& a, const anchor_data& b, const std::string& key) {
+    auto get = [](const anchor_data& d, const std::string& k, double* v) {
+        auto it = d.metrics.find(k);
+        if (it == d.metrics.end()) {
+            return false;
+        }
+        *v = it->second;
+        return true;
+    };
+    double na, nb, ma, mb, sa, sb;
+    if (!get(a, "call_count", &na) || !get(b, "call_count", &nb) ||
+        !get(a, "avg_" + key, &ma) || !get(b, "avg_" + key, &mb) ||
+        !get(a, "stddev_" + key, &sa) || !get(b, "stddev_" + key, &sb) || na < 2 || nb < 2) {
+        return SIG_UNKNOWN;
+    }
+    double va = sa * sa / na, vb = sb * sb / nb;
+    if (va + vb == 0.0) {
+        return ma == mb ? SIG_NO : SIG_YES;
+    }
+    double t = fabs(ma - mb) / sqrt(va + vb);
+    double df = (va + vb) * (va + vb) /
+                ((va * va) / (na - 1) + (vb * vb) / (nb - 1));
+    return t > t_critical(floor(df)) ? SIG_YES : SIG_NO;
+}
+
+static significance ks_test(const anchor_data& a, const anchor_data& b, const std::string& key) {
+    auto ia = a.hists.find(key), ib = b.hists.find(key);
+    if (ia == a.hists.end() || ib == b.hists.end()) {
+        return SIG_UNKNOWN;
+    }
+    double na = 0, nb = 0;
+    std::set<double> bounds;
+    for (auto& kv : ia->second) {
+        na += kv.second;
+        bounds.insert(kv.first);
+    }
+    for (auto& kv : ib->second) {
+        nb += kv.second;
+        bounds.insert(kv.first);
+    }
+    if (na == 0 || nb == 0) {
+        return SIG_UNKNOWN;
+    }
+    double ca = 0, cb = 0, d = 0;
+    for (double bound : bounds) {
+        auto pa = ia->second.find(bound), pb = ib->second.find(bound);
+        ca += pa == ia->second.end() ? 0 : pa->second;
+        cb += pb == ib->second.end() ? 0 : pb->second;
+        d = fmax(d, fabs(ca / na - cb / nb));
+    }
+    return d > 1.36 * sqrt((na + nb) / (na * nb)) ? SIG_YES : SIG_NO;
+}
+
+// Strips the avg_/stddev_/pNN_ prefix to get the counter key
+static std::string metric_key(const std::string& metric, std::string* prefix) {
+    static const char* prefixes[] = { "avg_", "stddev_", "p50_", "p90_", "p99_" };
+    for (const char* p : prefixes) {
+        size_t len = strlen(p);
+        if (metric.compare(0, len, p) == 0) {
+            *prefix = p;
+            return metric.substr(len);
+        }
+    }
+    prefix->clear();
+    return metric;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: cputrace_diff [options] <baseline.csv> <candidate.csv>\n"
+            "  -t, --threshold PCT   relative increase treated as a regression (default 5)\n"
+            "  -m, --metric NAME     gate on this metric only, may be repeated\n"
+            "                        (default: every avg_* and p*_ metric)\n"
+            "  -a, --anchor NAME     compare only this anchor, may be repeated\n"
+            "  -s, --no-significance gate on the threshold alone\n"
+            "  -q, --quiet           print regressions only\n");
+}
+
+int main(int argc, char** argv) {
+    double threshold = 5.0;
+    bool require_significance = true;
+    bool quiet = false;
+    std::set<std::string> gated, only_anchors;
+
+    static const struct option long_opts[] = {
+        { "threshold", required_argument, NULL, 't' },
+        { "metric", required_argument, NULL, 'm' },
+        { "anchor", required_argument, NULL, 'a' },
+        { "no-significance", no_argument, NULL, 's' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "t:m:a:sqh", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 't': threshold = atof(optarg); break;
+        case 'm': gated.insert(optarg); break;
+        case 'a': only_anchors.insert(optarg); break;
+        case 's': require_significance = false; break;
+        case 'q': quiet = true; break;
+        default: usage(); return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 2;
+    }
+
+    profile base, cand;
+    if (!load_profile(argv[optind], &base) || !load_profile(argv[optind + 1], &cand)) {
+        return 2;
+    }
+
+    int regressions = 0;
+    for (auto& ba : base) {
+        const std::string& name = ba.first;
+        if (!only_anchors.empty() && !only_anchors.count(name)) {
+            continue;
+        }
+        auto ca = cand.find(name);
+        if (ca == cand.end()) {
+            if (!quiet) {
+                printf("\n%s: only in baseline\n", name.c_str());
+            }
+            continue;
+        }
+        bool header = false;
+        for (auto& bm : ba.second.metrics) {
+            const std::string& metric = bm.first;
+            auto cm = ca->second.metrics.find(metric);
+            if (cm == ca->second.metrics.end()) {
+                continue;
+            }
+            std::string prefix;
+            std::string key = metric_key(metric, &prefix);
+            if (prefix == "stddev_") {
+                continue;
+            }
+            double before = bm.second, after = cm->second;
+            double delta = after - before;
+            double rel = before != 0.0 ? 100.0 * delta / before : (after != 0.0 ? INFINITY : 0.0);
+
+            significance sig = SIG_UNKNOWN;
+            if (prefix == "avg_") {
+                sig = welch_test(ba.second, ca->second, key);
+            } else if (!prefix.empty()) {
+                sig = ks_test(ba.second, ca->second, key);
+            }
+
+            bool is_gated = gated.empty() ? !prefix.empty() : gated.count(metric) > 0;
+            bool regressed = is_gated && rel > threshold &&
+                             (!require_significance || sig != SIG_NO);
+            if (regressed) {
+                regressions++;
+            }
+            if (quiet && !regressed) {
+                continue;
+            }
+            if (!header) {
+                printf("\n%s:\n", name.c_str());
+                printf("  %-28s %16s %16s %16s %9s  %s\n", "metric", "baseline", "candidate",
+                       "delta", "delta%", "significant");
+                header = true;
+            }
+            printf("  %-28s %16.1f %16.1f %+16.1f %+8.1f%%  %-11s%s\n", metric.c_str(), before, after,
+                   delta, rel, sig == SIG_YES ? "yes" : sig == SIG_NO ? "no" : "-",
+                   regressed ? "  REGRESSION" : "");
+        }
+    }
+    if (!quiet) {
+        for (auto& ca : cand) {
+            if (!base.count(ca.first) && (only_anchors.empty() || only_anchors.count(ca.first))) {
+                printf("\n%s: only in candidate\n", ca.first.c_str());
+            }
+        }
+    }
+
+    printf("\n%d regression%s beyond %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+    return regressions > 0 ? 1 : 0;
+}
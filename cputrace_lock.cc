@@ -0,0 +1,136 @@
+// Lock wait interposer for the per-anchor contention accounting (see
+// cputrace_lock_enable). Link this object into the program; its definitions
+// take precedence over libc's and forward to them through dlsym(RTLD_NEXT).
+// An acquire first tries the lock, so the uncontended path costs one trylock
+// and a flag test; only an acquire that has to wait is timed and reported.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cputrace.h"
+
+static int (*real_mutex_lock)(pthread_mutex_t*);
+static int (*real_mutex_trylock)(pthread_mutex_t*);
+static int (*real_rwlock_rdlock)(pthread_rwlock_t*);
+static int (*real_rwlock_tryrdlock)(pthread_rwlock_t*);
+static int (*real_rwlock_wrlock)(pthread_rwlock_t*);
+static int (*real_rwlock_trywrlock)(pthread_rwlock_t*);
+static int (*real_cond_wait)(pthread_cond_t*, pthread_mutex_t*);
+static int (*real_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+
+// Set by cputrace_lock_enable; until then every hook just forwards
+static bool g_lock_hooks_on;
+
+// The condition variable calls carry two symbol versions in glibc, and a
+// plain dlsym() may bind the old compat one; ask for the current one first.
+// Ports that only ever had one version fall back to dlsym().
+template <typename F>
+static void resolve(F* fn, const char* name, const char* version = NULL) {
+    void* sym = version ? dlvsym(RTLD_NEXT, name, version) : NULL;
+    if (!sym) {
+        sym = dlsym(RTLD_NEXT, name);
+    }
+    if (!sym) {
+        fprintf(stderr, "cputrace_lock: cannot resolve %s: %s\n", name, dlerror());
+        abort();
+    }
+    __atomic_store_n(fn, (F)sym, __ATOMIC_RELEASE);
+}
+
+// Also run on first use, in case a constructor locks before ours has run
+__attribute__((constructor)) static void cputrace_lock_init(void) {
+    if (__atomic_load_n(&real_cond_timedwait, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    resolve(&real_mutex_lock, "pthread_mutex_lock");
+    resolve(&real_mutex_trylock, "pthread_mutex_trylock");
+    resolve(&real_rwlock_rdlock, "pthread_rwlock_rdlock");
+    resolve(&real_rwlock_tryrdlock, "pthread_rwlock_tryrdlock");
+    resolve(&real_rwlock_wrlock, "pthread_rwlock_wrlock");
+    resolve(&real_rwlock_trywrlock, "pthread_rwlock_trywrlock");
+    resolve(&real_cond_wait, "pthread_cond_wait", "GLIBC_2.3.2");
+    resolve(&real_cond_timedwait, "pthread_cond_timedwait", "GLIBC_2.3.2");
+}
+
+void cputrace_lock_hooks(bool on) {
+    cputrace_lock_init();
+    __atomic_store_n(&g_lock_hooks_on, on, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t lock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Tries the lock first; on EBUSY waits for it and reports the wait
+template <typename L>
+static inline int lock_timed(L* lock, int (*trylock)(L*), int (*blocking)(L*)) {
+    if (!__atomic_load_n(&g_lock_hooks_on, __ATOMIC_RELAXED)) {
+        return blocking(lock);
+    }
+    int r = trylock(lock);
+    if (r != EBUSY) {
+        return r;
+    }
+    uint64_t start = lock_now_ns();
+    r = blocking(lock);
+    cputrace_lock_wait(lock, lock_now_ns() - start, false);
+    return r;
+}
+
+extern "C" {
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    if (__builtin_expect(!real_mutex_lock, 0)) {
+        cputrace_lock_init();
+    }
+    return lock_timed(mutex, real_mutex_trylock, real_mutex_lock);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t* lock) {
+    if (__builtin_expect(!real_rwlock_rdlock, 0)) {
+        cputrace_lock_init();
+    }
+    return lock_timed(lock, real_rwlock_tryrdlock, real_rwlock_rdlock);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t* lock) {
+    if (__builtin_expect(!real_rwlock_wrlock, 0)) {
+        cputrace_lock_init();
+    }
+    return lock_timed(lock, real_rwlock_trywrlock, real_rwlock_wrlock);
+}
+
+// Condition waits are reported whole, as time spent waiting for an event
+// rather than for a lock
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    if (__builtin_expect(!real_cond_wait, 0)) {
+        cputrace_lock_init();
+    }
+    if (!__atomic_load_n(&g_lock_hooks_on, __ATOMIC_RELAXED)) {
+        return real_cond_wait(cond, mutex);
+    }
+    uint64_t start = lock_now_ns();
+    int r = real_cond_wait(cond, mutex);
+    cputrace_lock_wait(cond, lock_now_ns() - start, true);
+    return r;
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime) {
+    if (__builtin_expect(!real_cond_timedwait, 0)) {
+        cputrace_lock_init();
+    }
+    if (!__atomic_load_n(&g_lock_hooks_on, __ATOMIC_RELAXED)) {
+        return real_cond_timedwait(cond, mutex, abstime);
+    }
+    uint64_t start = lock_now_ns();
+    int r = real_cond_timedwait(cond, mutex, abstime);
+    cputrace_lock_wait(cond, lock_now_ns() - start, true);
+    return r;
+}
+
+}
@@ -0,0 +1,428 @@
+// cputrace_merge: combine binary snapshots (CPUTRACE_FORMAT_BINARY) from
+// many processes and hosts into one fleet-level report.
+//
+//   cputrace_merge [options] <snapshot>...
+//
+// Files are mapped read-only and merged in place. Anchors are matched by
+// name and metrics by key; histograms are added bucket by bucket, so the
+// fleet percentiles are those of all calls together. A metric a process
+// could not count (the header's supported mask) is left out of its sums,
+// and averages divide by the calls of the processes that counted it. For
+// every anchor the processes of each host are summed and hosts whose per-call average of the
+// chosen metric is far from the fleet median are flagged. The exit status
+// is 1 when an outlier was found, 2 on usage or format errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "cputrace_snapshot.h"
+
+struct snap_file {
+    const char* path;
+    const char* map;
+    size_t size;
+    const struct cputrace_snap_header* h;
+    const char (*keys)[CPUTRACE_SNAP_KEY_LEN];
+    const uint64_t* bucket_lower;
+    const struct cputrace_snap_thread* threads;
+    std::vector<int> metric;        // file metric -> merged metric
+    std::vector<const struct cputrace_snap_anchor*> anchors;
+    bool hist_ok;                   // same buckets as the first file
+};
+
+struct totals {
+    uint64_t calls = 0;
+    std::vector<uint64_t> counted;  // calls per metric, of processes that count it
+    std::vector<uint64_t> sum;
+
+    void resize(size_t n) {
+        counted.resize(n);
+        sum.resize(n);
+    }
+    void add(const struct snap_file* f, uint64_t call_count, const uint64_t* sums) {
+        calls += call_count;
+        for (uint32_t i = 0; i < f->h->metric_count; i++) {
+            if (f->h->supported & (1ULL << i)) {
+                counted[f->metric[i]] += call_count;
+                sum[f->metric[i]] += sums[i];
+            }
+        }
+    }
+};
+
+struct merged_anchor {
+    uint64_t calls = 0;
+    uint32_t snapshots = 0;
+    std::vector<uint64_t> counted;
+    std::vector<uint64_t> sum;
+    std::vector<double> sumsq;
+    std::vector<std::vector<uint64_t>> hist;
+    std::map<std::string, totals> hosts;
+    std::map<std::string, uint32_t> host_snapshots;
+    std::map<std::string, totals> thread_names;
+    std::map<std::string, uint32_t> thread_counts;
+};
+
+static std::vector<std::string> g_keys;
+static std::map<std::string, int> g_key_index;
+static std::vector<uint64_t> g_bucket_lower;
+
+static int key_index(const std::string& key) {
+    auto it = g_key_index.find(key);
+    if (it != g_key_index.end()) {
+        return it->second;
+    }
+    g_keys.push_back(key);
+    g_key_index[key] = (int)g_keys.size() - 1;
+    return (int)g_keys.size() - 1;
+}
+
+static bool fail(const char* path, const char* what) {
+    fprintf(stderr, "cputrace_merge: %s: %s\n", path, what);
+    return false;
+}
+
+// Maps the file and checks every offset before anything is read through it
+static bool snap_open(const char* path, struct snap_file* f) {
+    f->path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "cputrace_merge: cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct cputrace_snap_header)) {
+        close(fd);
+        return fail(path, "too small for a snapshot");
+    }
+    f->size = st.st_size;
+    void* map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "cputrace_merge: mmap %s failed: %s\n", path, strerror(errno));
+        return false;
+    }
+    f->map = (const char*)map;
+    f->h = (const struct cputrace_snap_header*)map;
+    const struct cputrace_snap_header* h = f->h;
+    if (h->magic != CPUTRACE_SNAP_MAGIC) {
+        return fail(path, "not a cputrace snapshot");
+    }
+    if (h->version != CPUTRACE_SNAP_VERSION || h->header_size != sizeof(*h)) {
+        fprintf(stderr, "cputrace_merge: %s: unknown layout (version %u, expected %d)\n",
+                path, h->version, CPUTRACE_SNAP_VERSION);
+        return false;
+    }
+    if (h->total_size > f->size) {
+        return fail(path, "truncated");
+    }
+    if (h->total_size < h->header_size) {
+        return fail(path, "corrupt header");
+    }
+    size_t off = h->header_size;
+    size_t end = h->total_size;
+    size_t tables = (size_t)h->metric_count * CPUTRACE_SNAP_KEY_LEN + (size_t)h->hist_buckets * sizeof(uint64_t) +
+                    (size_t)h->thread_count * sizeof(struct cputrace_snap_thread);
+    if (h->metric_count > 64 || tables > end - off) {
+        return fail(path, "corrupt tables");
+    }
+    f->keys = (const char (*)[CPUTRACE_SNAP_KEY_LEN])(f->map + off);
+    off += (size_t)h->metric_count * CPUTRACE_SNAP_KEY_LEN;
+    f->bucket_lower = (const uint64_t*)(f->map + off);
+    off += (size_t)h->hist_buckets * sizeof(uint64_t);
+    f->threads = (const struct cputrace_snap_thread*)(f->map + off);
+    off += (size_t)h->thread_count * sizeof(struct cputrace_snap_thread);
+
+    for (uint32_t i = 0; i < h->metric_count; i++) {
+        f->metric.push_back(key_index(std::string(f->keys[i], strnlen(f->keys[i], CPUTRACE_SNAP_KEY_LEN))));
+    }
+    if (g_bucket_lower.empty()) {
+        g_bucket_lower.assign(f->bucket_lower, f->bucket_lower + h->hist_buckets);
+    }
+    f->hist_ok = g_bucket_lower.size() == h->hist_buckets &&
+                 std::equal(g_bucket_lower.begin(), g_bucket_lower.end(), f->bucket_lower);
+    if (!f->hist_ok) {
+        fprintf(stderr, "cputrace_merge: %s: different histogram buckets, percentiles leave it out\n", path);
+    }
+
+    size_t sums = (size_t)h->metric_count * (sizeof(uint64_t) + sizeof(double));
+    for (uint32_t a = 0; a < h->anchor_count; a++) {
+        if (end - off < sizeof(struct cputrace_snap_anchor)) {
+            return fail(path, "truncated anchor");
+        }
+        const struct cputrace_snap_anchor* anchor = (const struct cputrace_snap_anchor*)(f->map + off);
+        size_t need = sizeof(*anchor) + sums + (size_t)anchor->hist_entries * sizeof(struct cputrace_snap_bucket) +
+                      (size_t)anchor->thread_entries *
+                          (sizeof(struct cputrace_snap_thread_stats) + h->metric_count * sizeof(uint64_t));
+        if (anchor->record_size != need || need > end - off) {
+            return fail(path, "corrupt anchor record");
+        }
+        f->anchors.push_back(anchor);
+        off += need;
+    }
+    return true;
+}
+
+static void snap_merge(const struct snap_file* f, const char* filter, std::map<std::string, merged_anchor>* out) {
+    const struct cputrace_snap_header* h = f->h;
+    std::string host(h->host, strnlen(h->host, sizeof(h->host)));
+    if (host.empty()) {
+        host = "(unknown)";
+    }
+    size_t nmetrics = g_keys.size();
+    for (const struct cputrace_snap_anchor* a : f->anchors) {
+        std::string name(a->name, strnlen(a->name, sizeof(a->name)));
+        if (filter && name.find(filter) == std::string::npos) {
+            continue;
+        }
+        merged_anchor& m = (*out)[name];
+        m.counted.resize(nmetrics);
+        m.sum.resize(nmetrics);
+        m.sumsq.resize(nmetrics);
+        m.hist.resize(nmetrics);
+        m.calls += a->call_count;
+        m.snapshots++;
+
+        const uint64_t* sum = (const uint64_t*)(a + 1);
+        const double* sumsq = (const double*)(sum + h->metric_count);
+        const struct cputrace_snap_bucket* hist = (const struct cputrace_snap_bucket*)(sumsq + h->metric_count);
+        totals& ht = m.hosts[host];
+        ht.resize(nmetrics);
+        ht.add(f, a->call_count, sum);
+        m.host_snapshots[host]++;
+        for (uint32_t i = 0; i < h->metric_count; i++) {
+            if (h->supported & (1ULL << i)) {
+                m.counted[f->metric[i]] += a->call_count;
+                m.sum[f->metric[i]] += sum[i];
+                m.sumsq[f->metric[i]] += sumsq[i];
+            }
+        }
+        for (uint32_t k = 0; f->hist_ok && k < a->hist_entries; k++) {
+            if (hist[k].metric >= h->metric_count || hist[k].bucket >= h->hist_buckets ||
+                !(h->supported & (1ULL << hist[k].metric))) {
+                continue;
+            }
+            std::vector<uint64_t>& buckets = m.hist[f->metric[hist[k].metric]];
+            buckets.resize(g_bucket_lower.size());
+            buckets[hist[k].bucket] += hist[k].count;
+        }
+
+        const char* p = (const char*)(hist + a->hist_entries);
+        for (uint32_t t = 0; t < a->thread_entries; t++) {
+            const struct cputrace_snap_thread_stats* ts = (const struct cputrace_snap_thread_stats*)p;
+            const uint64_t* tsum = (const uint64_t*)(ts + 1);
+            p = (const char*)(tsum + h->metric_count);
+            std::string tname = ts->thread < h->thread_count
+                ? std::string(f->threads[ts->thread].name, strnlen(f->threads[ts->thread].name, 16))
+                : std::string("(unknown)");
+            totals& tt = m.thread_names[tname];
+            tt.resize(nmetrics);
+            tt.add(f, ts->call_count, tsum);
+            m.thread_counts[tname]++;
+        }
+    }
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& hist, double p) {
+    uint64_t total = 0;
+    for (uint64_t n : hist) {
+        total += n;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)ceil(p * (double)total));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < hist.size(); b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            uint64_t lower = g_bucket_lower[b];
+            return b + 1 < hist.size() ? lower + (g_bucket_lower[b + 1] - lower) / 2 : lower;
+        }
+    }
+    return 0;
+}
+
+static std::string commas(double v, int decimals) {
+    char raw[64];
+    snprintf(raw, sizeof(raw), "%.*f", decimals, v);
+    std::string s = raw;
+    size_t dot = s.find('.');
+    int digits = (int)(dot == std::string::npos ? s.size() : dot);
+    int first = s[0] == '-' ? 1 : 0;
+    for (int i = digits - 3; i > first; i -= 3) {
+        s.insert(i, ",");
+    }
+    return s;
+}
+
+static double avg(const totals& t, int metric) {
+    return t.counted[metric] ? (double)t.sum[metric] / t.counted[metric] : 0.0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: cputrace_merge [options] <snapshot>...\n"
+            "  -m, --metric KEY      metric for host averages and outliers\n"
+            "                        (default: cycles when counted, else wall_time_ns)\n"
+            "  -a, --anchor NAME     only anchors whose name contains NAME\n"
+            "  -r, --ratio X         flag hosts X times above or below the fleet median (default 1.5)\n"
+            "  -T, --threads         add a breakdown by thread name\n");
+}
+
+int main(int argc, char** argv) {
+    const char* metric_key = NULL;
+    const char* filter = NULL;
+    double ratio = 1.5;
+    bool by_thread = false;
+
+    static const struct option long_opts[] = {
+        { "metric", required_argument, NULL, 'm' },
+        { "anchor", required_argument, NULL, 'a' },
+        { "ratio", required_argument, NULL, 'r' },
+        { "threads", no_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "m:a:r:Th", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'm': metric_key = optarg; break;
+        case 'a': filter = optarg; break;
+        case 'r': ratio = atof(optarg); break;
+        case 'T': by_thread = true; break;
+        default: usage(); return 2;
+        }
+    }
+    if (argc - optind < 1 || ratio <= 1.0) {
+        usage();
+        return 2;
+    }
+
+    std::vector<struct snap_file> files(argc - optind);
+    for (int i = optind; i < argc; i++) {
+        if (!snap_open(argv[i], &files[i - optind])) {
+            return 2;
+        }
+    }
+    std::map<std::string, merged_anchor> anchors;
+    for (const struct snap_file& f : files) {
+        snap_merge(&f, filter, &anchors);
+    }
+    size_t nmetrics = g_keys.size();
+
+    int outliers = 0;
+    std::set<std::string> all_hosts;
+    for (const struct snap_file& f : files) {
+        all_hosts.insert(std::string(f.h->host, strnlen(f.h->host, sizeof(f.h->host))));
+    }
+    printf("cputrace_merge: %zu snapshots from %zu hosts, %zu anchors\n", files.size(), all_hosts.size(),
+           anchors.size());
+
+    for (auto& entry : anchors) {
+        merged_anchor& m = entry.second;
+        m.counted.resize(nmetrics);
+        m.sum.resize(nmetrics);
+        m.sumsq.resize(nmetrics);
+        m.hist.resize(nmetrics);
+        for (auto& host : m.hosts) {
+            host.second.resize(nmetrics);
+        }
+        for (auto& thread : m.thread_names) {
+            thread.second.resize(nmetrics);
+        }
+        printf("\n%s: %s calls in %u snapshots from %zu hosts\n", entry.first.c_str(),
+               commas((double)m.calls, 0).c_str(), m.snapshots, m.hosts.size());
+        printf("  %-22s %18s %16s %14s %12s %12s %12s\n", "metric", "total", "avg", "stddev", "p50", "p90", "p99");
+        for (size_t i = 0; i < nmetrics; i++) {
+            uint64_t calls = m.counted[i];
+            if (m.sum[i] == 0) {
+                continue;
+            }
+            double mean = (double)m.sum[i] / calls;
+            double var = calls > 1 ? (m.sumsq[i] - calls * mean * mean) / (calls - 1) : 0.0;
+            m.hist[i].resize(g_bucket_lower.size());
+            printf("  %-22s %18s %16s %14s %12s %12s %12s\n", g_keys[i].c_str(), commas((double)m.sum[i], 0).c_str(),
+                   commas(mean, 1).c_str(), commas(sqrt(std::max(var, 0.0)), 1).c_str(),
+                   commas((double)percentile(m.hist[i], 0.50), 0).c_str(),
+                   commas((double)percentile(m.hist[i], 0.90), 0).c_str(),
+                   commas((double)percentile(m.hist[i], 0.99), 0).c_str());
+        }
+
+        int metric = -1;
+        if (metric_key) {
+            auto it = g_key_index.find(metric_key);
+            metric = it != g_key_index.end() ? it->second : -1;
+        } else {
+            auto it = g_key_index.find("cycles");
+            metric = it != g_key_index.end() && m.counted[it->second] > 0 && m.sum[it->second] > 0 ? it->second : -1;
+            if (metric < 0 && g_key_index.count("wall_time_ns")) {
+                metric = g_key_index["wall_time_ns"];
+            }
+        }
+        if (metric < 0) {
+            fprintf(stderr, "cputrace_merge: no metric '%s' in the snapshots\n", metric_key ? metric_key : "wall_time_ns");
+            return 2;
+        }
+        // Hosts that could not count the metric take no part in the median
+        std::vector<double> host_avgs;
+        for (const auto& host : m.hosts) {
+            if (host.second.counted[metric]) {
+                host_avgs.push_back(avg(host.second, metric));
+            }
+        }
+        std::sort(host_avgs.begin(), host_avgs.end());
+        size_t n = host_avgs.size();
+        double median = n == 0 ? 0.0 : n % 2 ? host_avgs[n / 2] : (host_avgs[n / 2 - 1] + host_avgs[n / 2]) / 2;
+        printf("\n  hosts by avg %s (fleet median %s):\n", g_keys[metric].c_str(), commas(median, 1).c_str());
+        std::vector<std::pair<double, std::string>> order;
+        for (const auto& host : m.hosts) {
+            order.push_back(std::make_pair(avg(host.second, metric), host.first));
+        }
+        std::sort(order.rbegin(), order.rend());
+        for (const auto& o : order) {
+            const totals& t = m.hosts[o.second];
+            if (!t.counted[metric]) {
+                printf("    %-24s %4u snapshots %14s calls   %s not counted\n", o.second.c_str(),
+                       m.host_snapshots[o.second], commas((double)t.calls, 0).c_str(), g_keys[metric].c_str());
+                continue;
+            }
+            double rel = median > 0 ? o.first / median : 0.0;
+            const char* flag = "";
+            if (n > 2 && median > 0 && rel > ratio) {
+                flag = "  SLOW";
+            } else if (n > 2 && median > 0 && rel < 1.0 / ratio) {
+                flag = "  FAST";
+            }
+            outliers += *flag != '\0';
+            printf("    %-24s %4u snapshots %14s calls   avg %14s  %5.2fx%s\n", o.second.c_str(),
+                   m.host_snapshots[o.second], commas((double)t.calls, 0).c_str(), commas(o.first, 1).c_str(), rel,
+                   flag);
+        }
+
+        if (by_thread && !m.thread_names.empty()) {
+            printf("\n  thread names by avg %s:\n", g_keys[metric].c_str());
+            for (const auto& thread : m.thread_names) {
+                printf("    %-16s %6u thread records %14s calls   avg %14s\n", thread.first.c_str(),
+                       m.thread_counts[thread.first], commas((double)thread.second.calls, 0).c_str(),
+                       commas(avg(thread.second, metric), 1).c_str());
+            }
+        }
+    }
+    for (const struct snap_file& f : files) {
+        munmap((void*)f.map, f.size);
+    }
+    return outliers > 0 ? 1 : 0;
+}
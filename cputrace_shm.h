@@ -0,0 +1,43 @@
+#ifndef CPUTRACE_SHM_H
+#define CPUTRACE_SHM_H
+
+// Layout of the shared-memory anchor table published by
+// cputrace_shm_enable() and read by cputrace_top. Readers must check magic,
+// version and the recorded sizes before trusting anything else. Any change
+// to the layout bumps CPUTRACE_SHM_VERSION.
+
+#include <stdint.h>
+
+#define CPUTRACE_SHM_MAGIC 0x4d48534543525443ULL  // "CTRCESHM"
+#define CPUTRACE_SHM_VERSION 2
+#define CPUTRACE_SHM_METRICS 32
+#define CPUTRACE_SHM_NAME_LEN 96
+
+// One anchor, written by the process under the anchor mutex. seq is odd
+// while an update is in progress; a reader copies the entry and retries if
+// seq was odd or changed meanwhile.
+struct cputrace_shm_anchor {
+    uint64_t seq;
+    char name[CPUTRACE_SHM_NAME_LEN];
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_SHM_METRICS];
+};
+
+struct cputrace_shm_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t anchor_size;
+    uint32_t anchor_count;
+    uint32_t metric_count;
+    int32_t pid;
+    uint64_t supported;    // bit per metric the process can count
+    char metric_key[CPUTRACE_SHM_METRICS][32];   // dump keys, e.g. "cycles"
+};
+
+// The anchors follow the header at offset header_size
+static inline struct cputrace_shm_anchor* cputrace_shm_anchors(struct cputrace_shm_header* h) {
+    return (struct cputrace_shm_anchor*)((char*)h + h->header_size);
+}
+
+#endif // CPUTRACE_SHM_H
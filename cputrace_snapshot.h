@@ -0,0 +1,74 @@
+#ifndef CPUTRACE_SNAPSHOT_H
+#define CPUTRACE_SNAPSHOT_H
+
+// Binary snapshot written by cputrace_dump with CPUTRACE_FORMAT_BINARY and
+// read by cputrace_merge. The file describes itself: metric keys and
+// histogram bucket bounds are stored in it, so snapshots from builds with
+// different metric sets still merge by key. Host byte order; every record
+// is a multiple of 8 bytes so all fields can be read in place from a
+// mapping. Any change to the layout bumps CPUTRACE_SNAP_VERSION.
+//
+//   header
+//   char     metric_key[metric_count][CPUTRACE_SNAP_KEY_LEN]
+//   uint64_t bucket_lower[hist_buckets]
+//   struct cputrace_snap_thread threads[thread_count]
+//   anchor_count times:
+//     struct cputrace_snap_anchor
+//     uint64_t sum[metric_count]
+//     double   sumsq[metric_count]
+//     struct cputrace_snap_bucket hist[hist_entries]     (non-empty buckets)
+//     thread_entries times:
+//       struct cputrace_snap_thread_stats
+//       uint64_t sum[metric_count]
+
+#include <stdint.h>
+
+#define CPUTRACE_SNAP_MAGIC 0x50414e5345435254ULL  // "TRCESNAP"
+#define CPUTRACE_SNAP_VERSION 1
+#define CPUTRACE_SNAP_KEY_LEN 32
+#define CPUTRACE_SNAP_NAME_LEN 96
+#define CPUTRACE_SNAP_HOST_LEN 64
+
+struct cputrace_snap_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t metric_count;
+    uint32_t hist_buckets;
+    uint32_t anchor_count;
+    uint32_t thread_count;
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t timestamp_ns;  // CLOCK_REALTIME when written
+    uint64_t supported;     // bit per metric the process could count
+    uint64_t total_size;    // bytes in the snapshot, header included
+    char host[CPUTRACE_SNAP_HOST_LEN];
+};
+
+struct cputrace_snap_thread {
+    int32_t tid;
+    char name[16];
+    uint32_t reserved;
+};
+
+struct cputrace_snap_anchor {
+    char name[CPUTRACE_SNAP_NAME_LEN];
+    uint64_t call_count;
+    uint64_t record_size;   // bytes from this struct to the next anchor
+    uint32_t hist_entries;
+    uint32_t thread_entries;
+};
+
+struct cputrace_snap_bucket {
+    uint32_t metric;
+    uint32_t bucket;
+    uint64_t count;
+};
+
+struct cputrace_snap_thread_stats {
+    uint32_t thread;        // index into the thread table
+    uint32_t reserved;
+    uint64_t call_count;
+};
+
+#endif // CPUTRACE_SNAPSHOT_H
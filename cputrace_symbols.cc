@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cxxabi.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "cputrace_symbols.h"
+
+struct sym_func {
+    uint64_t start;
+    uint64_t size;
+    const char* name;    // points into the mapped string table
+};
+
+struct sym_module {
+    std::string path;
+    bool loaded;
+    const void* image;   // file mapping, kept for the symbol names
+    size_t image_size;
+    std::vector<struct sym_func> funcs;  // sorted by file virtual address
+};
+
+struct sym_range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t bias;       // runtime address - file virtual address
+    struct sym_module* module;
+};
+
+static pthread_mutex_t g_sym_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, struct sym_module*> g_modules;
+static std::vector<struct sym_range> g_ranges;  // sorted by start
+static std::map<const char*, std::string> g_demangled;
+
+static void load_symtab(struct sym_module* mod, const unsigned char* base, size_t size,
+                        const Elf64_Shdr* shdrs, int index) {
+    const Elf64_Shdr* sh = &shdrs[index];
+    const Elf64_Shdr* strsh = &shdrs[sh->sh_link];
+    if (sh->sh_offset + sh->sh_size > size || strsh->sh_offset + strsh->sh_size > size ||
+        sh->sh_entsize != sizeof(Elf64_Sym)) {
+        return;
+    }
+    const Elf64_Sym* syms = (const Elf64_Sym*)(base + sh->sh_offset);
+    const char* strtab = (const char*)(base + strsh->sh_offset);
+    size_t count = sh->sh_size / sizeof(Elf64_Sym);
+    for (size_t i = 0; i < count; i++) {
+        int type = ELF64_ST_TYPE(syms[i].st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) || syms[i].st_value == 0 ||
+            syms[i].st_name >= strsh->sh_size) {
+            continue;
+        }
+        mod->funcs.push_back({ syms[i].st_value, syms[i].st_size, strtab + syms[i].st_name });
+    }
+}
+
+static void load_module(struct sym_module* mod) {
+    mod->loaded = true;
+    int fd = open(mod->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return;
+    }
+    void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return;
+    }
+    const unsigned char* base = (const unsigned char*)image;
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)base;
+    size_t size = st.st_size;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_shentsize != sizeof(Elf64_Shdr) || eh->e_shoff + eh->e_shnum * sizeof(Elf64_Shdr) > size) {
+        munmap(image, size);
+        return;
+    }
+    mod->image = image;
+    mod->image_size = size;
+    const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(base + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if ((shdrs[i].sh_type == SHT_SYMTAB || shdrs[i].sh_type == SHT_DYNSYM) &&
+            shdrs[i].sh_link < eh->e_shnum) {
+            load_symtab(mod, base, size, shdrs, i);
+        }
+    }
+    std::sort(mod->funcs.begin(), mod->funcs.end(),
+              [](const struct sym_func& a, const struct sym_func& b) { return a.start < b.start; });
+    // Drop duplicates (.symtab and .dynsym overlap). Unsized symbols such as
+    // _init never match, so PLT stubs fall back to module+offset.
+    std::vector<struct sym_func> out;
+    for (const struct sym_func& f : mod->funcs) {
+        if (!out.empty() && out.back().start == f.start) {
+            if (out.back().size == 0) {
+                out.back() = f;
+            }
+            continue;
+        }
+        out.push_back(f);
+    }
+    mod->funcs.swap(out);
+}
+
+// Load bias of a mapping: the PT_LOAD segment that covers the file offset
+// tells which virtual address the mapping start corresponds to.
+static bool mapping_bias(const struct sym_module* mod, uint64_t start, uint64_t offset, uint64_t* bias) {
+    if (!mod->image) {
+        return false;
+    }
+    const unsigned char* base = (const unsigned char*)mod->image;
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)base;
+    if (eh->e_phentsize != sizeof(Elf64_Phdr) ||
+        eh->e_phoff + eh->e_phnum * sizeof(Elf64_Phdr) > mod->image_size) {
+        return false;
+    }
+    const Elf64_Phdr* ph = (const Elf64_Phdr*)(base + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD) {
+            continue;
+        }
+        uint64_t align = ph[i].p_align ? ph[i].p_align : 1;
+        uint64_t seg_off = ph[i].p_offset & ~(align - 1);
+        if (offset >= seg_off && offset < ph[i].p_offset + ph[i].p_filesz) {
+            uint64_t vaddr = (ph[i].p_vaddr & ~(align - 1)) + (offset - seg_off);
+            *bias = start - vaddr;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called with g_sym_mutex held
+static void load_maps(void) {
+    FILE* fp = fopen("/proc/self/maps", "r");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open /proc/self/maps: %s\n", __func__, strerror(errno));
+        return;
+    }
+    g_ranges.clear();
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t start, end, offset;
+        char perms[8];
+        int path_pos = 0;
+        if (sscanf(line, "%" SCNx64 "-%" SCNx64 " %7s %" SCNx64 " %*s %*s %n",
+                   &start, &end, perms, &offset, &path_pos) < 4 || perms[2] != 'x') {
+            continue;
+        }
+        char* path = line + path_pos;
+        path[strcspn(path, "\n")] = '\0';
+        if (path[0] != '/') {
+            continue;  // anonymous, [vdso], ...
+        }
+        struct sym_module*& mod = g_modules[path];
+        if (!mod) {
+            mod = new sym_module();
+            mod->path = path;
+            mod->loaded = false;
+            mod->image = NULL;
+            mod->image_size = 0;
+        }
+        if (!mod->loaded) {
+            load_module(mod);
+        }
+        uint64_t bias;
+        if (!mapping_bias(mod, start, offset, &bias)) {
+            bias = start - offset;
+        }
+        g_ranges.push_back({ start, end, bias, mod });
+    }
+    fclose(fp);
+    std::sort(g_ranges.begin(), g_ranges.end(),
+              [](const struct sym_range& a, const struct sym_range& b) { return a.start < b.start; });
+}
+
+static const struct sym_range* find_range(uint64_t addr) {
+    auto it = std::upper_bound(g_ranges.begin(), g_ranges.end(), addr,
+                               [](uint64_t a, const struct sym_range& r) { return a < r.start; });
+    if (it == g_ranges.begin()) {
+        return NULL;
+    }
+    --it;
+    return addr < it->end ? &*it : NULL;
+}
+
+static const char* demangle(const char* name) {
+    auto it = g_demangled.find(name);
+    if (it != g_demangled.end()) {
+        return it->second.c_str();
+    }
+    int status = 0;
+    char* d = abi::__cxa_demangle(name, NULL, NULL, &status);
+    std::string& s = g_demangled[name];
+    s = status == 0 && d ? d : name;
+    free(d);
+    return s.c_str();
+}
+
+bool cputrace_symbolize(uint64_t addr, struct cputrace_symbol* sym) {
+    sym->name = NULL;
+    sym->module = NULL;
+    sym->offset = addr;
+    pthread_mutex_lock(&g_sym_mutex);
+    const struct sym_range* range = find_range(addr);
+    if (!range) {
+        load_maps();
+        range = find_range(addr);
+    }
+    if (!range) {
+        pthread_mutex_unlock(&g_sym_mutex);
+        return false;
+    }
+    struct sym_module* mod = range->module;
+    uint64_t vaddr = addr - range->bias;
+    sym->module = mod->path.c_str();
+    sym->offset = vaddr;
+    auto it = std::upper_bound(mod->funcs.begin(), mod->funcs.end(), vaddr,
+                               [](uint64_t a, const struct sym_func& f) { return a < f.start; });
+    if (it != mod->funcs.begin()) {
+        --it;
+        if (vaddr < it->start + it->size) {
+            sym->name = demangle(it->name);
+            sym->offset = vaddr - it->start;
+        }
+    }
+    pthread_mutex_unlock(&g_sym_mutex);
+    return sym->name != NULL;
+}
+
+void cputrace_symbol_format(uint64_t addr, char* buf, size_t size) {
+    struct cputrace_symbol sym;
+    if (cputrace_symbolize(addr, &sym)) {
+        snprintf(buf, size, "%s+0x%" PRIx64, sym.name, sym.offset);
+    } else if (sym.module) {
+        const char* base = strrchr(sym.module, '/');
+        snprintf(buf, size, "%s+0x%" PRIx64, base ? base + 1 : sym.module, sym.offset);
+    } else {
+        snprintf(buf, size, "0x%" PRIx64, addr);
+    }
+}
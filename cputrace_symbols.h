@@ -0,0 +1,23 @@
+#ifndef CPUTRACE_SYMBOLS_H
+#define CPUTRACE_SYMBOLS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// In-process symbolizer. Executable mappings come from /proc/self/maps and
+// function symbols from each module's ELF .symtab/.dynsym. Tables are loaded
+// on first use and reloaded when an address falls outside every known
+// mapping (e.g. after dlopen). All returned strings stay valid for the life
+// of the process.
+struct cputrace_symbol {
+    const char* name;    // demangled function name, NULL if unknown
+    const char* module;  // path of the mapped file, NULL if unknown
+    uint64_t offset;     // addr - function start, or addr - module base
+};
+
+bool cputrace_symbolize(uint64_t addr, struct cputrace_symbol* sym);
+
+// Formats "function+0xoff" or "module+0xoff" or the bare address
+void cputrace_symbol_format(uint64_t addr, char* buf, size_t size);
+
+#endif // CPUTRACE_SYMBOLS_H
@@ -0,0 +1,84 @@
+#ifndef CPUTRACE_TEST_H
+#define CPUTRACE_TEST_H
+
+// Performance assertions for unit tests, on top of cputrace_query(). Gate on
+// instruction counts where possible: unlike time and cycles they barely move
+// between runs, even on a noisy CI machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cputrace.h"
+
+// Runs fn() `warmup` times unmeasured, then `iterations` times, each as one
+// call of the anchor `name` recording `flags`. Profiling is switched on for
+// the run if it was off. Returns -1 when nothing could be measured, with
+// `out` left empty so the checks below fail on it.
+template <typename F>
+int cputrace_bench(const char* name, uint64_t flags, unsigned warmup, unsigned iterations,
+                   F&& fn, struct cputrace_anchor_summary* out) {
+    memset(out, 0, sizeof(*out));
+    const char* label = cputrace_intern(name);
+    int index = cputrace_anchor_register(label);
+    if (index < 0) {
+        fprintf(stderr, "%s: no free anchor for %s\n", __func__, name);
+        return -1;
+    }
+    for (unsigned i = 0; i < warmup; i++) {
+        fn();
+    }
+    bool started = cputrace_set_profiling(true) == 0;
+    cputrace_clear_anchor(label);
+    for (unsigned i = 0; i < iterations; i++) {
+        struct HW_profile profile(label, (uint64_t)index, flags);
+        fn();
+    }
+    if (started) {
+        cputrace_set_profiling(false);
+    }
+    return cputrace_query(label, out);
+}
+
+enum cputrace_check_result {
+    CPUTRACE_CHECK_PASS = 0,
+    CPUTRACE_CHECK_FAIL = 1,
+    CPUTRACE_CHECK_SKIP = 2  // metric not counted on this machine
+};
+
+// Per-call average of `metric` must not exceed `limit`. A metric the
+// machine cannot count is skipped rather than failed; a summary without
+// calls, as left by a failed query, fails.
+inline int cputrace_check_avg_le(const struct cputrace_anchor_summary* s, int metric, double limit) {
+    const char* what = cputrace_metric_name(metric);
+    const char* name = s->name ? s->name : "?";
+    if (s->call_count == 0) {
+        printf("FAIL %s: no calls measured\n", name);
+        return CPUTRACE_CHECK_FAIL;
+    }
+    if (!(s->recorded & (1ULL << metric))) {
+        printf("SKIP %s: %s not counted\n", name, what);
+        return CPUTRACE_CHECK_SKIP;
+    }
+    double avg = s->metric[metric].avg;
+    bool ok = avg <= limit;
+    printf("%s %s: %.1f %s per call, limit %.1f\n", ok ? "PASS" : "FAIL", name, avg, what, limit);
+    return ok ? CPUTRACE_CHECK_PASS : CPUTRACE_CHECK_FAIL;
+}
+
+// Per-call average at most `ratio` times a baseline, e.g. 1.05 for +5%
+inline int cputrace_check_avg_ratio(const struct cputrace_anchor_summary* s, int metric,
+                                    double baseline, double ratio) {
+    return cputrace_check_avg_le(s, metric, baseline * ratio);
+}
+
+#define CPUTRACE_ASSERT_AVG_LE(summary, metric, limit)                                    \
+    do {                                                                                  \
+        if (cputrace_check_avg_le(&(summary), (metric), (limit)) == CPUTRACE_CHECK_FAIL) { \
+            exit(EXIT_FAILURE);                                                           \
+        }                                                                                 \
+    } while (0)
+
+#define CPUTRACE_ASSERT_AVG_RATIO(summary, metric, baseline, ratio) \
+    CPUTRACE_ASSERT_AVG_LE(summary, metric, (baseline) * (ratio))
+
+#endif // CPUTRACE_TEST_H
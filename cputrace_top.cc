@@ -0,0 +1,265 @@
+// cputrace_top: live per-anchor view of a process that called
+// cputrace_shm_enable().
+//
+//   cputrace_top [options] <pid | /shm-name>
+//
+// Attaches read-only to the shared-memory anchor table and, every interval,
+// shows per-anchor call rates and per-call averages over that interval.
+// Reading uses the per-anchor seqlocks and never blocks the process.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "cputrace_shm.h"
+
+struct anchor_sample {
+    std::string name;
+    uint64_t call_count;
+    uint64_t sum[CPUTRACE_SHM_METRICS];
+};
+
+// Indices of the metrics the view uses, -1 when the process has none
+struct metric_map {
+    int cycles, instructions, cache_misses, branch_misses, wall, task, page_faults, switches;
+};
+
+static int metric_index(const struct cputrace_shm_header* h, const char* key) {
+    for (uint32_t i = 0; i < h->metric_count && i < CPUTRACE_SHM_METRICS; i++) {
+        if (strncmp(h->metric_key[i], key, sizeof(h->metric_key[i])) == 0) {
+            return (h->supported & (1ULL << i)) ? (int)i : -1;
+        }
+    }
+    return -1;
+}
+
+static bool read_anchor(const struct cputrace_shm_anchor* a, struct anchor_sample* out) {
+    struct cputrace_shm_anchor copy;
+    for (int tries = 0; tries < 100; tries++) {
+        uint64_t seq = __atomic_load_n(&a->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(&copy, (const void*)a, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&a->seq, __ATOMIC_RELAXED) == seq) {
+            copy.name[sizeof(copy.name) - 1] = '\0';
+            out->name = copy.name;
+            out->call_count = copy.call_count;
+            memcpy(out->sum, copy.sum, sizeof(out->sum));
+            return true;
+        }
+    }
+    return false;
+}
+
+// An anchor that stays busy keeps its previous values for this interval
+static void read_table(struct cputrace_shm_header* h, std::vector<struct anchor_sample>* out,
+                       const std::vector<struct anchor_sample>& prev) {
+    out->assign(h->anchor_count, anchor_sample());
+    struct cputrace_shm_anchor* anchors = cputrace_shm_anchors(h);
+    for (uint32_t i = 0; i < h->anchor_count; i++) {
+        if (!read_anchor(&anchors[i], &(*out)[i])) {
+            (*out)[i] = i < prev.size() ? prev[i] : anchor_sample();
+        }
+    }
+}
+
+static struct cputrace_shm_header* attach(const char* target, size_t* size) {
+    std::string name = target;
+    if (strspn(target, "0123456789") == strlen(target)) {
+        name = std::string("/cputrace.") + target;
+    }
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "cputrace_top: cannot open %s: %s\n", name.c_str(), strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct cputrace_shm_header)) {
+        fprintf(stderr, "cputrace_top: %s is too small\n", name.c_str());
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "cputrace_top: mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+    struct cputrace_shm_header* h = (struct cputrace_shm_header*)map;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != CPUTRACE_SHM_MAGIC ||
+        h->version != CPUTRACE_SHM_VERSION || h->header_size != sizeof(struct cputrace_shm_header) ||
+        h->anchor_size != sizeof(struct cputrace_shm_anchor) ||
+        h->header_size + (size_t)h->anchor_size * h->anchor_count > (size_t)st.st_size) {
+        fprintf(stderr, "cputrace_top: %s: unknown layout (version %u, expected %d)\n",
+                name.c_str(), h->version, CPUTRACE_SHM_VERSION);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return h;
+}
+
+static double ratio(uint64_t num, uint64_t den, double scale) {
+    return den ? scale * (double)num / (double)den : 0.0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: cputrace_top [options] <pid | /shm-name>\n"
+            "  -i, --interval SEC    refresh interval (default 1)\n"
+            "  -s, --sort KEY        calls or a metric key such as cycles (default calls)\n"
+            "  -n, --iterations N    exit after N refreshes (default: run until killed)\n"
+            "  -t, --top N           show the N busiest anchors (default 20)\n"
+            "  -b, --batch           append instead of redrawing the screen\n");
+}
+
+int main(int argc, char** argv) {
+    double interval = 1.0;
+    const char* sort_key = "calls";
+    long iterations = 0;
+    size_t top = 20;
+    bool batch = !isatty(STDOUT_FILENO);
+
+    static const struct option long_opts[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "sort", required_argument, NULL, 's' },
+        { "iterations", required_argument, NULL, 'n' },
+        { "top", required_argument, NULL, 't' },
+        { "batch", no_argument, NULL, 'b' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "i:s:n:t:bh", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'i': interval = atof(optarg); break;
+        case 's': sort_key = optarg; break;
+        case 'n': iterations = atol(optarg); break;
+        case 't': top = (size_t)atol(optarg); break;
+        case 'b': batch = true; break;
+        default: usage(); return 2;
+        }
+    }
+    if (argc - optind != 1 || interval <= 0) {
+        usage();
+        return 2;
+    }
+    size_t size;
+    struct cputrace_shm_header* h = attach(argv[optind], &size);
+    if (!h) {
+        return 1;
+    }
+    int sort_metric = -1;
+    if (strcmp(sort_key, "calls") != 0) {
+        sort_metric = metric_index(h, sort_key);
+        if (sort_metric < 0) {
+            fprintf(stderr, "cputrace_top: unknown or uncounted metric '%s'\n", sort_key);
+            return 2;
+        }
+    }
+    struct metric_map m = {
+        metric_index(h, "cycles"), metric_index(h, "instructions"), metric_index(h, "cache_misses"),
+        metric_index(h, "branch_misses"), metric_index(h, "wall_time_ns"), metric_index(h, "task_clock_ns"),
+        metric_index(h, "page_faults"), metric_index(h, "context_switches"),
+    };
+
+    std::vector<struct anchor_sample> prev, cur;
+    read_table(h, &prev, std::vector<struct anchor_sample>());
+    for (long n = 0; iterations == 0 || n < iterations; n++) {
+        usleep((useconds_t)(interval * 1e6));
+        read_table(h, &cur, prev);
+
+        struct row {
+            const struct anchor_sample* a;
+            uint64_t calls;
+            uint64_t delta[CPUTRACE_SHM_METRICS];
+        };
+        std::vector<struct row> rows;
+        for (size_t i = 0; i < cur.size(); i++) {
+            // A reset in the process shows up as counts going backwards
+            bool reset = cur[i].call_count < prev[i].call_count;
+            struct row r;
+            r.a = &cur[i];
+            r.calls = cur[i].call_count - (reset ? 0 : prev[i].call_count);
+            for (int k = 0; k < CPUTRACE_SHM_METRICS; k++) {
+                r.delta[k] = cur[i].sum[k] - (reset ? 0 : prev[i].sum[k]);
+            }
+            if (r.calls > 0) {
+                rows.push_back(r);
+            }
+        }
+        std::stable_sort(rows.begin(), rows.end(), [sort_metric](const struct row& x, const struct row& y) {
+            return sort_metric < 0 ? x.calls > y.calls : x.delta[sort_metric] > y.delta[sort_metric];
+        });
+
+        if (!batch) {
+            printf("\033[H\033[2J");
+        }
+        printf("cputrace_top: pid %d, %zu active anchors, %.1f s interval, sorted by %s\n\n",
+               (int)h->pid, rows.size(), interval, sort_key);
+        printf("%-36s %10s %10s %6s", "anchor", "calls/s", "wall us", "cpu%");
+        if (m.cycles >= 0) {
+            printf(" %12s", "cyc/call");
+        }
+        if (m.cycles >= 0 && m.instructions >= 0) {
+            printf(" %6s", "IPC");
+        }
+        if (m.instructions >= 0 && m.cache_misses >= 0) {
+            printf(" %9s", "cmiss/ki");
+        }
+        if (m.instructions >= 0 && m.branch_misses >= 0) {
+            printf(" %9s", "bmiss/ki");
+        }
+        if (m.page_faults >= 0) {
+            printf(" %9s", "pgf/call");
+        }
+        if (m.switches >= 0) {
+            printf(" %9s", "csw/call");
+        }
+        printf("\n");
+        for (size_t k = 0; k < rows.size() && k < top; k++) {
+            const struct row& r = rows[k];
+            printf("%-36.36s %10.1f %10.1f %6.1f", r.a->name.c_str(), r.calls / interval,
+                   m.wall >= 0 ? ratio(r.delta[m.wall], r.calls, 1e-3) : 0.0,
+                   m.wall >= 0 && m.task >= 0 ? ratio(r.delta[m.task], r.delta[m.wall], 100.0) : 0.0);
+            if (m.cycles >= 0) {
+                printf(" %12.0f", ratio(r.delta[m.cycles], r.calls, 1.0));
+            }
+            if (m.cycles >= 0 && m.instructions >= 0) {
+                printf(" %6.2f", ratio(r.delta[m.instructions], r.delta[m.cycles], 1.0));
+            }
+            if (m.instructions >= 0 && m.cache_misses >= 0) {
+                printf(" %9.2f", ratio(r.delta[m.cache_misses], r.delta[m.instructions], 1000.0));
+            }
+            if (m.instructions >= 0 && m.branch_misses >= 0) {
+                printf(" %9.2f", ratio(r.delta[m.branch_misses], r.delta[m.instructions], 1000.0));
+            }
+            if (m.page_faults >= 0) {
+                printf(" %9.2f", ratio(r.delta[m.page_faults], r.calls, 1.0));
+            }
+            if (m.switches >= 0) {
+                printf(" %9.2f", ratio(r.delta[m.switches], r.calls, 1.0));
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+        prev.swap(cur);
+        if (kill(h->pid, 0) == -1 && errno == ESRCH) {
+            printf("\nprocess %d exited\n", (int)h->pid);
+            break;
+        }
+    }
+    munmap(h, size);
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Minimal stand-in for Ceph's common/Formatter.h so that the Ceph adapter
+// (cputrace_ceph.cc) builds and runs outside a Ceph tree. Only the calls
+// cputrace uses are provided; JSONFormatter prints compact JSON.
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ceph {
+
+class Formatter {
+public:
+    virtual ~Formatter() {}
+    virtual void flush(std::ostream& os) = 0;
+    virtual void open_array_section(std::string_view name) = 0;
+    virtual void open_object_section(std::string_view name) = 0;
+    virtual void close_section() = 0;
+    virtual void dump_unsigned(std::string_view name, uint64_t u) = 0;
+    virtual void dump_int(std::string_view name, int64_t s) = 0;
+    virtual void dump_float(std::string_view name, double d) = 0;
+    virtual void dump_string(std::string_view name, std::string_view s) = 0;
+    virtual void dump_format(std::string_view name, const char* fmt, ...) {
+        char buf[1024];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        dump_string(name, buf);
+    }
+};
+
+class JSONFormatter : public Formatter {
+public:
+    void flush(std::ostream& os) override {
+        os << ss.str() << std::endl;
+        ss.str("");
+        stack.clear();
+    }
+    void open_array_section(std::string_view name) override { open(name, '[', true); }
+    void open_object_section(std::string_view name) override { open(name, '{', false); }
+    void close_section() override {
+        if (stack.empty()) {
+            return;
+        }
+        ss << (stack.back().is_array ? ']' : '}');
+        stack.pop_back();
+    }
+    void dump_unsigned(std::string_view name, uint64_t u) override { key(name); ss << u; }
+    void dump_int(std::string_view name, int64_t s) override { key(name); ss << s; }
+    void dump_float(std::string_view name, double d) override { key(name); ss << d; }
+    void dump_string(std::string_view name, std::string_view s) override {
+        key(name);
+        quote(s);
+    }
+
+private:
+    struct section {
+        bool is_array;
+        bool first;
+    };
+    std::ostringstream ss;
+    std::vector<section> stack;
+
+    void quote(std::string_view s) {
+        ss << '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                ss << '\\';
+            }
+            ss << c;
+        }
+        ss << '"';
+    }
+    // Array elements are written without their name, as Ceph does
+    void key(std::string_view name) {
+        if (stack.empty()) {
+            return;
+        }
+        if (!stack.back().first) {
+            ss << ',';
+        }
+        stack.back().first = false;
+        if (!stack.back().is_array) {
+            quote(name);
+            ss << ':';
+        }
+    }
+    void open(std::string_view name, char c, bool is_array) {
+        key(name);
+        ss << c;
+        stack.push_back({ is_array, true });
+    }
+};
+
+} // namespace ceph
@@ -0,0 +1,55 @@
+// Built with -finstrument-functions: nothing below declares a scope
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "cputrace.h"
+
+__attribute__((noinline)) double work_parse(int n) {
+    volatile double x = 0;
+    for (int i = 0; i < n; i++) {
+        x = x + i;
+    }
+    return x;
+}
+
+__attribute__((noinline)) double work_apply(int n) {
+    return work_parse(n / 2) + work_parse(n / 2);
+}
+
+// Instrumented too, but rejected by the filter
+__attribute__((noinline)) int helper(int x) {
+    return x * 3 + 1;
+}
+
+__attribute__((noinline)) void flush_log() {
+    volatile int x = 0;
+    for (int i = 0; i < 100000; i++) {
+        x = x + helper(i);
+    }
+}
+
+int main() {
+    std::cout << "Starting test10.cc\n";
+    cputrace_auto_allow("flush_log");
+    if (cputrace_auto_enable("^work_", HW_PROFILE_CYC | HW_PROFILE_TASK) < 0) {
+        return 1;
+    }
+    cputrace_start();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 50; i++) {
+                work_apply(100000);
+                flush_log();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    cputrace_stop();
+    cputrace_auto_disable();
+    cputrace_close();
+    std::cout << "Test10.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cputrace.h"
+
+static const char* kSocket = "/tmp/cputrace-test11.sock";
+
+void handle_request() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 100000; i++) {
+    }
+}
+
+// What an operator would do with socat or nc -U
+std::string control(const char* cmd) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, kSocket);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return "connect failed";
+    }
+    std::string line = std::string(cmd) + "\n";
+    if (write(fd, line.data(), line.size()) < 0) {
+        close(fd);
+        return "write failed";
+    }
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    close(fd);
+    return out;
+}
+
+int main() {
+    std::cout << "Starting test11.cc\n";
+    if (cputrace_control_start(kSocket, SIGUSR2) < 0) {
+        return 1;
+    }
+    std::atomic<bool> done(false);
+    std::thread worker([&done]() {
+        while (!done) {
+            handle_request();
+            usleep(100);
+        }
+    });
+
+    std::cout << control("start 1");
+    std::cout << control("start");
+    usleep(200000);
+    std::string json = control("dump format=json filter=handle metric=task_clock_ns");
+    std::cout << json.substr(0, 120) << "...\n";
+    std::cout << control("dump format=xml");
+    std::cout << control("frobnicate");
+
+    // The handler only wakes the control thread, which dumps to stderr
+    raise(SIGUSR2);
+    usleep(1200000);  // past the 1 s window
+    std::cout << control("stop");
+    std::cout << control("reset");
+    std::cout << control("dump");
+
+    done = true;
+    worker.join();
+    cputrace_control_stop();
+    std::cout << "Test11.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <iostream>
+#include <unistd.h>
+#include "cputrace.h"
+
+// Usually quick; call 300 stalls like a slow disk flush would
+void kv_sync(int i) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    usleep(i == 300 ? 20000 : 100);
+}
+
+void txc_finish() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 10000; i++) {
+    }
+}
+
+int main() {
+    std::cout << "Starting test12.cc\n";
+    struct cputrace_trigger_opts opts;
+    cputrace_trigger_opts_init(&opts);
+    opts.window_ms = 5;
+    opts.history = 64;
+    cputrace_trigger_enable(&opts);
+    // 10 ms in one call
+    cputrace_trigger_add("kv_sync", CPUTRACE_RESULT_WALL, 10000000, 0);
+    cputrace_start();
+
+    if (cputrace_trigger_dump(stdout) < 0) {
+        std::cout << "no capture yet\n";
+    }
+    for (int i = 0; i < 400; i++) {
+        kv_sync(i);
+        txc_finish();
+    }
+    if (cputrace_trigger_dump(stdout) < 0) {
+        std::cout << "FAIL: trigger did not fire\n";
+        return 1;
+    }
+    if (cputrace_trigger_dump(stdout) < 0) {
+        std::cout << "re-armed, no new capture\n";
+    }
+    cputrace_trigger_disable();
+    cputrace_stop();
+    std::cout << "Test12.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <string.h>
+#include "cputrace.h"
+#include "cputrace_test.h"
+
+__attribute__((noinline)) unsigned checksum(const unsigned char* data, size_t len) {
+    unsigned sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum = sum * 31 + data[i];
+    }
+    return sum;
+}
+
+static unsigned char g_data[16384];
+static volatile unsigned g_sink;
+
+int main() {
+    std::cout << "Starting test13.cc\n";
+    memset(g_data, 7, sizeof(g_data));
+    const uint64_t flags = HW_PROFILE_INS | HW_PROFILE_CYC | HW_PROFILE_TASK;
+
+    struct cputrace_anchor_summary base, cand, slow;
+    if (cputrace_bench("checksum_4k", flags, 10, 200,
+                       []() { g_sink = checksum(g_data, 4096); }, &base) < 0) {
+        std::cout << "FAIL: nothing measured\n";
+        return 1;
+    }
+    std::cout << base.call_count << " calls, p50 task-clock "
+              << base.metric[CPUTRACE_RESULT_TASK].p50 << " ns\n";
+
+    // The same work again stays within 5% instructions (and a loose time bound)
+    cputrace_bench("checksum_4k_again", flags, 10, 200,
+                   []() { g_sink = checksum(g_data, 4096); }, &cand);
+    CPUTRACE_ASSERT_AVG_RATIO(cand, CPUTRACE_RESULT_INS, base.metric[CPUTRACE_RESULT_INS].avg, 1.05);
+
+    // Four times the work must be caught
+    std::cout << "expecting one FAIL:\n";
+    cputrace_bench("checksum_16k", flags, 10, 200,
+                   []() { g_sink = checksum(g_data, 16384); }, &slow);
+    int metric = (slow.recorded & (1ULL << CPUTRACE_RESULT_INS)) ? CPUTRACE_RESULT_INS : CPUTRACE_RESULT_TASK;
+    if (cputrace_check_avg_ratio(&slow, metric, base.metric[metric].avg, 1.05) != CPUTRACE_CHECK_FAIL) {
+        std::cout << "FAIL: regression not detected\n";
+        return 1;
+    }
+    struct cputrace_anchor_summary none;
+    if (cputrace_query("no_such_anchor", &none) != -1) {
+        std::cout << "FAIL: unknown anchor found\n";
+        return 1;
+    }
+    std::cout << "Test13.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cputrace.h"
+
+void osd_op() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 20000; i++) {
+    }
+}
+
+void journal_write() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK | HW_PROFILE_SWI);
+    usleep(500);
+}
+
+int main() {
+    std::cout << "Starting test14.cc\n";
+    if (cputrace_shm_enable(NULL) < 0) {
+        return 1;
+    }
+    cputrace_start();
+    std::atomic<bool> done(false);
+    std::thread worker([&done]() {
+        while (!done) {
+            osd_op();
+            journal_write();
+        }
+    });
+
+    // What an operator runs from another shell
+    std::string cmd = "./cputrace_top -b -n 2 -i 0.5 -s task_clock_ns " + std::to_string(getpid());
+    int rc = system(cmd.c_str());
+
+    done = true;
+    worker.join();
+    cputrace_stop();
+    cputrace_shm_disable();
+    if (rc != 0) {
+        std::cout << "FAIL: cputrace_top exited with " << rc << "\n";
+        return 1;
+    }
+    std::cout << "Test14.cc complete.\n";
+    return 0;
+}
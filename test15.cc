@@ -0,0 +1,62 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include "cputrace.h"
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+void stay_put(int cpu) {
+    pin(cpu);
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_CMISS | HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 200000; i++) {
+    }
+}
+
+// Moves itself to another CPU halfway through
+void migrate(int from, int to) {
+    pin(from);
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_CMISS | HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 100000; i++) {
+    }
+    pin(to);
+    for (volatile int i = 0; i < 100000; i++) {
+    }
+}
+
+int main() {
+    std::cout << "Starting test15.cc\n";
+    int nodes = cputrace_numa_enable();
+    int ncpus = (int)std::thread::hardware_concurrency();
+    std::cout << nodes << " NUMA node(s), " << ncpus << " cpu(s)\n";
+    cputrace_start();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([ncpus, t]() {
+            for (int i = 0; i < 20; i++) {
+                stay_put((t + i) % ncpus);
+                if (ncpus > 1) {
+                    migrate(i % ncpus, (i + 1) % ncpus);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    cputrace_stop();
+    cputrace_dump();
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.format = CPUTRACE_FORMAT_JSON;
+    opts.filter = "stay_put";
+    cputrace_dump_file(stdout, &opts);
+    cputrace_numa_disable();
+    std::cout << "Test15.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cputrace.h"
+
+// Same churn as test3: many allocations, nothing kept
+void churn() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    for (int i = 0; i < 100000; i++) {
+        int* a = new int;
+        delete a;
+    }
+}
+
+// Keeps a growing buffer alive across the nested churn
+void build() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    std::vector<std::string> v;
+    for (int i = 0; i < 1000; i++) {
+        v.push_back(std::string(100, 'x'));
+    }
+    churn();
+}
+
+int main() {
+    std::cout << "Starting test16.cc\n";
+    if (cputrace_alloc_enable() < 0) {
+        return 1;
+    }
+    cputrace_start();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 5; i++) {
+                build();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    cputrace_stop();
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.format = CPUTRACE_FORMAT_JSON;
+    opts.filter = "build";
+    cputrace_dump_file(stdout, &opts);
+    cputrace_alloc_disable();
+    std::cout << "Test16.cc complete.\n";
+    cputrace_close();
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "cputrace.h"
+
+std::mutex g_mutex;
+std::mutex g_queue_mutex;
+std::condition_variable g_queue_cv;
+int g_shared_counter = 0;
+int g_queued = 0;
+
+void contend() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    for (int i = 0; i < 2000; i++) {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        g_shared_counter++;
+        if (g_shared_counter % 100 == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+}
+
+void consume(int items) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    std::unique_lock<std::mutex> lock(g_queue_mutex);
+    for (int i = 0; i < items; i++) {
+        g_queue_cv.wait(lock, [] { return g_queued > 0; });
+        g_queued--;
+    }
+}
+
+// Uncontended lock/unlock pairs, in ns each
+static double uncontended_ns() {
+    std::mutex m;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1000000; i++) {
+        m.lock();
+        m.unlock();
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / 1e6;
+}
+
+int main() {
+    std::cout << "Starting test17.cc\n";
+    double before = uncontended_ns();
+    if (cputrace_lock_enable() < 0) {
+        return 1;
+    }
+    double after = uncontended_ns();
+    std::cout << "uncontended lock+unlock: " << before << " ns unhooked, " << after << " ns hooked\n";
+
+    cputrace_start();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back(contend);
+    }
+    std::thread consumer(consume, 10);
+    for (int i = 0; i < 10; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_queued++;
+        g_queue_cv.notify_one();
+    }
+    consumer.join();
+    for (auto& t : threads) {
+        t.join();
+    }
+    cputrace_stop();
+    std::cout << "g_mutex is at " << (void*)&g_mutex << "\n";
+    cputrace_dump();
+    cputrace_lock_disable();
+    std::cout << "Test17.cc complete.\n";
+    return 0;
+}
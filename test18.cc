@@ -0,0 +1,52 @@
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cputrace.h"
+
+// Writes and syncs a small file, the shape of a KV sync
+void sync_batch(int fd) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK | HW_PROFILE_RUSAGE | HW_PROFILE_IO);
+    char block[4096];
+    memset(block, 'k', sizeof(block));
+    for (int i = 0; i < 16; i++) {
+        if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block)) {
+            perror("write");
+            return;
+        }
+    }
+    fdatasync(fd);
+}
+
+// Touches fresh memory: minor faults only
+void fault_in() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK | HW_PROFILE_RUSAGE);
+    std::vector<char> buf(8 << 20);
+    for (size_t i = 0; i < buf.size(); i += 4096) {
+        buf[i] = 1;
+    }
+}
+
+int main() {
+    std::cout << "Starting test18.cc\n";
+    char path[] = "/tmp/cputrace_test18.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    cputrace_io_interval(0);
+    cputrace_start();
+    for (int i = 0; i < 10; i++) {
+        sync_batch(fd);
+        fault_in();
+    }
+    cputrace_stop();
+    close(fd);
+    cputrace_dump();
+    std::cout << "Test18.cc complete.\n";
+    return 0;
+}
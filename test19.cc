@@ -0,0 +1,66 @@
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "cputrace.h"
+
+// Data-dependent branches on random input: bad speculation
+long branchy(const std::vector<int>& data) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_TOPDOWN);
+    long sum = 0;
+    for (int v : data) {
+        if (v & 1) {
+            sum += v;
+        } else {
+            sum -= v / 3;
+        }
+    }
+    return sum;
+}
+
+// Dependent loads over a large random cycle: backend bound
+size_t chase(const std::vector<size_t>& next) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_TOPDOWN);
+    size_t p = 0;
+    for (size_t i = 0; i < next.size(); i++) {
+        p = next[p];
+    }
+    return p;
+}
+
+int main() {
+    std::cout << "Starting test19.cc\n";
+    int method = cputrace_topdown_enable();
+    std::cout << "top-down method " << method << "\n";
+
+    std::mt19937 gen(42);
+    std::vector<int> data(1 << 20);
+    for (int& v : data) {
+        v = (int)gen();
+    }
+    std::vector<size_t> order(1 << 20), next(1 << 20);
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin() + 1, order.end(), gen);
+    for (size_t i = 0; i < order.size(); i++) {
+        next[order[i]] = order[(i + 1) % order.size()];
+    }
+
+    cputrace_start();
+    long sink = 0;
+    for (int i = 0; i < 5; i++) {
+        sink += branchy(data);
+        sink += (long)chase(next);
+    }
+    cputrace_stop();
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    cputrace_dump_file(stdout, &opts);
+    opts.format = CPUTRACE_FORMAT_JSON;
+    opts.filter = "chase";
+    cputrace_dump_file(stdout, &opts);
+    cputrace_topdown_disable();
+    std::cout << "Test19.cc complete (" << (sink & 1) << ").\n";
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cputrace.h"
+
+void encode_chunk() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 50000; i++) {
+    }
+}
+
+void commit_txn() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_TASK);
+    for (volatile int i = 0; i < 10000; i++) {
+    }
+}
+
+// One snapshot per "process", as a fleet collector would gather them
+static bool write_snapshot(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return false;
+    }
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.format = CPUTRACE_FORMAT_BINARY;
+    int r = cputrace_dump_file(fp, &opts);
+    fclose(fp);
+    return r >= 0;
+}
+
+static void run_round(int calls) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([calls]() {
+            for (int i = 0; i < calls; i++) {
+                encode_chunk();
+                commit_txn();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+int main() {
+    std::cout << "Starting test20.cc\n";
+    cputrace_start();
+    run_round(200);
+    if (!write_snapshot("/tmp/cputrace_test20_a.snap")) {
+        return 1;
+    }
+    run_round(300);
+    if (!write_snapshot("/tmp/cputrace_test20_b.snap")) {
+        return 1;
+    }
+    cputrace_stop();
+
+    int rc = system("./cputrace_merge -T -m task_clock_ns /tmp/cputrace_test20_a.snap /tmp/cputrace_test20_b.snap");
+    if (rc != 0) {
+        std::cout << "FAIL: cputrace_merge exited with " << rc << "\n";
+        return 1;
+    }
+    // A truncated file must be rejected, not read past its end
+    rc = system("head -c 200 /tmp/cputrace_test20_a.snap > /tmp/cputrace_test20_c.snap && "
+                "./cputrace_merge /tmp/cputrace_test20_c.snap 2>/dev/null");
+    if (!WIFEXITED(rc) || WEXITSTATUS(rc) != 2) {
+        std::cout << "FAIL: truncated snapshot not rejected\n";
+        return 1;
+    }
+    std::cout << "Test20.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <stdlib.h>
+#include <string.h>
+#include "cputrace.h"
+
+// One helper, two callers with very different inputs
+void checksum(int len) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_CALLERS);
+    for (volatile int i = 0; i < len; i++) {
+    }
+}
+
+void small_write() {
+    for (int i = 0; i < 4; i++) {
+        checksum(1000);
+    }
+}
+
+void large_write() {
+    checksum(200000);
+}
+
+int main() {
+    std::cout << "Starting test21.cc\n";
+    if (cputrace_callers_enable(4) < 0) {
+        return 1;
+    }
+    cputrace_start();
+    std::thread worker([]() {
+        for (int i = 0; i < 200; i++) {
+            small_write();
+            large_write();
+        }
+    });
+    worker.join();
+    cputrace_stop();
+    cputrace_dump();
+
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.format = CPUTRACE_FORMAT_FOLDED;
+    size_t len;
+    char* folded = cputrace_dump_buffer(&opts, &len);
+    if (!folded) {
+        return 1;
+    }
+    std::cout << "\nfolded stacks:\n" << folded;
+    bool ok = strstr(folded, "small_write") && strstr(folded, "large_write");
+    free(folded);
+    cputrace_callers_disable();
+    if (!ok) {
+        std::cout << "FAIL: callers of checksum not told apart\n";
+        return 1;
+    }
+    std::cout << "Test21.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <iostream>
+#include "cputrace.h"
+
+// Two implementations of the same operation, one much cheaper
+static void crc_table(void* arg) {
+    volatile int* len = (volatile int*)arg;
+    for (volatile int i = 0; i < *len; i++) {
+    }
+}
+
+static void crc_bytewise(void* arg) {
+    volatile int* len = (volatile int*)arg;
+    for (volatile int i = 0; i < *len * 20; i++) {
+    }
+}
+
+int main() {
+    std::cout << "Starting test22.cc\n";
+    int len = 2000;
+    struct cputrace_experiment_opts opts;
+    cputrace_experiment_opts_init(&opts);
+    opts.blocks = 20;
+    opts.calls_per_block = 20;
+    struct cputrace_experiment* exp = cputrace_experiment_create("crc", &opts);
+    if (!exp) {
+        return 1;
+    }
+    int bytewise = cputrace_experiment_add(exp, "bytewise", crc_bytewise, &len);
+    int table = cputrace_experiment_add(exp, "table", crc_table, &len);
+    if (bytewise < 0 || table < 0 || cputrace_experiment_run(exp) < 0) {
+        return 1;
+    }
+    cputrace_experiment_report(exp, stdout);
+
+    int winner = cputrace_experiment_winner(exp, CPUTRACE_RESULT_WALL);
+    double ratio = cputrace_experiment_median(exp, bytewise, CPUTRACE_RESULT_WALL) /
+                   cputrace_experiment_median(exp, table, CPUTRACE_RESULT_WALL);
+    cputrace_experiment_destroy(exp);
+    if (winner != table || ratio < 5) {
+        std::cout << "FAIL: expected 'table' to win by a wide margin, winner " << winner << " ratio " << ratio
+                  << "\n";
+        return 1;
+    }
+    std::cout << "Test22.cc complete.\n";
+    return 0;
+}
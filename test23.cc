@@ -0,0 +1,33 @@
+#include <iostream>
+#include <unistd.h>
+#include "cputrace.h"
+
+// User-only counting, as the Ceph build sets it, must not lose the context
+// switches of a scope that sleeps: they happen in kernel mode.
+int main() {
+    std::cout << "Starting test23.cc\n";
+    cputrace_set_user_only(true);
+    cputrace_set_profiling(true);
+    for (int i = 0; i < 20; i++) {
+        HWProfileFunctionF(profile, "nap", HW_PROFILE_SWI);
+        usleep(500);
+    }
+    cputrace_set_profiling(false);
+
+    if (!cputrace_event_supported(CPUTRACE_RESULT_SWI)) {
+        std::cout << "SKIP: context switches not counted on this machine\n";
+        return 0;
+    }
+    struct cputrace_anchor_summary s;
+    if (cputrace_query("nap", &s) < 0 || s.call_count != 20) {
+        std::cout << "FAIL: no calls of nap recorded\n";
+        return 1;
+    }
+    if (s.metric[CPUTRACE_RESULT_SWI].total == 0) {
+        std::cout << "FAIL: 20 sleeping calls counted no context switches\n";
+        return 1;
+    }
+    std::cout << "nap: " << s.metric[CPUTRACE_RESULT_SWI].total << " context switches in 20 calls\n";
+    std::cout << "Test23.cc complete.\n";
+    return 0;
+}
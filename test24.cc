@@ -0,0 +1,63 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cputrace.h"
+
+// Three threads share one name and one has its own: the dump lists four
+// threads and two thread names under the anchor.
+static void worker(const char* name) {
+    pthread_setname_np(pthread_self(), name);
+    for (int i = 0; i < 50; i++) {
+        HWProfileFunctionF(profile, "flush", HW_PROFILE_TASK);
+        for (volatile int j = 0; j < 10000; j++) {
+        }
+    }
+}
+
+// Finds the thread_names entry for name and checks its thread and call counts.
+static bool has_group(const char* json, const char* name, int threads, int calls) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"thread_name\": \"%s\"", name);
+    const char* p = strstr(json, key);
+    int t = -1, c = -1;
+    if (!p || sscanf(p + strlen(key), " , \"threads\": %d , \"call_count\": %d", &t, &c) != 2)
+        return false;
+    return t == threads && c == calls;
+}
+
+int main() {
+    std::cout << "Starting test24.cc\n";
+    cputrace_start();
+    std::vector<std::thread> threads;
+    const char* names[] = { "osd_shard", "osd_shard", "osd_shard", "kv_sync" };
+    for (const char* name : names) {
+        threads.emplace_back(worker, name);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    cputrace_stop();
+
+    std::cout << "\n=== Per thread and per thread name ===\n";
+    cputrace_dump_ex(CPUTRACE_DUMP_THREADS | CPUTRACE_DUMP_THREAD_NAMES);
+
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.format = CPUTRACE_FORMAT_JSON;
+    opts.flags = CPUTRACE_DUMP_THREAD_NAMES;
+    size_t len = 0;
+    char* json = cputrace_dump_buffer(&opts, &len);
+    bool ok = json && has_group(json, "osd_shard", 3, 150) && has_group(json, "kv_sync", 1, 50);
+    free(json);
+    cputrace_close();
+    if (!ok) {
+        std::cout << "FAIL: expected 3 osd_shard threads with 150 calls and 1 kv_sync thread with 50\n";
+        return 1;
+    }
+    std::cout << "Test24.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "cputrace.h"
+
+// A scope that mostly makes system calls: with the split on, its cycles are
+// reported as user and kernel parts.
+static void syscall_heavy() {
+    HWProfileFunctionF(profile, "getppid_loop", HW_PROFILE_CYC | HW_PROFILE_INS);
+    for (int i = 0; i < 2000; i++) {
+        syscall(SYS_getppid);
+    }
+}
+
+int main() {
+    std::cout << "Starting test25.cc\n";
+    if (cputrace_kernel_split_enable() < 0) {
+        std::cout << "SKIP: kernel counting not permitted\n";
+        return 0;
+    }
+    cputrace_start();
+    for (int i = 0; i < 20; i++) {
+        syscall_heavy();
+    }
+    cputrace_stop();
+    cputrace_dump();
+
+    if (!cputrace_event_supported(CPUTRACE_RESULT_CYC)) {
+        std::cout << "SKIP: no cycles counter on this machine\n";
+        cputrace_close();
+        return 0;
+    }
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+    opts.format = CPUTRACE_FORMAT_JSON;
+    size_t len = 0;
+    char* json = cputrace_dump_buffer(&opts, &len);
+    bool ok = json && strstr(json, "\"kernel_cycles\"") != NULL;
+    free(json);
+    cputrace_kernel_split_disable();
+    cputrace_close();
+    if (!ok) {
+        std::cout << "FAIL: no kernel part of cycles in the dump\n";
+        return 1;
+    }
+    std::cout << "Test25.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include "cputrace.h"
+
+static void spin(int n) {
+    for (int i = 0; i < n; i++) {
+        volatile int x = i * i;
+        (void)x;
+    }
+}
+
+// An op that starts on one thread, waits, and is completed by another.
+void handoff_op() {
+    HW_span* span = HWProfileSpanNew("handoff_op", HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_SWI);
+    spin(1000000);
+    span->pause();
+    usleep(10000); // off-CPU wait, not counted
+
+    std::thread worker([span]() {
+        span->resume();
+        spin(1000000);
+        span->finish();
+        delete span;
+    });
+    worker.join();
+}
+
+// A function that suspends several times before it completes.
+void suspending_op() {
+    HWProfileSpanF(span, "suspending_op", HW_PROFILE_CYC | HW_PROFILE_INS | HW_PROFILE_SWI);
+    for (int i = 0; i < 4; i++) {
+        spin(250000);
+        span.pause();
+        usleep(1000);
+        span.resume();
+    }
+}
+
+int main() {
+    std::cout << "Starting test4.cc\n";
+    cputrace_start();
+    for (int i = 0; i < 5; i++) {
+        handoff_op();
+        suspending_op();
+    }
+    cputrace_stop();
+
+    std::cout << "\n=== Span results ===\n";
+    cputrace_dump();
+    cputrace_close();
+    std::cout << "Test4.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cputrace.h"
+
+void light_func() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_SWI | HW_PROFILE_CYC | HW_PROFILE_INS);
+    for (int i = 0; i < 100000; i++) {
+        volatile int x = i * i;
+        (void)x;
+    }
+}
+
+void heavy_func(uint64_t id) {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_SWI | HW_PROFILE_CYC | HW_PROFILE_INS);
+    profile.set_tag(id);
+    for (int i = 0; i < 20; i++) {
+        usleep(500);
+    }
+}
+
+void idle_func() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_SWI);
+    usleep(100);
+}
+
+int main() {
+    std::cout << "Starting test5.cc\n";
+    cputrace_start();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; t++) {
+        threads.emplace_back([t]() {
+            for (int i = 0; i < 10; i++) {
+                light_func();
+                heavy_func(t * 100 + i);
+                idle_func();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    struct cputrace_dump_opts opts;
+    cputrace_dump_opts_init(&opts);
+
+    std::cout << "\n=== Top 2 anchors by context switches (text, stdout fd) ===\n";
+    std::cout.flush();
+    opts.sort_by = CPUTRACE_RESULT_SWI;
+    opts.top_n = 2;
+    cputrace_dump_fd(STDOUT_FILENO, &opts);
+
+    std::cout << "\n=== All anchors with thread breakdown (JSON, FILE*) ===\n";
+    std::cout.flush();
+    opts.format = CPUTRACE_FORMAT_JSON;
+    opts.flags = CPUTRACE_DUMP_THREADS | CPUTRACE_DUMP_THREAD_NAMES;
+    opts.sort_by = CPUTRACE_SORT_CALLS;
+    opts.top_n = 0;
+    cputrace_dump_file(stdout, &opts);
+
+    std::cout << "\n=== Anchors matching 'heavy' (CSV, memory buffer) ===\n";
+    opts.format = CPUTRACE_FORMAT_CSV;
+    opts.flags = 0;
+    opts.filter = "heavy";
+    size_t len = 0;
+    char* csv = cputrace_dump_buffer(&opts, &len);
+    std::cout << csv << "(" << len << " bytes)\n";
+    free(csv);
+
+    cputrace_stop();
+    cputrace_close();
+    std::cout << "Test5.cc complete.\n";
+    return 0;
+}
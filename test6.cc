@@ -0,0 +1,59 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include "cputrace.h"
+
+static char src[4 << 20];
+static char dst[4 << 20];
+
+void write_op(size_t len) {
+    HWProfileFunctionKeyF(profile, __FUNCTION__, HW_PROFILE_CMISS | HW_PROFILE_CYC, len);
+    memcpy(dst, src, len);
+}
+
+void handle_op(const char* type) {
+    HWProfileFunctionNameF(profile, __FUNCTION__, HW_PROFILE_SWI, type);
+    usleep(type[0] == 'r' ? 100 : 300);
+}
+
+void many_keys_op(int key) {
+    HWProfileFunctionKeyF(profile, __FUNCTION__, HW_PROFILE_SWI, key);
+}
+
+int main() {
+    std::cout << "Starting test6.cc\n";
+    cputrace_start();
+
+    // Dynamic names are interned once and the pointer reused
+    const char* op_types[2];
+    for (int i = 0; i < 2; i++) {
+        std::string name = i == 0 ? "read" : "write";
+        op_types[i] = cputrace_intern(name.c_str());
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([&op_types]() {
+            for (int i = 0; i < 20; i++) {
+                write_op(i % 4 == 0 ? (4 << 20) : 4096);
+                handle_op(op_types[i % 2]);
+                handle_op("stat");
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    // More distinct keys than the table holds, the rest go to "(other)"
+    for (int i = 0; i < 40; i++) {
+        many_keys_op(i % 20);
+    }
+
+    cputrace_stop();
+    cputrace_close();
+    std::cout << "Test6.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <math.h>
+#include <linux/perf_event.h>
+#include "cputrace.h"
+
+__attribute__((noinline)) double hot_loop(int n) {
+    double x = 0;
+    for (int i = 1; i < n; i++) {
+        x += sqrt((double)i) / i;
+    }
+    return x;
+}
+
+__attribute__((noinline)) double cold_loop(int n) {
+    volatile double x = 0;
+    for (int i = 0; i < n; i++) {
+        x = x + 1;
+    }
+    return x;
+}
+
+double compute() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC | HW_PROFILE_SAMPLE);
+    return hot_loop(20000000) + cold_loop(2000000);
+}
+
+double unsampled() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_CYC);
+    return hot_loop(1000000);
+}
+
+int main() {
+    std::cout << "Starting test7.cc\n";
+    cputrace_start();
+    // Cache misses would be the usual choice; the software task clock also
+    // works where hardware events are unavailable (one sample per 100us)
+    cputrace_sampling_enable(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 100000);
+    double sum = 0;
+    for (int i = 0; i < 5; i++) {
+        sum += compute();
+        sum += unsampled();
+    }
+    cputrace_sampling_disable();
+    cputrace_stop();
+    cputrace_close();
+    std::cout << "Test7.cc complete (" << (sum > 0) << ").\n";
+    return 0;
+}
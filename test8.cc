@@ -0,0 +1,40 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "cputrace.h"
+
+// Blocks like a sync thread waiting on the disk
+void sync_wait() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_OFFCPU | HW_PROFILE_SWI);
+    usleep(2000);
+}
+
+// Pure CPU work; with more threads than cores it gets preempted
+void busy_work() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_OFFCPU);
+    for (volatile int i = 0; i < 5000000; i++) {
+    }
+}
+
+int main() {
+    std::cout << "Starting test8.cc\n";
+    cputrace_start();
+    int nthreads = 2 * std::thread::hardware_concurrency();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 10; i++) {
+                sync_wait();
+                busy_work();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    cputrace_stop();
+    cputrace_close();
+    std::cout << "Test8.cc complete.\n";
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "cputrace_ceph.h"
+
+// Ceph adapter against the stub Formatter in stub/common
+
+void kv_sync() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_SWI | HW_PROFILE_CYC);
+    usleep(500);
+}
+
+void txc_finish() {
+    HWProfileFunctionF(profile, __FUNCTION__, HW_PROFILE_INS);
+    for (volatile int i = 0; i < 100000; i++) {
+    }
+}
+
+int main() {
+    ceph::JSONFormatter f;
+    cputrace_start(&f);
+    cputrace_start(&f);
+    f.flush(std::cout);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 20; i++) {
+                kv_sync();
+                txc_finish();
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::cout << "\n=== dump ===\n";
+    cputrace_dump(&f);
+    f.flush(std::cout);
+
+    std::cout << "\n=== dump kv_sync, context_switches only, per thread ===\n";
+    cputrace_dump(&f, "kv_sync", "context_switches", true);
+    f.flush(std::cout);
+
+    cputrace_stop(&f);
+    cputrace_reset(&f);
+    cputrace_dump(&f);
+    f.flush(std::cout);
+    std::cout << "Test9.cc complete.\n";
+    return 0;
+}